@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+
+namespace Maths {
+
+/// The point at distance d along the Hilbert curve that fills a side by side grid, side being a power of two. Points
+/// that are close along the curve are close on the grid too, more so than with Morton order, which jumps across the
+/// grid at the boundaries of its quadrants.
+constexpr std::pair<std::uint32_t, std::uint32_t> hilbert_2d_point(std::uint32_t side, std::uint64_t d) noexcept {
+    std::uint32_t x = 0, y = 0;
+
+    for (std::uint32_t s = 1; s < side; s *= 2) {
+        const auto rx = static_cast<std::uint32_t>(1 & (d / 2));
+        const auto ry = static_cast<std::uint32_t>(1 & (d ^ rx));
+
+        // the quadrants at the start and at the end are rotated so that the curve goes through them without jumping
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+
+        x += s * rx;
+        y += s * ry;
+        d /= 4;
+    }
+
+    return { x, y };
+}
+
+static_assert(hilbert_2d_point(2, 0) == std::pair<std::uint32_t, std::uint32_t> { 0, 0 });
+static_assert(hilbert_2d_point(2, 1) == std::pair<std::uint32_t, std::uint32_t> { 0, 1 });
+static_assert(hilbert_2d_point(2, 2) == std::pair<std::uint32_t, std::uint32_t> { 1, 1 });
+static_assert(hilbert_2d_point(2, 3) == std::pair<std::uint32_t, std::uint32_t> { 1, 0 });
+static_assert(hilbert_2d_point(4, 15) == std::pair<std::uint32_t, std::uint32_t> { 3, 0 });
+
+}
@@ -245,6 +245,25 @@ template<typename T, size_t n> constexpr Matrix<T, n, n> identity_matrix() noexc
     return mat;
 }
 
+/// The inverse of an invertible 3x3 matrix, through its adjugate
+template<typename T> constexpr Matrix<T, 3, 3> inverse(const Matrix<T, 3, 3> &m) noexcept {
+    Matrix<T, 3, 3> adjugate {};
+    for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; j < 3; j++) {
+            const size_t r_0 = (j + 1) % 3, r_1 = (j + 2) % 3;
+            const size_t c_0 = (i + 1) % 3, c_1 = (i + 2) % 3;
+            adjugate.at(i, j) = m.at(r_0, c_0) * m.at(r_1, c_1) - m.at(r_0, c_1) * m.at(r_1, c_0);
+        }
+    }
+
+    const T determinant
+        = m.at(0, 0) * adjugate.at(0, 0) + m.at(0, 1) * adjugate.at(1, 0) + m.at(0, 2) * adjugate.at(2, 0);
+    for (auto &v : adjugate.m_impl)
+        v /= determinant;
+
+    return adjugate;
+}
+
 //////////////////////////////////////
 //// Element-wise unary operators ////
 //////////////////////////////////////
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+
+namespace Maths {
+
+/// Spreads the lower 10 bits of v so that there are two zero bits between each
+constexpr std::uint32_t morton_expand_10(std::uint32_t v) noexcept {
+    v &= 0x3FFu;
+    v = (v | (v << 16)) & 0x030000FFu;
+    v = (v | (v << 8)) & 0x0300F00Fu;
+    v = (v | (v << 4)) & 0x030C30C3u;
+    v = (v | (v << 2)) & 0x09249249u;
+    return v;
+}
+
+/// 30 bit Morton code of a point on a 1024^3 grid, x being the most significant
+constexpr std::uint32_t morton_3d(std::uint32_t x, std::uint32_t y, std::uint32_t z) noexcept {
+    return (morton_expand_10(x) << 2) | (morton_expand_10(y) << 1) | morton_expand_10(z);
+}
+
+/// Spreads the lower 21 bits of v so that there are two zero bits between each
+constexpr std::uint64_t morton_expand_21(std::uint64_t v) noexcept {
+    v &= 0x1FFFFFu;
+    v = (v | (v << 32)) & 0x001F00000000FFFFull;
+    v = (v | (v << 16)) & 0x001F0000FF0000FFull;
+    v = (v | (v << 8)) & 0x100F00F00F00F00Full;
+    v = (v | (v << 4)) & 0x10C30C30C30C30C3ull;
+    v = (v | (v << 2)) & 0x1249249249249249ull;
+    return v;
+}
+
+/// 63 bit Morton code of a point on a 2097152^3 grid, x being the most significant
+constexpr std::uint64_t morton_3d_63(std::uint64_t x, std::uint64_t y, std::uint64_t z) noexcept {
+    return (morton_expand_21(x) << 2) | (morton_expand_21(y) << 1) | morton_expand_21(z);
+}
+
+static_assert(morton_3d(1, 0, 0) == 4 && morton_3d(0, 1, 0) == 2 && morton_3d(0, 0, 1) == 1);
+static_assert(morton_3d(1023, 1023, 1023) == (1u << 30) - 1);
+static_assert(morton_3d_63(1, 2, 3) == 0b011'101);
+static_assert(morton_3d_63(0x1FFFFF, 0x1FFFFF, 0x1FFFFF) == (1ull << 63) - 1);
+
+}
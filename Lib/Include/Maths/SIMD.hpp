@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+
+namespace Maths {
+
+/// GCC/Clang vector extension types of Width Ts. GCC drops vector_size attributes that depend on template parameters,
+/// hence the specialisations.
+template<typename T, std::size_t Width> struct SIMD;
+
+template<> struct SIMD<float, 4> {
+    typedef float type __attribute__((vector_size(sizeof(float) * 4)));
+};
+
+template<> struct SIMD<float, 8> {
+    typedef float type __attribute__((vector_size(sizeof(float) * 8)));
+};
+
+template<> struct SIMD<double, 4> {
+    typedef double type __attribute__((vector_size(sizeof(double) * 4)));
+};
+
+template<> struct SIMD<double, 8> {
+    typedef double type __attribute__((vector_size(sizeof(double) * 8)));
+};
+
+template<typename T, std::size_t Width> using simd_t = typename SIMD<T, Width>::type;
+
+template<typename V> constexpr V simd_min(V lhs, V rhs) noexcept { return lhs < rhs ? lhs : rhs; }
+
+template<typename V> constexpr V simd_max(V lhs, V rhs) noexcept { return lhs > rhs ? lhs : rhs; }
+
+/// Whether any lane of a comparison result is set
+template<typename M> constexpr bool simd_any(M mask) noexcept {
+    for (std::size_t lane = 0; lane < sizeof(M) / sizeof(mask[0]); lane++)
+        if (mask[lane])
+            return true;
+    return false;
+}
+
+}
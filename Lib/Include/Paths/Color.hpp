@@ -7,7 +7,12 @@
 
 namespace Paths {
 
+/// Colours and their accumulation stay double precision with PATHS_DOUBLE_COLOR even if geometry is single precision
+#ifdef PATHS_DOUBLE_COLOR
+using ColorChannelType = double;
+#else
 using ColorChannelType = Real;
+#endif
 using Color = Maths::Vector<ColorChannelType, 3>;
 
 }
\ No newline at end of file
@@ -12,11 +12,12 @@
 #    include <cassert>
 #endif
 
+#include <algorithm>
 #include <cmath>
-#include <thread>
 
 #include "Maths/Matrix.hpp"
 #include "Maths/Vector.hpp"
+#include "Utils/ThreadPool.hpp"
 
 namespace Paths {
 
@@ -39,20 +40,35 @@ template<typename... Ts> inline void do_assert(bool b, fmt::format_string<Ts...>
 namespace ProgramConfig {
 
 static constexpr const bool single_thread = false;
-static constexpr const bool default_spin = true;
 
 static constexpr const bool embed_ray_stats = true;
 
-static const size_t preferred_thread_count = single_thread ? 1 : std::thread::hardware_concurrency();
+/// Triangles get tested with the watertight test of Woop et al., which never lets rays through the edges shared by
+/// neighbouring triangles, instead of Möller–Trumbore
+static constexpr const bool watertight_triangles = true;
 
+/// The number of threads of the pool that rendering, averaging, exporting and building hierarchies all share, see
+/// Utils::ThreadPool::global()
+[[nodiscard]] inline std::size_t preferred_thread_count() noexcept {
+    return single_thread ? 1 : Utils::ThreadPool::global().thread_count();
 }
 
+}
+
+/// PATHS_SINGLE_PRECISION makes geometry (points, rays, shapes and the hierarchies over them) single precision, which
+/// doubles the SIMD width of the hierarchies and halves the memory they take. See Color.hpp for colours.
+#ifdef PATHS_SINGLE_PRECISION
+using Real = float;
+#else
 using Real = std::double_t;
+#endif
 
 static constexpr Real inf = std::numeric_limits<Real>::infinity();
 static constexpr Real eps = std::numeric_limits<Real>::epsilon();
 static constexpr Real sensible_inf = static_cast<Real>(16777215); // 2^24-1
-static constexpr Real sensible_eps = static_cast<Real>(1e-7);
+/// Distances and determinants at or below this are treated as zero. 1e-7 in double precision, a few ulps of 1 in
+/// single precision where 1e-7 is below the resolution of the distances next to 1.
+static constexpr Real sensible_eps = std::max(static_cast<Real>(1e-7), 8 * eps);
 
 using Point = Maths::Vector<Real, 3>;
 static constexpr Point epsilon_point({ sensible_eps, sensible_eps, sensible_eps });
@@ -5,7 +5,7 @@
 #include "Paths/Image/Image.hpp"
 #include "Paths/Ray.hpp"
 #include "Paths/Scene/Scene.hpp"
-#include "Utils/WorkerPool.hpp"
+#include "Utils/Parallel.hpp"
 
 namespace Paths {
 
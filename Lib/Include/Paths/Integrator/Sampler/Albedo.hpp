@@ -9,7 +9,8 @@ public:
     ~AlbedoIntegrator() noexcept override = default;
 
 protected:
-    [[nodiscard]] Color sample(Ray ray, Scene &scene) const noexcept override;
+    [[nodiscard]] Color sample_hit(
+        Ray ray, const std::optional<Intersection> &isection, Scene &scene) const noexcept override;
 };
 
 }
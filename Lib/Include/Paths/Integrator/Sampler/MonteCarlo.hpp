@@ -11,7 +11,8 @@ public:
     void add_dot_light(Point p, Point color) noexcept { m_dot_lights.push_back({ p, color }); }
 
 protected:
-    [[nodiscard]] Color sample(Ray ray, Scene &scene) const noexcept override;
+    [[nodiscard]] Color sample_hit(
+        Ray ray, const std::optional<Intersection> &first_isection, Scene &scene) const noexcept override;
 
 private:
     struct DotLight {
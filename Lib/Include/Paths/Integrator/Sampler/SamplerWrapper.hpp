@@ -1,76 +1,182 @@
 #pragma once
 
+#include <chrono>
+#include <numeric>
+
+#include "Maths/Hilbert.hpp"
 #include "Paths/Integrator/Integrator.hpp"
+#include "Utils/Parallel.hpp"
 
 namespace Paths {
 
+/// Renders the image in square tiles which are handed out to the threads in the order of a Hilbert curve. Every thread
+/// starts with a contiguous stretch of the curve and steals from the ends of the others' once done with its own, so
+/// tiles that take long (e.g. the ones over detailed geometry) do not leave the other threads idle.
 class SamplerWrapperIntegrator : public Integrator {
 public:
-    SamplerWrapperIntegrator() { start_threads(); }
+    /// Accumulated over the renders since the camera was last set
+    struct TileStatistics {
+        std::size_t m_renders = 0;
+        std::size_t m_tiles = 0;
+        std::size_t m_steals = 0;
+        Real m_slowest_tile_seconds = 0;
+        Real m_render_seconds = 0;
+
+        /// The time every thread spent in tiles
+        std::vector<Real> m_thread_seconds {};
+
+        /// The fraction of the time that the threads spent not working on tiles
+        [[nodiscard]] Real idle_fraction() const noexcept {
+            const auto total = m_render_seconds * static_cast<Real>(m_thread_seconds.size());
+            const auto busy = std::accumulate(m_thread_seconds.begin(), m_thread_seconds.end(), static_cast<Real>(0));
+            return total > 0 ? 1 - busy / total : 0;
+        }
+    };
 
-    ~SamplerWrapperIntegrator() noexcept override {
-        m_renderer_pool.close();
-        if (m_renderer_thread.joinable())
-            m_renderer_thread.join();
-    }
+    SamplerWrapperIntegrator() = default;
+
+    ~SamplerWrapperIntegrator() noexcept override = default;
 
     void set_camera(Camera c) noexcept override {
         m_camera = c;
         m_camera.prepare();
         m_back_buffer.resize(c.m_resolution[0], c.m_resolution[1]);
+
+        const auto tiles_x = (c.m_resolution[0] + m_tile_side - 1) / m_tile_side;
+        const auto tiles_y = (c.m_resolution[1] + m_tile_side - 1) / m_tile_side;
+
+        std::uint32_t side = 1;
+        while (side < std::max(tiles_x, tiles_y))
+            side *= 2;
+
+        m_tiles.clear();
+        m_tiles.reserve(tiles_x * tiles_y);
+        for (std::uint64_t d = 0; d < static_cast<std::uint64_t>(side) * side; d++)
+            if (const auto tile = Maths::hilbert_2d_point(side, d); tile.first < tiles_x && tile.second < tiles_y)
+                m_tiles.push_back(tile);
+
+        m_tile_seconds.resize(m_tiles.size());
+        m_tile_times.resize(tiles_x, tiles_y);
+        reset_tile_statistics();
     }
 
     void set_scene(Scene *s) noexcept override { m_scene = s; }
 
     void do_render() noexcept override {
-        m_renderer_pool.split_work(
-            m_camera.m_resolution[1], ProgramConfig::preferred_thread_count, [this](size_t start, size_t end) {
-                return WorkItem {
-                    .m_self = *this,
-                    .m_start = start,
-                    .m_end = end,
-                };
+        const auto n_threads = ProgramConfig::preferred_thread_count();
+        m_ray_scratch.resize(n_threads);
+        m_tile_statistics.m_thread_seconds.resize(n_threads);
+
+        const auto start_time = std::chrono::steady_clock::now();
+
+        const auto steals = Utils::parallel_for_stealing(
+            m_tiles.size(), n_threads, [this](std::size_t thread, std::size_t i) {
+                const auto tile_start = std::chrono::steady_clock::now();
+                integrate_tile(thread, m_tiles[i].first * m_tile_side, m_tiles[i].second * m_tile_side);
+                const std::chrono::duration<Real> tile_time = std::chrono::steady_clock::now() - tile_start;
+
+                m_tile_seconds[i] = tile_time.count();
+                m_tile_statistics.m_thread_seconds[thread] += tile_time.count();
             });
-        m_renderer_pool.wg_wait();
+
+        const std::chrono::duration<Real> render_time = std::chrono::steady_clock::now() - start_time;
+
+        for (std::size_t i = 0; i < m_tiles.size(); i++) {
+            const auto seconds = static_cast<ColorChannelType>(m_tile_seconds[i]);
+            auto &total = m_tile_times.at(m_tiles[i].first, m_tiles[i].second);
+            total = total + Color(seconds, seconds, seconds);
+            m_tile_statistics.m_slowest_tile_seconds
+                = std::max(m_tile_statistics.m_slowest_tile_seconds, m_tile_seconds[i]);
+        }
+
+        m_tile_statistics.m_renders++;
+        m_tile_statistics.m_tiles += m_tiles.size();
+        m_tile_statistics.m_steals += steals;
+        m_tile_statistics.m_render_seconds += render_time.count();
     }
 
     [[nodiscard]] Image::ImageView get_image() noexcept override {
         return static_cast<Image::ImageView>(m_back_buffer);
     }
 
+    [[nodiscard]] const TileStatistics &get_tile_statistics() const noexcept { return m_tile_statistics; }
+
+    /// The seconds spent on every tile summed over the renders, a pixel per tile
+    [[nodiscard]] Image::ImageView get_tile_times() const noexcept {
+        return static_cast<Image::ImageView>(m_tile_times);
+    }
+
+    void reset_tile_statistics() noexcept {
+        m_tile_statistics = {};
+        m_tile_times.fill(static_cast<ColorChannelType>(0));
+    }
+
 protected:
-    [[nodiscard]] virtual Color sample(Ray, Scene &) const noexcept { return {}; };
+    /// Samples a camera ray, by default by finding its closest hit and handing that to sample_hit
+    [[nodiscard]] virtual Color sample(Ray ray, Scene &scene) const noexcept {
+        std::size_t bound_checks = 0, shape_checks = 0;
+        return sample_hit(ray, scene.intersect_ray(ray, bound_checks, shape_checks), scene);
+    }
+
+    /// Samples a camera ray whose closest hit is already known
+    [[nodiscard]] virtual Color sample_hit(Ray, const std::optional<Intersection> &, Scene &) const noexcept {
+        return {};
+    }
+
+    /// If set, camera rays are traced in packets of tiles and sample_hit is called with their closest hits instead of
+    /// sample. Samplers that override sample should unset this.
+    bool m_trace_packets = true;
 
 private:
     Scene *m_scene { nullptr };
     Camera m_camera {};
     Image::Image<> m_back_buffer {};
 
-    struct WorkItem {
-        SamplerWrapperIntegrator &m_self;
-        std::size_t m_start, m_end;
-    };
+    /// Packets are tiles, which are squares of this side
+    static constexpr std::size_t m_tile_side = 8;
+    static_assert(m_tile_side * m_tile_side <= ShapeStore::m_packet_size);
 
-    static void worker_fn(WorkItem &&item) noexcept {
-        for (std::size_t i = item.m_start; i < item.m_end; i++)
-            item.m_self.integrate_line(i);
-    }
+    /// The tiles in the order of the Hilbert curve, in tiles
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> m_tiles {};
 
-    std::thread m_renderer_thread;
-    Utils::WorkerPoolWaitGroup<decltype(&SamplerWrapperIntegrator::worker_fn), WorkItem, ProgramConfig::default_spin>
-        m_renderer_pool { &SamplerWrapperIntegrator::worker_fn, ProgramConfig::preferred_thread_count };
+    /// Of the last render, in the order of m_tiles
+    std::vector<Real> m_tile_seconds {};
 
-    void start_threads() {
-        m_renderer_thread = std::thread([this] { m_renderer_pool.do_work(ProgramConfig::preferred_thread_count); });
-        // bufferCopyThread = std::thread([this] { btfWorkerPool.Work(preferredThreadCount); });
-    }
+    TileStatistics m_tile_statistics {};
+    Image::Image<> m_tile_times {};
+
+    /// The rays of the packets of every thread
+    std::vector<std::vector<Ray>> m_ray_scratch {};
+
+    /// Integrates the tile whose top left pixel is at (x_start, y_start), in a packet if m_trace_packets is set
+    void integrate_tile(std::size_t thread, std::size_t x_start, std::size_t y_start) noexcept {
+        const auto x_end = std::min(x_start + m_tile_side, m_camera.m_resolution[0]);
+        const auto y_end = std::min(y_start + m_tile_side, m_camera.m_resolution[1]);
+
+        if (!m_trace_packets) {
+            for (std::size_t y = y_start; y < y_end; y++)
+                for (std::size_t x = x_start; x < x_end; x++)
+                    m_back_buffer.at(x, y) = sample(m_camera.make_ray(x, y), *m_scene);
+            return;
+        }
+
+        auto &rays = m_ray_scratch[thread];
+        std::array<std::optional<Intersection>, ShapeStore::m_packet_size> isects;
+        std::size_t bound_checks = 0, shape_checks = 0;
+
+        rays.clear();
+        for (std::size_t y = y_start; y < y_end; y++)
+            for (std::size_t x = x_start; x < x_end; x++)
+                rays.push_back(m_camera.make_ray(x, y));
+
+        m_scene->intersect_packet(rays, std::span(isects).first(rays.size()), bound_checks, shape_checks);
 
-    void integrate_line(std::size_t y) noexcept {
-        for (std::size_t x = 0; x < m_camera.m_resolution[0]; x++) {
-            const auto ray = m_camera.make_ray(x, y);
-            m_back_buffer.at(x, y) = sample(ray, *m_scene);
+        for (std::size_t i = 0; i < rays.size(); i++) {
+            const auto x = x_start + i % (x_end - x_start);
+            const auto y = y_start + i / (x_end - x_start);
+            m_back_buffer.at(x, y) = sample_hit(rays[i], isects[i], *m_scene);
         }
     }
 };
 
-}
\ No newline at end of file
+}
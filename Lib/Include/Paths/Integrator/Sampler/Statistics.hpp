@@ -6,6 +6,9 @@ namespace Paths {
 
 class StatVisualiserIntegrator : public SamplerWrapperIntegrator {
 public:
+    /// The traversal statistics are per ray, so camera rays are not traced in packets
+    StatVisualiserIntegrator() { m_trace_packets = false; }
+
     ~StatVisualiserIntegrator() override = default;
 
 protected:
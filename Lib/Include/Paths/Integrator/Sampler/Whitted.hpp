@@ -11,12 +11,16 @@ public:
     void add_dot_light(Point p, Point color) noexcept { m_dot_lights.push_back({ p, color }); }
 
 protected:
-    [[nodiscard]] Color sample(Ray ray, Scene &scene) const noexcept override;
+    [[nodiscard]] Color sample_hit(
+        Ray ray, const std::optional<Intersection> &isection, Scene &scene) const noexcept override;
 
 private:
     [[nodiscard]] Color sample_impl(
         Ray ray, Scene &scene, std::size_t depth, std::size_t &bound_checks, std::size_t &shape_checks) const noexcept;
 
+    [[nodiscard]] Color shade(Ray ray, const std::optional<Intersection> &isection, Scene &scene, std::size_t depth,
+        std::size_t &bound_checks, std::size_t &shape_checks) const noexcept;
+
     struct DotLight {
         Point m_position;
         Point m_emission;
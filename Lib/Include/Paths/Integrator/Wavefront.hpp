@@ -0,0 +1,124 @@
+#pragma once
+
+#include "Integrator.hpp"
+
+namespace Paths {
+
+/// A path tracer that advances all of its paths one bounce at a time instead of tracing them to completion one by one.
+/// The paths are kept in queues which go through the roulette, extend and shade stages, each stage being a batched pass
+/// over the whole queue, until no path is left.
+class WavefrontIntegrator final : public Integrator {
+public:
+    /// Images with more pixels than this are rendered in multiple waves
+    static constexpr std::size_t m_max_wave_size = 1 << 18;
+
+    /// Accumulated over the extension of secondary rays, the ones that sort_rays affects
+    struct RayStatistics {
+        std::size_t m_rays = 0;
+        std::size_t m_bound_checks = 0;
+        std::size_t m_shape_checks = 0;
+        /// Only counted while the node cache is modelled, see set_model_node_cache
+        std::size_t m_node_fetches = 0;
+        std::size_t m_node_misses = 0;
+        Real m_sort_seconds = 0;
+        Real m_extend_seconds = 0;
+
+        /// Including the time spent sorting
+        [[nodiscard]] Real mrays_per_second() const noexcept {
+            const auto seconds = m_sort_seconds + m_extend_seconds;
+            return seconds > 0 ? static_cast<Real>(m_rays) / seconds / 1'000'000 : 0;
+        }
+
+        /// 0 if no rays were traced
+        [[nodiscard]] Real bound_checks_per_ray() const noexcept {
+            return m_rays > 0 ? static_cast<Real>(m_bound_checks) / static_cast<Real>(m_rays) : 0;
+        }
+
+        /// Unlike bound checks per ray this depends on the order the rays are traced in, 0 if no rays were traced
+        [[nodiscard]] Real node_misses_per_ray() const noexcept {
+            return m_rays > 0 ? static_cast<Real>(m_node_misses) / static_cast<Real>(m_rays) : 0;
+        }
+    };
+
+    /// \param sort_rays Whether to sort the secondary rays by their major directions and the Morton codes of their
+    /// origins before every extension, so that neighbouring rays are likely to visit the same nodes. They are still
+    /// traced one by one, secondary rays diverge too quickly for packets to pay off even when sorted.
+    explicit WavefrontIntegrator(bool sort_rays = false)
+        : m_sort_rays(sort_rays) { }
+
+    ~WavefrontIntegrator() noexcept override = default;
+
+    void set_camera(Camera c) noexcept override;
+
+    void set_scene(Scene *s) noexcept override { m_scene = s; }
+
+    void do_render() noexcept override;
+
+    [[nodiscard]] Image::ImageView get_image() noexcept override {
+        return static_cast<Image::ImageView>(m_back_buffer);
+    }
+
+    [[nodiscard]] const RayStatistics &get_ray_statistics() const noexcept { return m_ray_statistics; }
+
+    void reset_ray_statistics() noexcept { m_ray_statistics = {}; }
+
+    /// Whether secondary rays are traced through a BVH::NodeCacheModel per thread, which slows their extension down
+    void set_model_node_cache(bool model) noexcept { m_model_node_cache = model; }
+
+    /// Everything about a path but its next ray
+    struct PathState {
+        Color m_radiance { 0, 0, 0 };
+        Color m_throughput { 1, 1, 1 };
+        Real m_previous_cosine = 1;
+        std::uint32_t m_pixel = 0;
+        std::uint32_t m_depth = 0;
+        bool m_alive = true;
+    };
+
+    /// The buffers of sort_queue, kept between calls so that they are not reallocated every time
+    struct SortScratch {
+        std::vector<std::pair<std::uint64_t, std::uint32_t>> m_keys {};
+        std::vector<Ray> m_rays {};
+        std::vector<PathState> m_paths {};
+    };
+
+    /// Reorders the rays by their major directions and then by the Morton codes of their origins, paths[i] stays with
+    /// rays[i]
+    static void sort_queue(std::vector<Ray> &rays, std::vector<PathState> &paths, SortScratch &scratch) noexcept;
+
+private:
+    bool m_sort_rays;
+    bool m_model_node_cache = false;
+    RayStatistics m_ray_statistics {};
+
+    Scene *m_scene { nullptr };
+    Camera m_camera {};
+    Image::Image<> m_back_buffer {};
+
+    /// Pixel indices in the order of 8x8 tiles, so that consecutive camera rays are coherent
+    std::vector<std::uint32_t> m_pixel_order {};
+
+    // the queues, the ith elements of which belong to the same path
+    std::vector<Ray> m_rays {};
+    std::vector<PathState> m_paths {};
+    std::vector<std::optional<Intersection>> m_hits {};
+
+    SortScratch m_sort_scratch {};
+
+    void generate(std::size_t start, std::size_t end) noexcept;
+
+    /// Terminates long paths at random
+    void roulette() noexcept;
+
+    /// Finds the closest hits of the rays of the paths, in packets if the rays are known to be coherent. Adds to the
+    /// checks and the node cache counts of stats.
+    void extend(bool coherent, bool model_node_cache, RayStatistics &stats) noexcept;
+
+    /// Accumulates the emission at the hits and spawns the next rays, terminates the paths that missed
+    void shade() noexcept;
+
+    /// Writes the terminated paths into the image and removes them from the queues
+    void retire() noexcept;
+};
+
+}
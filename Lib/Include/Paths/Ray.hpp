@@ -1,5 +1,7 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <optional>
 
 #include "Common.hpp"
@@ -24,6 +26,31 @@ static constexpr EMajorAxis get_major_direction(const Point &direction) noexcept
     return static_cast<EMajorAxis>(static_cast<std::size_t>(direction[major_axis] < 0) + major_axis * 2);
 }
 
+/// What the watertight triangle test needs of a ray, see Woop et al., "Watertight Ray/Triangle Intersection". The axis
+/// that the ray goes along the most becomes z, the other two get sheared so that the ray goes straight along z.
+struct RayShear {
+    /// The axes that become x, y and z, in that order
+    std::array<std::uint8_t, 3> m_axes;
+
+    /// How much x and y get sheared by z, and how much z gets scaled by
+    Point m_shear;
+};
+
+static constexpr RayShear get_ray_shear(const Point &direction, EMajorAxis major_direction) noexcept {
+    const auto z = static_cast<std::uint8_t>(static_cast<int>(major_direction) / 2);
+    auto x = static_cast<std::uint8_t>((z + 1) % 3);
+    auto y = static_cast<std::uint8_t>((x + 1) % 3);
+
+    // keeps the winding of triangles the same after the axes get swapped around
+    if (direction[z] < 0)
+        std::swap(x, y);
+
+    return {
+        .m_axes = { x, y, z },
+        .m_shear = { direction[x] / direction[z], direction[y] / direction[z], static_cast<Real>(1) / direction[z] },
+    };
+}
+
 }
 
 struct Ray {
@@ -31,12 +58,14 @@ struct Ray {
         : m_origin(origin)
         , m_direction(direction)
         , m_direction_reciprocals(Maths::reciprocal(direction))
-        , m_major_direction(Detail::get_major_direction(direction)) { }
+        , m_major_direction(Detail::get_major_direction(direction))
+        , m_shear(Detail::get_ray_shear(direction, m_major_direction)) { }
 
     Point m_origin;
     Point m_direction;
     Point m_direction_reciprocals;
     Detail::EMajorAxis m_major_direction;
+    Detail::RayShear m_shear;
 };
 
 /*
@@ -98,6 +127,29 @@ static constexpr Point refract_vector(Point vec, Point normal, Real r) noexcept
     return vec * r + normal * (r * c - std::sqrt(1 - r * r * (1 - c * c)));
 }
 
+/// The bound of the relative error of n floating point operations, from Pharr et al., "Physically Based Rendering",
+/// 3.9.1
+static constexpr Real error_gamma(int n) noexcept { return (n * eps / 2) / (1 - n * eps / 2); }
+
+/// Moves a point on a surface off of it along n, out of the box around p that the surface might really be in, so that
+/// rays starting there do not hit the surface again. The distance grows with the error of p instead of being fixed, as
+/// in Pharr et al., "Physically Based Rendering", 3.9.5.
+/// \param error The bound of the absolute error of every coordinate of p
+/// \param n The oriented normal at p, pointing to where the rays will go
+static inline Point offset_ray_origin(Point p, Point error, Point n) noexcept {
+    const Point offset = n * Maths::dot(Maths::abs(n), error);
+
+    Point ret = p + offset;
+    for (std::size_t axis = 0; axis < 3; axis++) {
+        // the addition might have rounded back towards the surface
+        if (offset[axis] > 0)
+            ret[axis] = std::nextafter(ret[axis], inf);
+        else if (offset[axis] < 0)
+            ret[axis] = std::nextafter(ret[axis], -inf);
+    }
+    return ret;
+}
+
 ///
 /// \param light The position of the light
 /// \param intersection The point of ray-surface intersection
@@ -130,6 +182,7 @@ struct Intersection {
         : m_mat_index(mat_index)
         , m_distance(distance)
         , m_intersection_point(ray.m_origin + ray.m_direction * distance)
+        , m_error((Maths::abs(ray.m_origin) + Maths::abs(ray.m_direction * distance)) * Detail::error_gamma(7))
         , m_normal(normal)
         , m_going_in(Maths::dot(normal, ray.m_direction) < 0)
         , m_oriented_normal(m_going_in ? normal : -normal)
@@ -140,12 +193,21 @@ struct Intersection {
     Real m_distance {};
     Point m_intersection_point;
 
+    /// The bound of the absolute error of m_intersection_point. Shapes that do not know any better leave it at what
+    /// going along the ray with a distance that is off by a few ulps gives.
+    Point m_error;
+
     Point m_normal {};
     bool m_going_in {};
     Point m_oriented_normal {};
 
     Maths::Vector<Real, 2> m_uv { 0, 0 };
 
+    /// Where rays leaving the surface on the side the ray came from should start, see Detail::offset_ray_origin
+    [[nodiscard]] Point offset_origin() const noexcept {
+        return Detail::offset_ray_origin(m_intersection_point, m_error, m_oriented_normal);
+    }
+
     static constexpr bool replace(std::optional<Intersection> &old, std::optional<Intersection> &&with) noexcept {
         if (with && (!old || ((with->m_distance < old->m_distance) && with->m_distance > 0))) {
             old.operator=(std::forward<Intersection &&>(*with));
@@ -158,4 +220,19 @@ struct Intersection {
 static_assert(std::is_trivially_copyable_v<Intersection>);
 static_assert(std::is_trivially_destructible_v<Intersection>);
 
+/// What closest hit traversals carry around instead of an Intersection, which gets completed only for the closest hit
+struct Hit {
+    static constexpr std::uint32_t m_npos = std::numeric_limits<std::uint32_t>::max();
+
+    Real m_distance = inf;
+
+    /// Which primitive of the store got hit, what this indexes into is up to the store. m_npos if nothing got hit
+    std::uint32_t m_primitive = m_npos;
+
+    /// Only used by triangles and parallelograms
+    Maths::Vector<Real, 2> m_barycentrics { 0, 0 };
+};
+
+static_assert(std::is_trivially_copyable_v<Hit>);
+
 }
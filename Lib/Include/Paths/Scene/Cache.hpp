@@ -0,0 +1,249 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "TBVH.hpp"
+#include "ThinBVH.hpp"
+
+namespace Paths::BVH::Cache {
+
+/// Has to be bumped whenever the layout of anything that gets cached changes, caches of other versions are ignored
+static constexpr std::uint32_t format_version = 4;
+
+/// 64 bit FNV-1a, for telling inputs apart and not for security
+struct Hasher {
+    std::uint64_t m_state = 0xcbf29ce484222325;
+
+    void add_bytes(std::span<const std::byte> bytes) noexcept {
+        for (const auto byte : bytes) {
+            m_state ^= static_cast<std::uint64_t>(byte);
+            m_state *= 0x100000001b3;
+        }
+    }
+
+    template<typename T> requires std::is_trivially_destructible_v<T> void add(const T &value) noexcept {
+        add_bytes(std::as_bytes(std::span(&value, 1)));
+    }
+
+    void add(std::string_view str) noexcept {
+        add(str.size());
+        add_bytes(std::as_bytes(std::span(str.data(), str.size())));
+    }
+};
+
+/// The hash of the contents of a file, std::nullopt if it cannot be read
+extern std::optional<std::uint64_t> hash_file(const std::string &path) noexcept;
+
+/// A read only mapping of a whole file
+class MappedFile {
+public:
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile(MappedFile &&other) noexcept
+        : m_data(std::exchange(other.m_data, nullptr))
+        , m_size(std::exchange(other.m_size, 0)) { }
+
+    ~MappedFile() noexcept;
+
+    [[nodiscard]] static std::optional<MappedFile> open(const std::string &path) noexcept;
+
+    [[nodiscard]] std::span<const std::byte> data() const noexcept {
+        return { static_cast<const std::byte *>(m_data), m_size };
+    }
+
+private:
+    MappedFile(void *data, std::size_t size) noexcept
+        : m_data(data)
+        , m_size(size) { }
+
+    void *m_data = nullptr;
+    std::size_t m_size = 0;
+};
+
+/// Values that are written byte by byte. Their types must not have padding either, or the padding bytes end up in
+/// the file and caches of the same store stop being identical. Types with padding get a serialise member instead.
+template<typename T>
+concept Bitwise = std::is_trivially_copyable_v<T> && std::is_default_constructible_v<T>;
+
+template<typename T, typename Archive>
+concept Serialisable = requires(T &value, Archive &archive) { value.serialise(archive); };
+
+/// Appends values to a buffer. Stores describe what they consist of with a serialise(archive) member function which
+/// calls archive(member) for their members, the same function is used with a Reader to load them.
+class Writer {
+public:
+    /// Arrays start at multiples of this many bytes from the start of the file
+    static constexpr std::size_t m_alignment = 64;
+
+    template<typename T> void operator()(const T &value) {
+        if constexpr (Serialisable<T, Writer>) {
+            const_cast<T &>(value).serialise(*this);
+        } else {
+            static_assert(Bitwise<T>);
+            append(std::as_bytes(std::span(&value, 1)));
+        }
+    }
+
+    template<typename T, typename U> void operator()(const std::pair<T, U> &value) {
+        operator()(value.first);
+        operator()(value.second);
+    }
+
+    /// Arrays of Bitwise values are written in one go, others value by value
+    template<typename T> void operator()(const std::vector<T> &values) {
+        operator()(static_cast<std::uint64_t>(values.size()));
+        m_buffer.resize((m_buffer.size() + m_alignment - 1) / m_alignment * m_alignment);
+
+        if constexpr (Serialisable<T, Writer>) {
+            for (const auto &value : values)
+                operator()(value);
+        } else {
+            static_assert(Bitwise<T>);
+            append(std::as_bytes(std::span(values)));
+        }
+    }
+
+    [[nodiscard]] std::span<const std::byte> data() const noexcept { return m_buffer; }
+
+    /// Writes to a temporary file which then replaces the one at path, so that readers never see half written caches
+    [[nodiscard]] bool write_to(const std::string &path) const noexcept;
+
+private:
+    std::vector<std::byte> m_buffer {};
+
+    void append(std::span<const std::byte> bytes) { m_buffer.insert(m_buffer.end(), bytes.begin(), bytes.end()); }
+};
+
+/// Reads what a Writer wrote into the members of the stores. Nothing is used in place, arrays of Bitwise values are
+/// copied out of the mapping with a single memcpy each.
+class Reader {
+public:
+    explicit Reader(std::span<const std::byte> data) noexcept
+        : m_data(data) { }
+
+    template<typename T> void operator()(T &value) {
+        if constexpr (Serialisable<T, Reader>) {
+            value.serialise(*this);
+        } else {
+            static_assert(Bitwise<T>);
+            read(std::as_writable_bytes(std::span(&value, 1)));
+        }
+    }
+
+    template<typename T, typename U> void operator()(std::pair<T, U> &value) {
+        operator()(value.first);
+        operator()(value.second);
+    }
+
+    template<typename T> void operator()(std::vector<T> &values) {
+        std::uint64_t size = 0;
+        operator()(size);
+        m_offset = (m_offset + Writer::m_alignment - 1) / Writer::m_alignment * Writer::m_alignment;
+
+        // every value takes up at least a byte, which keeps corrupt sizes from allocating
+        const std::size_t min_value_size = Serialisable<T, Reader> ? 1 : sizeof(T);
+        if (m_failed || size > (m_data.size() - std::min(m_offset, m_data.size())) / min_value_size) {
+            m_failed = true;
+            return;
+        }
+
+        values.resize(size);
+        if constexpr (Serialisable<T, Reader>) {
+            for (auto &value : values)
+                operator()(value);
+        } else {
+            static_assert(Bitwise<T>);
+            read(std::as_writable_bytes(std::span(values)));
+        }
+    }
+
+    /// Whether everything read so far was there
+    [[nodiscard]] bool ok() const noexcept { return !m_failed; }
+
+    [[nodiscard]] bool at_end() const noexcept { return m_offset == m_data.size(); }
+
+private:
+    std::span<const std::byte> m_data;
+    std::size_t m_offset = 0;
+    bool m_failed = false;
+
+    void read(std::span<std::byte> bytes) noexcept {
+        if (m_failed || m_offset + bytes.size() > m_data.size()) {
+            m_failed = true;
+            return;
+        }
+        std::memcpy(bytes.data(), m_data.data() + m_offset, bytes.size());
+        m_offset += bytes.size();
+    }
+};
+
+/// Tells apart the kinds of stores and the layouts that they depend on in the headers of the caches
+template<typename Store> struct StoreType;
+
+template<> struct StoreType<Detail::ThinBVHTree<Shape::Triangle>> {
+    static constexpr std::uint32_t m_id = 1;
+};
+
+template<> struct StoreType<Detail::ThreadedBVH<Shape::Triangle, false>> {
+    static constexpr std::uint32_t m_id = 2;
+};
+
+template<> struct StoreType<Detail::ThreadedBVH<Shape::Triangle, true>> {
+    static constexpr std::uint32_t m_id = 3;
+};
+
+struct Header {
+    static constexpr std::array<char, 8> m_expected_magic { 'P', 'A', 'T', 'H', 'S', 'B', 'V', 'H' };
+
+    std::array<char, 8> m_magic = m_expected_magic;
+    std::uint32_t m_version = format_version;
+    std::uint32_t m_store_type = 0;
+    std::uint32_t m_real_size = sizeof(Real);
+    std::uint32_t m_block_width = Detail::triangle_block_width;
+
+    /// What the store was built from, see Hasher
+    std::uint64_t m_key = 0;
+
+    [[nodiscard]] bool operator==(const Header &) const noexcept = default;
+};
+
+template<typename Store> [[nodiscard]] bool save(Store &store, std::uint64_t key, const std::string &path) noexcept {
+    Writer writer {};
+    writer(Header { .m_store_type = StoreType<Store>::m_id, .m_key = key });
+    writer(store);
+    return writer.write_to(path);
+}
+
+/// \return nullptr if there is no cache at path, or if it is of another version, store type or key
+template<typename Store>
+[[nodiscard]] std::shared_ptr<Store> load(std::uint64_t key, const std::string &path) noexcept {
+    const auto file = MappedFile::open(path);
+    if (!file)
+        return nullptr;
+
+    Reader reader { file->data() };
+
+    Header header {};
+    reader(header);
+    if (!reader.ok() || header != Header { .m_store_type = StoreType<Store>::m_id, .m_key = key })
+        return nullptr;
+
+    auto store = std::make_shared<Store>();
+    reader(*store);
+    if (!reader.ok() || !reader.at_end())
+        return nullptr;
+
+    return store;
+}
+
+}
@@ -0,0 +1,359 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+#include "Maths/SIMD.hpp"
+#include "Paths/Common.hpp"
+#include "Paths/Ray.hpp"
+#include "Paths/Shape/Shapes.hpp"
+#include "Utils/Parallel.hpp"
+
+namespace Paths::BVH::Detail {
+
+/// The shapes of the leaves of a flattened BVH. Leaves refer to their shapes through the ranges returned by append,
+/// what a range indexes into is up to the store. Traversals collect the closest Hit with closest_hit and complete the
+/// Intersection once at the end with surface_at. Refits move the shapes with transform and get the new bounds of the
+/// leaves with extents.
+template<typename ShapeT = void> class LeafStore {
+public:
+    typedef Shape::BoundableShapeT<ShapeT> shape_t;
+    typedef std::pair<std::uint32_t, std::uint32_t> range_t;
+
+    void reserve(std::size_t shape_count) { m_shapes.reserve(shape_count); }
+
+    range_t append(std::span<const shape_t> shapes) {
+        const auto start = static_cast<std::uint32_t>(m_shapes.size());
+        std::copy(shapes.begin(), shapes.end(), std::back_inserter(m_shapes));
+        return { start, static_cast<std::uint32_t>(m_shapes.size()) };
+    }
+
+    /// The end of the last range
+    [[nodiscard]] std::uint32_t end() const noexcept { return static_cast<std::uint32_t>(m_shapes.size()); }
+
+    [[nodiscard]] std::size_t size() const noexcept { return m_shapes.size(); }
+
+    /// The number of shape checks that testing a range amounts to
+    [[nodiscard]] static std::size_t checks(range_t range) noexcept { return range.second - range.first; }
+
+    /// Replaces best with the closest hit in the range if that is closer, returns whether best got replaced
+    bool closest_hit(const Ray &ray, range_t range, Hit &best) const noexcept {
+        if (!Shape::closest_hit_linear(ray, m_shapes.cbegin() + range.first, m_shapes.cbegin() + range.second, best))
+            return false;
+
+        best.m_primitive += range.first;
+        return true;
+    }
+
+    [[nodiscard]] Intersection surface_at(const Ray &ray, const Hit &hit) const noexcept {
+        return Shape::surface_at(m_shapes[hit.m_primitive], ray, hit);
+    }
+
+    [[nodiscard]] bool occluded(const Ray &ray, Real t_max, range_t range) const noexcept {
+        return Shape::occluded_linear(ray, t_max, m_shapes.cbegin() + range.first, m_shapes.cbegin() + range.second);
+    }
+
+    /// Replaces every shape s with fn(s)
+    template<typename Fn> void transform(Fn &&fn, bool parallel) {
+        Utils::parallel_chunks(m_shapes.size(), parallel ? ProgramConfig::preferred_thread_count() : 1,
+            [this, &fn](std::size_t, std::size_t start, std::size_t end) {
+                for (std::size_t i = start; i < end; i++)
+                    m_shapes[i] = std::invoke(fn, std::as_const(m_shapes[i]));
+            });
+    }
+
+    /// The extents of the shapes in the range, padded like TraversableBVHNode::calculate_extents does
+    [[nodiscard]] std::pair<Point, Point> extents(range_t range) const noexcept {
+        std::pair<Point, Point> extents = Shape::empty_extents;
+        for (auto i = range.first; i < range.second; i++) {
+            Shape::apply(
+                m_shapes[i], [&extents](const auto &s) { extents = Shape::merge_extents(extents, s.m_extents); });
+        }
+        return Shape::padded_extents(extents);
+    }
+
+private:
+    std::vector<shape_t> m_shapes {};
+};
+
+#ifdef __AVX512F__
+static constexpr std::size_t triangle_block_width = 8;
+#else
+static constexpr std::size_t triangle_block_width = 4;
+#endif
+
+/// Triangles get packed into SoA blocks of triangle_block_width, every leaf starting a new block, and all the
+/// triangles of a block get tested at once. Ranges index blocks instead of triangles.
+///
+/// Only what the intersection test needs is kept in the blocks, what is needed to complete the Intersection of the
+/// closest hit is kept aside, and what is needed only for building (extents, centers) is not kept at all.
+template<bool Parallelogram> class LeafStore<Shape::Detail::TriangleImpl<Parallelogram>> {
+    static constexpr std::size_t Width = triangle_block_width;
+    typedef Maths::simd_t<Real, Width> vreal_t;
+
+    /// Padding lanes have degenerate (all zero) triangles. The vertices are kept as they are instead of as a vertex and
+    /// two edges so that triangles sharing an edge see the exact same edge, see ProgramConfig::watertight_triangles.
+    struct Block {
+        /// Indexed by vertex then axis
+        std::array<std::array<vreal_t, 3>, 3> m_vertices {};
+    };
+
+    struct Shading {
+        Point m_normal {};
+        std::size_t m_mat_index = 0;
+
+        /// See Cache.hpp, single precision normals leave padding before the index
+        template<typename Archive> void serialise(Archive &archive) {
+            archive(m_normal);
+            archive(m_mat_index);
+        }
+    };
+
+    struct BlockHits {
+        vreal_t m_t;
+        vreal_t m_u;
+        vreal_t m_v;
+    };
+
+public:
+    typedef Shape::Detail::TriangleImpl<Parallelogram> shape_t;
+    typedef std::pair<std::uint32_t, std::uint32_t> range_t;
+
+    void reserve(std::size_t shape_count) {
+        m_blocks.reserve((shape_count + Width - 1) / Width);
+        m_lane_counts.reserve(m_blocks.capacity());
+        m_shading.reserve(m_blocks.capacity() * Width);
+    }
+
+    range_t append(std::span<const shape_t> shapes) {
+        const auto start = static_cast<std::uint32_t>(m_blocks.size());
+
+        for (std::size_t i = 0; i < shapes.size(); i++) {
+            const auto lane = i % Width;
+            if (!lane) {
+                m_blocks.emplace_back();
+                m_lane_counts.push_back(0);
+                m_shading.resize(m_blocks.size() * Width);
+            }
+
+            const auto &triangle = shapes[i];
+            set_lane(m_blocks.back(), lane, triangle);
+            ++m_lane_counts.back();
+            m_shading[(m_blocks.size() - 1) * Width + lane] = { triangle.m_normal, triangle.m_mat_index };
+        }
+
+        m_triangle_count += shapes.size();
+
+        return { start, static_cast<std::uint32_t>(m_blocks.size()) };
+    }
+
+    [[nodiscard]] std::uint32_t end() const noexcept { return static_cast<std::uint32_t>(m_blocks.size()); }
+
+    [[nodiscard]] std::size_t size() const noexcept { return m_triangle_count; }
+
+    [[nodiscard]] static std::size_t checks(range_t range) noexcept { return (range.second - range.first) * Width; }
+
+    /// The primitive of a hit is its block * Width + lane
+    bool closest_hit(const Ray &ray, range_t range, Hit &best) const noexcept {
+        bool replaced = false;
+
+        for (auto i = range.first; i < range.second; i++) {
+            const auto hits = intersect_block(m_blocks[i], ray);
+            for (std::size_t lane = 0; lane < Width; lane++) {
+                if (hits.m_t[lane] >= best.m_distance)
+                    continue;
+
+                best.m_distance = hits.m_t[lane];
+                best.m_primitive = static_cast<std::uint32_t>(i * Width + lane);
+                best.m_barycentrics = { hits.m_u[lane], hits.m_v[lane] };
+                replaced = true;
+            }
+        }
+
+        return replaced;
+    }
+
+    [[nodiscard]] Intersection surface_at(const Ray &ray, const Hit &hit) const noexcept {
+        const auto &shading = m_shading[hit.m_primitive];
+        Intersection isection(ray, shading.m_mat_index, hit.m_distance, shading.m_normal, hit.m_barycentrics);
+        Shape::Detail::set_triangle_point(
+            isection, get_vertices(hit.m_primitive / Width, hit.m_primitive % Width), hit.m_barycentrics);
+        return isection;
+    }
+
+    [[nodiscard]] bool occluded(const Ray &ray, Real t_max, range_t range) const noexcept {
+        for (auto i = range.first; i < range.second; i++) {
+            const auto hits = intersect_block(m_blocks[i], ray);
+            for (std::size_t lane = 0; lane < Width; lane++)
+                if (hits.m_t[lane] < t_max)
+                    return true;
+        }
+
+        return false;
+    }
+
+    /// Replaces every triangle t with fn(t), the triangles are rebuilt from the blocks for fn
+    template<typename Fn> void transform(Fn &&fn, bool parallel) {
+        Utils::parallel_chunks(m_blocks.size(), parallel ? ProgramConfig::preferred_thread_count() : 1,
+            [this, &fn](std::size_t, std::size_t start, std::size_t end) {
+                for (std::size_t i = start; i < end; i++) {
+                    for (std::size_t lane = 0; lane < m_lane_counts[i]; lane++) {
+                        auto &shading = m_shading[i * Width + lane];
+                        const shape_t triangle = std::invoke(fn, shape_t(shading.m_mat_index, get_vertices(i, lane)));
+                        set_lane(m_blocks[i], lane, triangle);
+                        shading = { triangle.m_normal, triangle.m_mat_index };
+                    }
+                }
+            });
+    }
+
+    /// The extents of the triangles in the range, padded like TraversableBVHNode::calculate_extents does
+    [[nodiscard]] std::pair<Point, Point> extents(range_t range) const noexcept {
+        std::pair<Point, Point> extents = Shape::empty_extents;
+        for (auto i = range.first; i < range.second; i++) {
+            for (std::size_t lane = 0; lane < m_lane_counts[i]; lane++) {
+                const auto vertices = get_vertices(i, lane);
+                for (const auto &vertex : vertices)
+                    extents = Shape::merge_extents(extents, vertex);
+                if constexpr (Parallelogram)
+                    extents = Shape::merge_extents(extents, vertices[1] + vertices[2] - vertices[0]);
+            }
+        }
+        return Shape::padded_extents(extents);
+    }
+
+    /// See Cache.hpp, the blocks are stored as they are laid out in memory
+    template<typename Archive> void serialise(Archive &archive) {
+        archive(m_blocks);
+        archive(m_lane_counts);
+        archive(m_shading);
+        archive(m_triangle_count);
+    }
+
+private:
+    std::vector<Block> m_blocks {};
+    /// The number of triangles in each block, the lanes after those are padding
+    std::vector<std::uint8_t> m_lane_counts {};
+
+    /// Indexed by block * Width + lane
+    std::vector<Shading> m_shading {};
+    std::size_t m_triangle_count = 0;
+
+    static void set_lane(Block &block, std::size_t lane, const shape_t &triangle) noexcept {
+        for (std::size_t vertex = 0; vertex < 3; vertex++)
+            for (std::size_t axis = 0; axis < 3; axis++)
+                block.m_vertices[vertex][axis][lane] = triangle.get_vertices()[vertex][axis];
+    }
+
+    [[nodiscard]] std::array<Point, 3> get_vertices(std::size_t block_index, std::size_t lane) const noexcept {
+        const auto &block = m_blocks[block_index];
+        std::array<Point, 3> vertices;
+        for (std::size_t vertex = 0; vertex < 3; vertex++)
+            for (std::size_t axis = 0; axis < 3; axis++)
+                vertices[vertex][axis] = block.m_vertices[vertex][axis][lane];
+        return vertices;
+    }
+
+    static std::array<vreal_t, 3> cross(const std::array<vreal_t, 3> &lhs, const std::array<vreal_t, 3> &rhs) noexcept {
+        return {
+            lhs[1] * rhs[2] - lhs[2] * rhs[1],
+            lhs[2] * rhs[0] - lhs[0] * rhs[2],
+            lhs[0] * rhs[1] - lhs[1] * rhs[0],
+        };
+    }
+
+    static vreal_t dot(const std::array<vreal_t, 3> &lhs, const std::array<vreal_t, 3> &rhs) noexcept {
+        return lhs[0] * rhs[0] + lhs[1] * rhs[1] + lhs[2] * rhs[2];
+    }
+
+    /// See Shape::Detail::difference_of_products, the loop gets turned into vector fmas
+    static vreal_t difference_of_products(vreal_t a, vreal_t b, vreal_t c, vreal_t d) noexcept {
+        const vreal_t cd = c * d;
+        vreal_t ret;
+        for (std::size_t lane = 0; lane < Width; lane++)
+            ret[lane] = std::fma(a[lane], b[lane], -cd[lane]) + std::fma(-c[lane], d[lane], cd[lane]);
+        return ret;
+    }
+
+    static BlockHits intersect_block(const Block &block, const Ray &ray) noexcept {
+        if constexpr (ProgramConfig::watertight_triangles)
+            return intersect_block_watertight(block, ray);
+        else
+            return intersect_block_moller_trumbore(block, ray);
+    }
+
+    /// The same watertight test as TriangleImpl's, for every lane at once. Lanes that miss get an infinite distance.
+    static BlockHits intersect_block_watertight(const Block &block, const Ray &ray) noexcept {
+        const auto [x, y, z] = ray.m_shear.m_axes;
+        const auto &shear = ray.m_shear.m_shear;
+
+        std::array<std::array<vreal_t, 3>, 3> sheared;
+        for (std::size_t i = 0; i < 3; i++) {
+            const auto &vertex = block.m_vertices[i];
+            const vreal_t vertex_x = vertex[x] - ray.m_origin[x];
+            const vreal_t vertex_y = vertex[y] - ray.m_origin[y];
+            const vreal_t vertex_z = vertex[z] - ray.m_origin[z];
+            sheared[i] = { vertex_x - shear[0] * vertex_z, vertex_y - shear[1] * vertex_z, shear[2] * vertex_z };
+        }
+        const auto &[a, b, c] = sheared;
+
+        vreal_t w_0 = difference_of_products(c[0], b[1], c[1], b[0]);
+        vreal_t w_1 = difference_of_products(a[0], c[1], a[1], c[0]);
+        vreal_t w_2 = difference_of_products(b[0], a[1], b[1], a[0]);
+        vreal_t det = w_0 + w_1 + w_2;
+
+        const vreal_t one = vreal_t {} + 1;
+        const vreal_t sign = det < 0 ? -one : one;
+        w_0 *= sign;
+        w_1 *= sign;
+        w_2 *= sign;
+        det *= sign;
+
+        const auto t = w_0 * a[2] + w_1 * b[2] + w_2 * c[2];
+        const auto f = one / det;
+
+        auto valid = (det != 0) & (w_1 >= 0) & (w_2 >= 0) & (t > 0);
+        if constexpr (Parallelogram)
+            valid &= (w_1 <= det) & (w_2 <= det);
+        else
+            valid &= w_0 >= 0;
+
+        const vreal_t miss = vreal_t {} + inf;
+        return { valid ? t * f : miss, w_1 * f, w_2 * f };
+    }
+
+    /// The same Möller–Trumbore as TriangleImpl's, for every lane at once. Lanes that miss get an infinite distance.
+    static BlockHits intersect_block_moller_trumbore(const Block &block, const Ray &ray) noexcept {
+        std::array<vreal_t, 3> direction;
+        std::array<vreal_t, 3> s;
+        std::array<vreal_t, 3> edge_0;
+        std::array<vreal_t, 3> edge_1;
+        for (std::size_t axis = 0; axis < 3; axis++) {
+            direction[axis] = vreal_t {} + ray.m_direction[axis];
+            s[axis] = (vreal_t {} + ray.m_origin[axis]) - block.m_vertices[0][axis];
+            edge_0[axis] = block.m_vertices[1][axis] - block.m_vertices[0][axis];
+            edge_1[axis] = block.m_vertices[2][axis] - block.m_vertices[0][axis];
+        }
+
+        const auto h = cross(direction, edge_1);
+        const auto a = dot(edge_0, h);
+        const auto f = static_cast<Real>(1) / a;
+
+        const auto u = f * dot(s, h);
+        const auto q = cross(s, edge_0);
+        const auto v = f * dot(direction, q);
+        const auto t = f * dot(edge_1, q);
+
+        auto valid = (a > sensible_eps) | (a < -sensible_eps);
+        valid &= (u >= 0) & (u <= 1) & (v >= 0) & (t > sensible_eps);
+        if constexpr (Parallelogram)
+            valid &= v <= 1;
+        else
+            valid &= u + v <= 1;
+
+        const vreal_t miss = vreal_t {} + inf;
+        return { valid ? t : miss, u, v };
+    }
+};
+
+}
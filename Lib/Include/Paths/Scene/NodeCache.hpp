@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+namespace Paths::BVH {
+
+/// A model of a 32 KiB, 8-way set associative data cache with LRU replacement, like a typical L1, that the node fetches
+/// of single ray traversals of the flattened stores and of the top level go through while one is recorded into.
+/// Unlike bound checks, how many fetches miss depends on the order in which rays are traced.
+class NodeCacheModel {
+public:
+    static constexpr std::size_t m_line_size = 64;
+    static constexpr std::size_t m_set_count = 64;
+    static constexpr std::size_t m_way_count = 8;
+
+    /// Cache lines of nodes fetched, and how many of them were not in the cache
+    std::size_t m_fetches = 0;
+    std::size_t m_misses = 0;
+
+    /// Calls fn with the node fetches of the calling thread recorded into this model
+    template<typename Fn> void record(Fn &&fn) {
+        NodeCacheModel *const outer = std::exchange(s_current, this);
+        fn();
+        s_current = outer;
+    }
+
+    /// Records the fetch of node if a model is being recorded into on the calling thread
+    template<typename T> static void fetch(const T &node) noexcept {
+        if (s_current) [[unlikely]]
+            s_current->fetch_bytes(reinterpret_cast<std::uintptr_t>(&node), sizeof(T));
+    }
+
+private:
+    /// Indexed by set, the lines of each set are ordered from the most to the least recently used. Line 0 holds
+    /// addresses that no node has, so it stands in for empty ways.
+    std::array<std::array<std::uintptr_t, m_way_count>, m_set_count> m_lines {};
+
+    static inline thread_local NodeCacheModel *s_current = nullptr;
+
+    void fetch_bytes(std::uintptr_t address, std::size_t size) noexcept {
+        for (auto line = address / m_line_size; line <= (address + size - 1) / m_line_size; line++)
+            fetch_line(line);
+    }
+
+    void fetch_line(std::uintptr_t line) noexcept {
+        auto &set = m_lines[line % m_set_count];
+        ++m_fetches;
+
+        std::size_t way = 0;
+        while (way < m_way_count - 1 && set[way] != line)
+            way++;
+        if (set[way] != line)
+            ++m_misses;
+
+        // the line moves to the front, evicting the least recently used one on misses
+        for (; way > 0; way--)
+            set[way] = set[way - 1];
+        set[0] = line;
+    }
+};
+
+}
@@ -4,11 +4,18 @@
 #include "Paths/Material/material.hpp"
 #include "Paths/Ray.hpp"
 #include "Paths/Shape/Shapes.hpp"
+#include "Utils/SpinLock.hpp"
 
-#include "Store.hpp"
-
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <span>
 #include <vector>
 
+#include "Store.hpp"
+#include "TopLevel.hpp"
+
 namespace Paths {
 
 class Scene final : public ShapeStore {
@@ -28,7 +35,8 @@ public:
             return m_material_aliases.at(alias);
     }
 
-    void insert_store(std::shared_ptr<ShapeStore> store) noexcept { m_stores.push_back(std::move(store)); }
+    /// The stores become children of the scene, which get traced through a hierarchy over their bounds
+    void insert_store(std::shared_ptr<ShapeStore> store) noexcept { insert_child(std::move(store)); }
 
     [[nodiscard]] Material get_material(std::size_t i) const noexcept {
         if (m_materials.empty())
@@ -37,18 +45,27 @@ public:
     }
 
 protected:
+    /// Everything in the scene is in its children
     [[nodiscard]] std::optional<Intersection> intersect_impl(
-        Ray ray, std::size_t &bound_checks, std::size_t &shape_checks) const noexcept override {
-        std::optional<Intersection> best_intersection = std::nullopt;
+        Ray, std::size_t &bound_checks, std::size_t &shape_checks) const noexcept override {
+        return std::nullopt;
+    }
+
+    void intersect_packet_impl(std::span<const Ray>, std::span<std::optional<Intersection>> isects,
+        std::size_t &bound_checks, std::size_t &shape_checks) const noexcept override {
+        std::fill(isects.begin(), isects.end(), std::nullopt);
+    }
 
-        for (const auto &store : m_stores)
-            Intersection::replace(best_intersection, store->intersect_ray(ray, bound_checks, shape_checks));
+    [[nodiscard]] bool occluded_impl(
+        Ray, Real t_max, std::size_t &bound_checks, std::size_t &shape_checks) const noexcept override {
+        return false;
+    }
 
-        return best_intersection;
+    [[nodiscard]] std::optional<std::pair<Point, Point>> extents_impl() const noexcept override {
+        return Shape::empty_extents;
     }
 
 private:
-    std::vector<std::shared_ptr<ShapeStore>> m_stores {};
     std::vector<Material> m_materials {};
     std::unordered_map<std::string, std::size_t> m_material_aliases {};
 };
@@ -0,0 +1,381 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <span>
+#include <vector>
+
+#include "Traversal.hpp"
+
+namespace Paths::BVH::Detail {
+
+/// Builds a tree like the binned SAH partitioner does, except that every node also considers splitting space instead
+/// of the shapes: shapes straddling a spatial split are clipped to both sides and referenced by both children. Long
+/// and thin shapes that would make the boxes of their siblings overlap get chopped into pieces with small boxes.
+/// The extra references are limited by a budget which gets divided among the children in proportion to their sizes
+/// so that the tree does not depend on the order the subtrees are built in.
+template<typename ShapeT> class SpatialSplitBuilder {
+public:
+    typedef Shape::BoundableShapeT<ShapeT> shape_t;
+
+    static constexpr std::size_t m_bin_count = 16;
+
+    struct Node {
+        std::pair<Point, Point> m_extents = Shape::empty_extents;
+        std::array<std::unique_ptr<Node>, 2> m_children { nullptr, nullptr };
+
+        /// The indices of the shapes of leaves
+        std::vector<std::uint32_t> m_shapes {};
+
+        /// The number of shape references in the subtree
+        std::size_t m_reference_count = 0;
+
+        [[nodiscard]] bool is_leaf() const noexcept { return !m_children[0]; }
+    };
+
+    SpatialSplitBuilder(std::span<const shape_t> shapes, std::size_t max_depth, std::size_t min_shapes,
+        Real duplication_budget, bool parallel) noexcept
+        : m_shapes(shapes)
+        , m_max_depth(max_depth)
+        , m_min_shapes(std::max<std::size_t>(min_shapes, 1))
+        , m_duplication_budget(static_cast<std::size_t>(static_cast<Real>(shapes.size()) * duplication_budget))
+        , m_parallel(parallel) { }
+
+    [[nodiscard]] std::unique_ptr<Node> build() noexcept {
+        std::vector<Reference> references(m_shapes.size());
+        for (std::size_t i = 0; i < m_shapes.size(); i++)
+            references[i] = { Shape::apply(m_shapes[i], [](const auto &s) { return s.m_extents; }),
+                static_cast<std::uint32_t>(i) };
+
+        const auto extents = bounds_of(references);
+        m_root_area = Shape::surface_area(extents);
+
+        return build_node(std::move(references), extents, m_duplication_budget, 0);
+    }
+
+private:
+    struct Reference {
+        std::pair<Point, Point> m_extents;
+        std::uint32_t m_index;
+    };
+
+    struct Bin {
+        std::pair<Point, Point> m_extents = Shape::empty_extents;
+        std::size_t m_count = 0;
+
+        /// Only used by spatial binning, the number of references that end in the bin
+        std::size_t m_exits = 0;
+    };
+
+    struct Split {
+        Real m_cost = inf;
+        std::size_t m_axis = 0;
+
+        /// The first bin on the rhs
+        std::size_t m_bin = 0;
+
+        std::pair<Point, Point> m_lhs_extents = Shape::empty_extents;
+        std::pair<Point, Point> m_rhs_extents = Shape::empty_extents;
+        std::size_t m_lhs_count = 0;
+        std::size_t m_rhs_count = 0;
+    };
+
+    std::span<const shape_t> m_shapes;
+    std::size_t m_max_depth;
+    std::size_t m_min_shapes;
+    std::size_t m_duplication_budget;
+    bool m_parallel;
+    Real m_root_area = 0;
+
+    static std::pair<Point, Point> bounds_of(std::span<const Reference> references) noexcept {
+        std::pair<Point, Point> extents = Shape::empty_extents;
+        for (const auto &reference : references)
+            extents = Shape::merge_extents(extents, reference.m_extents);
+        return extents;
+    }
+
+    static Point center_of(const std::pair<Point, Point> &extents) noexcept {
+        return (extents.first + extents.second) / Real { 2 };
+    }
+
+    static std::pair<Point, Point> intersect_extents(
+        const std::pair<Point, Point> &lhs, const std::pair<Point, Point> &rhs) noexcept {
+        return { Maths::max(lhs.first, rhs.first), Maths::min(lhs.second, rhs.second) };
+    }
+
+    static bool is_empty(const std::pair<Point, Point> &extents) noexcept {
+        for (std::size_t axis = 0; axis < 3; axis++)
+            if (extents.first[axis] > extents.second[axis])
+                return true;
+        return false;
+    }
+
+    /// The bounds of the part of the referenced shape between the planes at min and max along axis. Triangles get
+    /// clipped exactly, other shapes get their boxes clipped.
+    [[nodiscard]] std::pair<Point, Point> clip(
+        const Reference &reference, std::size_t axis, Real min, Real max) const noexcept {
+        auto slab = reference.m_extents;
+        slab.first[axis] = std::max(slab.first[axis], min);
+        slab.second[axis] = std::min(slab.second[axis], max);
+
+        return Shape::apply(m_shapes[reference.m_index], [&](const auto &s) -> std::pair<Point, Point> {
+            if constexpr (std::is_same_v<std::decay_t<decltype(s)>, Shape::Triangle>) {
+                const auto &vertices = s.get_vertices();
+                std::pair<Point, Point> clipped = Shape::empty_extents;
+
+                for (std::size_t i = 0; i < 3; i++) {
+                    const Point &v_0 = vertices[i];
+                    const Point &v_1 = vertices[(i + 1) % 3];
+
+                    if (v_0[axis] >= min && v_0[axis] <= max)
+                        clipped = Shape::merge_extents(clipped, v_0);
+
+                    for (const Real plane : { min, max }) {
+                        if ((v_0[axis] - plane) * (v_1[axis] - plane) >= 0)
+                            continue;
+                        const Real t = (plane - v_0[axis]) / (v_1[axis] - v_0[axis]);
+                        Point crossing = v_0 + (v_1 - v_0) * t;
+                        crossing[axis] = plane;
+                        clipped = Shape::merge_extents(clipped, crossing);
+                    }
+                }
+
+                return intersect_extents(clipped, slab);
+            } else {
+                return slab;
+            }
+        });
+    }
+
+    [[nodiscard]] std::size_t object_bin(const std::pair<Point, Point> &center_extents, std::size_t axis,
+        const Reference &reference) const noexcept {
+        const Real length = center_extents.second[axis] - center_extents.first[axis];
+        const auto index = static_cast<std::size_t>((center_of(reference.m_extents)[axis] - center_extents.first[axis])
+            / length * static_cast<Real>(m_bin_count));
+        return std::min(index, m_bin_count - 1);
+    }
+
+    [[nodiscard]] std::size_t spatial_bin(
+        const std::pair<Point, Point> &extents, std::size_t axis, Real position) const noexcept {
+        const Real length = extents.second[axis] - extents.first[axis];
+        const auto index = static_cast<std::size_t>(
+            std::max<Real>(0, (position - extents.first[axis]) / length * static_cast<Real>(m_bin_count)));
+        return std::min(index, m_bin_count - 1);
+    }
+
+    [[nodiscard]] Real spatial_plane(const std::pair<Point, Point> &extents, std::size_t axis, std::size_t bin) const {
+        const Real length = extents.second[axis] - extents.first[axis];
+        return extents.first[axis] + length * static_cast<Real>(bin) / static_cast<Real>(m_bin_count);
+    }
+
+    /// Sweeps the bins of an axis, lhs_count and rhs_count give the number of references on both sides of a boundary
+    template<typename LhsCount, typename RhsCount>
+    void sweep(const std::array<Bin, m_bin_count> &bins, std::size_t axis, Real parent_area, LhsCount &&lhs_count_of,
+        RhsCount &&rhs_count_of, Split &best) const noexcept {
+        std::array<std::pair<Point, Point>, m_bin_count> rhs_extents {};
+        std::pair<Point, Point> extents = Shape::empty_extents;
+        for (std::size_t i = m_bin_count - 1; i > 0; i--) {
+            extents = Shape::merge_extents(extents, bins[i].m_extents);
+            rhs_extents[i] = extents;
+        }
+
+        std::pair<Point, Point> lhs_extents = Shape::empty_extents;
+        for (std::size_t i = 1; i < m_bin_count; i++) {
+            lhs_extents = Shape::merge_extents(lhs_extents, bins[i - 1].m_extents);
+
+            const std::size_t lhs_count = lhs_count_of(i);
+            const std::size_t rhs_count = rhs_count_of(i);
+            if (lhs_count < m_min_shapes || rhs_count < m_min_shapes)
+                continue;
+
+            const Real cost = sah_traversal_cost
+                + (Shape::surface_area(lhs_extents) * static_cast<Real>(lhs_count)
+                      + Shape::surface_area(rhs_extents[i]) * static_cast<Real>(rhs_count))
+                    / parent_area * sah_intersection_cost;
+
+            if (cost < best.m_cost)
+                best = { cost, axis, i, lhs_extents, rhs_extents[i], lhs_count, rhs_count };
+        }
+    }
+
+    [[nodiscard]] Split find_object_split(
+        std::span<const Reference> references, const std::pair<Point, Point> &extents) const noexcept {
+        std::pair<Point, Point> center_extents = Shape::empty_extents;
+        for (const auto &reference : references)
+            center_extents = Shape::merge_extents(center_extents, center_of(reference.m_extents));
+
+        Split best {};
+        const Real parent_area = Shape::surface_area(extents);
+
+        for (std::size_t axis = 0; axis < 3; axis++) {
+            if (center_extents.second[axis] - center_extents.first[axis] <= sensible_eps)
+                continue;
+
+            std::array<Bin, m_bin_count> bins {};
+            for (const auto &reference : references) {
+                auto &bin = bins[object_bin(center_extents, axis, reference)];
+                bin.m_extents = Shape::merge_extents(bin.m_extents, reference.m_extents);
+                ++bin.m_count;
+            }
+
+            std::array<std::size_t, m_bin_count + 1> prefix {};
+            for (std::size_t i = 0; i < m_bin_count; i++)
+                prefix[i + 1] = prefix[i] + bins[i].m_count;
+
+            sweep(
+                bins, axis, parent_area, [&prefix](std::size_t i) { return prefix[i]; },
+                [&prefix](std::size_t i) { return prefix[m_bin_count] - prefix[i]; }, best);
+        }
+
+        return best;
+    }
+
+    [[nodiscard]] Split find_spatial_split(
+        std::span<const Reference> references, const std::pair<Point, Point> &extents) const noexcept {
+        Split best {};
+        const Real parent_area = Shape::surface_area(extents);
+
+        for (std::size_t axis = 0; axis < 3; axis++) {
+            if (extents.second[axis] - extents.first[axis] <= sensible_eps)
+                continue;
+
+            // m_count counts the references that enter a bin
+            std::array<Bin, m_bin_count> bins {};
+            for (const auto &reference : references) {
+                const auto first = spatial_bin(extents, axis, reference.m_extents.first[axis]);
+                const auto last = spatial_bin(extents, axis, reference.m_extents.second[axis]);
+
+                for (std::size_t i = first; i <= last; i++) {
+                    const auto clipped = first == last
+                        ? reference.m_extents
+                        : clip(reference, axis, spatial_plane(extents, axis, i), spatial_plane(extents, axis, i + 1));
+                    if (!is_empty(clipped))
+                        bins[i].m_extents = Shape::merge_extents(bins[i].m_extents, clipped);
+                }
+
+                ++bins[first].m_count;
+                ++bins[last].m_exits;
+            }
+
+            std::array<std::size_t, m_bin_count + 1> entries {};
+            std::array<std::size_t, m_bin_count + 1> exits {};
+            for (std::size_t i = 0; i < m_bin_count; i++) {
+                entries[i + 1] = entries[i] + bins[i].m_count;
+                exits[i + 1] = exits[i] + bins[i].m_exits;
+            }
+
+            sweep(
+                bins, axis, parent_area, [&entries](std::size_t i) { return entries[i]; },
+                [&exits](std::size_t i) { return exits[m_bin_count] - exits[i]; }, best);
+        }
+
+        return best;
+    }
+
+    [[nodiscard]] std::unique_ptr<Node> make_leaf(
+        std::vector<Reference> references, const std::pair<Point, Point> &extents) const noexcept {
+        auto node = std::make_unique<Node>();
+        node->m_extents = extents;
+        node->m_reference_count = references.size();
+        node->m_shapes.reserve(references.size());
+        for (const auto &reference : references)
+            node->m_shapes.push_back(reference.m_index);
+        return node;
+    }
+
+    [[nodiscard]] std::unique_ptr<Node> build_node(std::vector<Reference> references,
+        const std::pair<Point, Point> &extents, std::size_t budget, std::size_t depth) const noexcept {
+        const std::size_t count = references.size();
+        if (depth >= m_max_depth || count <= m_min_shapes || Shape::surface_area(extents) <= 0)
+            return make_leaf(std::move(references), extents);
+
+        const auto object_split = find_object_split(references, extents);
+        auto best = object_split;
+        bool spatial = false;
+
+        const auto overlap = intersect_extents(object_split.m_lhs_extents, object_split.m_rhs_extents);
+        const bool overlapping = object_split.m_cost == inf
+            || (!is_empty(overlap) && Shape::surface_area(overlap) > spatial_split_overlap_threshold * m_root_area);
+
+        if (budget && overlapping) {
+            const auto spatial_split = find_spatial_split(references, extents);
+            const auto duplicates = spatial_split.m_lhs_count + spatial_split.m_rhs_count - count;
+            if (spatial_split.m_cost < best.m_cost && duplicates <= budget) {
+                best = spatial_split;
+                spatial = true;
+            }
+        }
+
+        if (best.m_cost >= static_cast<Real>(count) * sah_intersection_cost)
+            return make_leaf(std::move(references), extents);
+
+        std::vector<Reference> lhs {};
+        std::vector<Reference> rhs {};
+        lhs.reserve(best.m_lhs_count);
+        rhs.reserve(best.m_rhs_count);
+
+        if (spatial) {
+            const Real plane = spatial_plane(extents, best.m_axis, best.m_bin);
+            for (const auto &reference : references) {
+                if (spatial_bin(extents, best.m_axis, reference.m_extents.second[best.m_axis]) < best.m_bin) {
+                    lhs.push_back(reference);
+                } else if (spatial_bin(extents, best.m_axis, reference.m_extents.first[best.m_axis]) >= best.m_bin) {
+                    rhs.push_back(reference);
+                } else {
+                    const auto lhs_extents = clip(reference, best.m_axis, -inf, plane);
+                    const auto rhs_extents = clip(reference, best.m_axis, plane, inf);
+                    if (!is_empty(lhs_extents))
+                        lhs.push_back({ lhs_extents, reference.m_index });
+                    if (!is_empty(rhs_extents))
+                        rhs.push_back({ rhs_extents, reference.m_index });
+                }
+            }
+        } else {
+            std::pair<Point, Point> center_extents = Shape::empty_extents;
+            for (const auto &reference : references)
+                center_extents = Shape::merge_extents(center_extents, center_of(reference.m_extents));
+
+            for (const auto &reference : references) {
+                if (object_bin(center_extents, best.m_axis, reference) < best.m_bin)
+                    lhs.push_back(reference);
+                else
+                    rhs.push_back(reference);
+            }
+        }
+
+        if (lhs.empty() || rhs.empty())
+            return make_leaf(std::move(references), extents);
+
+        references.clear();
+        references.shrink_to_fit();
+
+        const std::size_t duplicates = lhs.size() + rhs.size() - count;
+        const std::size_t remaining = budget - std::min(budget, duplicates);
+        const std::size_t lhs_budget = remaining * lhs.size() / (lhs.size() + rhs.size());
+        const std::size_t rhs_budget = remaining - lhs_budget;
+        const auto lhs_extents = bounds_of(lhs);
+        const auto rhs_extents = bounds_of(rhs);
+
+        auto node = std::make_unique<Node>();
+        node->m_extents = extents;
+
+        auto build_lhs = [&] {
+            node->m_children[0] = build_node(std::move(lhs), lhs_extents, lhs_budget, depth + 1);
+        };
+        auto build_rhs = [&] {
+            node->m_children[1] = build_node(std::move(rhs), rhs_extents, rhs_budget, depth + 1);
+        };
+
+        if (m_parallel && count >= parallel_build_threshold && depth < parallel_build_fork_depth()) {
+            Utils::fork_join(build_lhs, build_rhs);
+        } else {
+            build_lhs();
+            build_rhs();
+        }
+
+        node->m_reference_count = node->m_children[0]->m_reference_count + node->m_children[1]->m_reference_count;
+        return node;
+    }
+};
+
+}
@@ -2,9 +2,26 @@
 
 namespace Paths {
 
+class ShapeStore;
+
+namespace BVH {
+
+/// A store that traces rays against the given stores through a hierarchy over their bounds, defined in TopLevel.cpp
+std::shared_ptr<ShapeStore> make_store_hierarchy(std::span<const std::shared_ptr<ShapeStore>> stores) noexcept;
+
+}
+
 class ShapeStore {
 public:
-    virtual ~ShapeStore() noexcept = default;
+    /// The largest packet that intersect_packet accepts, an 8x8 tile of camera rays
+    static constexpr std::size_t m_packet_size = 64;
+
+    ShapeStore() noexcept = default;
+
+    ShapeStore(const ShapeStore &) = delete;
+    ShapeStore &operator=(const ShapeStore &) = delete;
+
+    virtual ~ShapeStore() noexcept { detach_children(); }
 
     virtual bool insert_shape(Shape::Shape) noexcept { return false; }
 
@@ -13,23 +30,129 @@ public:
     [[nodiscard]] std::optional<Intersection> intersect_ray(
         Ray ray, std::size_t &bound_checks, std::size_t &isect_checks) const noexcept {
         auto best = intersect_impl(ray, bound_checks, isect_checks);
-        for (const auto &child : m_children)
-            Intersection::replace(best, child->intersect_ray(ray, bound_checks, isect_checks));
+        if (const auto *children = child_hierarchy(); children)
+            Intersection::replace(best, children->intersect_ray(ray, bound_checks, isect_checks));
         return best;
     }
 
-    void insert_child(std::shared_ptr<ShapeStore> store) noexcept { m_children.push_back(std::move(store)); }
+    /// Finds the closest hits of up to m_packet_size rays at once. The rays are expected to be coherent (e.g. camera
+    /// rays of neighbouring pixels) so that the stores can share their traversal work among them.
+    void intersect_packet(std::span<const Ray> rays, std::span<std::optional<Intersection>> isects,
+        std::size_t &bound_checks, std::size_t &isect_checks) const noexcept {
+        intersect_packet_impl(rays, isects, bound_checks, isect_checks);
+
+        const auto *children = child_hierarchy();
+        if (!children)
+            return;
+
+        std::array<std::optional<Intersection>, m_packet_size> child_isects;
+        children->intersect_packet(rays, std::span(child_isects).first(rays.size()), bound_checks, isect_checks);
+        for (std::size_t i = 0; i < rays.size(); i++)
+            Intersection::replace(isects[i], std::move(child_isects[i]));
+    }
+
+    /// Checks if anything gets hit by the ray closer than t_max, without finding the closest hit
+    [[nodiscard]] bool occluded(
+        Ray ray, Real t_max, std::size_t &bound_checks, std::size_t &isect_checks) const noexcept {
+        if (occluded_impl(ray, t_max, bound_checks, isect_checks))
+            return true;
+        const auto *children = child_hierarchy();
+        return children && children->occluded(ray, t_max, bound_checks, isect_checks);
+    }
 
-    void clear_children() noexcept { m_children.clear(); }
+    /// The bounds of everything in the store and its children, std::nullopt if any of it is unbounded
+    [[nodiscard]] std::optional<std::pair<Point, Point>> get_extents() const noexcept {
+        auto extents = extents_impl();
+        for (const auto &child : m_children) {
+            const auto child_extents = child->get_extents();
+            if (!extents || !child_extents)
+                return std::nullopt;
+            extents = Shape::merge_extents(*extents, *child_extents);
+        }
+        return extents;
+    }
+
+    /// The children are traced through a hierarchy over their bounds which gets rebuilt by the first ray after the
+    /// set of children or the bounds of any of them change. Not thread safe, like the other modifications of stores.
+    void insert_child(std::shared_ptr<ShapeStore> store) noexcept {
+        store->m_parents.push_back(this);
+        m_children.push_back(std::move(store));
+        invalidate_children();
+    }
+
+    void clear_children() noexcept {
+        detach_children();
+        m_children.clear();
+        invalidate_children();
+    }
+
+    /// Makes the next ray rebuild the hierarchy over the children. Children call this on their parents by themselves
+    /// when their bounds change, see bounds_changed.
+    void invalidate_children() noexcept {
+        m_children_changed.store(true, std::memory_order_release);
+        bounds_changed();
+    }
 
     [[nodiscard]] std::size_t child_count() const noexcept { return m_children.size(); }
 
 protected:
+    /// Has to be called by stores after their shapes move, e.g. by refits, so that the stores they are children of
+    /// rebuild their hierarchies
+    void bounds_changed() noexcept {
+        for (auto *parent : m_parents)
+            parent->invalidate_children();
+    }
+
     [[nodiscard]] virtual std::optional<Intersection> intersect_impl(
         Ray, std::size_t &bound_checks, std::size_t &isect_checks) const noexcept = 0;
 
+    /// The bounds of the shapes of the store itself, stores that do not know them are treated as unbounded
+    [[nodiscard]] virtual std::optional<std::pair<Point, Point>> extents_impl() const noexcept { return std::nullopt; }
+
+    /// Traces the rays one by one, stores that can share the work between coherent rays should override this
+    virtual void intersect_packet_impl(std::span<const Ray> rays, std::span<std::optional<Intersection>> isects,
+        std::size_t &bound_checks, std::size_t &isect_checks) const noexcept {
+        for (std::size_t i = 0; i < rays.size(); i++)
+            isects[i] = intersect_impl(rays[i], bound_checks, isect_checks);
+    }
+
+    /// Falls back to a closest hit query, stores should override this with an early-out traversal
+    [[nodiscard]] virtual bool occluded_impl(
+        Ray ray, Real t_max, std::size_t &bound_checks, std::size_t &isect_checks) const noexcept {
+        const auto isect = intersect_impl(ray, bound_checks, isect_checks);
+        return isect && isect->m_distance < t_max;
+    }
+
 private:
     std::vector<std::shared_ptr<ShapeStore>> m_children {};
+    /// The stores that this one is a child of, the children outlive their parents
+    std::vector<ShapeStore *> m_parents {};
+
+    mutable std::shared_ptr<ShapeStore> m_child_hierarchy {};
+    mutable std::atomic<bool> m_children_changed = false;
+    /// Building the hierarchy can take a while, the threads that need it meanwhile sleep instead of spinning
+    mutable std::mutex m_child_hierarchy_mutex {};
+
+    void detach_children() noexcept {
+        for (const auto &child : m_children)
+            std::erase(child->m_parents, this);
+    }
+
+    /// nullptr if there are no children
+    [[nodiscard]] const ShapeStore *child_hierarchy() const noexcept {
+        if (m_children.empty())
+            return nullptr;
+
+        if (m_children_changed.load(std::memory_order_acquire)) {
+            std::lock_guard lock(m_child_hierarchy_mutex);
+            if (m_children_changed.load(std::memory_order_relaxed)) {
+                m_child_hierarchy = BVH::make_store_hierarchy(m_children);
+                m_children_changed.store(false, std::memory_order_release);
+            }
+        }
+
+        return m_child_hierarchy.get();
+    }
 };
 
 template<typename ShapeT = void> struct LinearShapeStore final : public ShapeStore {
@@ -56,6 +179,25 @@ template<typename ShapeT = void> struct LinearShapeStore final : public ShapeSto
     [[nodiscard]] std::size_t total_shape_count() const noexcept override { return m_shapes.size(); }
 
 protected:
+    /// std::nullopt if there are planes among the shapes
+    [[nodiscard]] std::optional<std::pair<Point, Point>> extents_impl() const noexcept override {
+        std::pair<Point, Point> extents = Shape::empty_extents;
+        for (const auto &shape : m_shapes) {
+            const bool bounded = Shape::apply(shape, [&extents](const auto &s) -> bool {
+                if constexpr (requires { s.m_extents; }) {
+                    extents = Shape::merge_extents(extents, s.m_extents);
+                    return true;
+                } else {
+                    return false;
+                }
+            });
+
+            if (!bounded)
+                return std::nullopt;
+        }
+        return extents;
+    }
+
     [[nodiscard]] std::optional<Intersection> intersect_impl(Ray ray, [[maybe_unused]] std::size_t &bound_checks,
         [[maybe_unused]] std::size_t &shape_checks) const noexcept override {
         if constexpr (Paths::ProgramConfig::embed_ray_stats)
@@ -63,6 +205,14 @@ protected:
 
         return Shape::intersect_linear(ray, m_shapes.cbegin(), m_shapes.cend());
     }
+
+    [[nodiscard]] bool occluded_impl(Ray ray, Real t_max, [[maybe_unused]] std::size_t &bound_checks,
+        [[maybe_unused]] std::size_t &shape_checks) const noexcept override {
+        if constexpr (Paths::ProgramConfig::embed_ray_stats)
+            shape_checks += m_shapes.size();
+
+        return Shape::occluded_linear(ray, t_max, m_shapes.cbegin(), m_shapes.cend());
+    }
 };
 
 }
@@ -1,16 +1,40 @@
 #pragma once
 
+#include <cstdint>
+
+#include "Leaves.hpp"
 #include "Tree.hpp"
 
 namespace Paths::BVH::Detail {
 
 template<typename ShapeT = void, bool MT = true> class ThreadedBVH final : public ShapeStore {
-    struct Node {
-        std::array<std::size_t, 2> m_shape_extents {};
-        std::pair<Point, Point> m_extents {};
+    /// Nodes are stored in pre-order, so the hit link is always the next node. The shapes of a node end where the
+    /// shapes of the next one begin, a sentinel node is appended for the last node's sake.
+    struct alignas(32) Node {
+        std::array<float, 3> m_min;
+        std::array<float, 3> m_max;
+        std::uint32_t m_shape_start;
+        std::uint32_t m_miss;
+    };
+
+    /// Nodes are stored in the canonical pre-order. The hit link of a leaf is its miss link, the hit link of an inner
+    /// node is either the next node (its canonical left child) or m_right, depending on the direction.
+    struct alignas(64) MTNode {
+        std::array<float, 3> m_min;
+        std::array<float, 3> m_max;
+        std::uint32_t m_shape_start;
+        std::uint32_t m_shape_count;
+        std::array<std::uint32_t, 6> m_miss;
+        std::uint32_t m_right;
+
+        /// The bit for a direction is set if m_right is to be visited first in that direction
+        std::uint32_t m_swapped;
     };
 
-    typedef std::array<std::size_t, 2> link_t;
+    static_assert(sizeof(Node) == 32);
+    static_assert(sizeof(MTNode) == 64);
+
+    typedef std::conditional_t<MT, MTNode, Node> node_t;
 
     static std::size_t get_miss_link(const ThreadableBVHNode<ShapeT> &node) noexcept {
         using const_node_pointer_t = const ThreadableBVHNode<ShapeT> *;
@@ -30,92 +54,277 @@ template<typename ShapeT = void, bool MT = true> class ThreadedBVH final : publi
 
 public:
     typedef Shape::BoundableShapeT<ShapeT> shape_t;
-    static constexpr std::size_t m_npos = std::numeric_limits<std::size_t>::max();
+    static constexpr std::uint32_t m_npos = std::numeric_limits<std::uint32_t>::max();
+
+    /// An empty hierarchy that is only to be filled by loading a cache into it, see Cache.hpp
+    ThreadedBVH() = default;
 
     explicit ThreadedBVH(ThreadableBVHTree<ShapeT> &tree) noexcept {
-        using node_t = ThreadableBVHNode<ShapeT>;
+        using tree_node_t = ThreadableBVHNode<ShapeT>;
         auto &root = dynamic_cast<ThreadableBVHNode<ShapeT> &>(tree.root());
 
         m_extents = root.get_extents();
-        std::size_t node_count = 0;
+        std::uint32_t node_count = 0;
         root.template traverse<ETraversalOrder::PreOrder>([this, &node_count](auto &n) {
-            auto &node = dynamic_cast<node_t &>(n);
+            auto &node = dynamic_cast<tree_node_t &>(n);
             node.set_id(node_count);
             ++node_count;
 
-            auto node_shapes = node.get_shapes();
-
-            const std::size_t start = m_shapes.size();
-            std::copy(node_shapes.begin(), node_shapes.end(), std::back_inserter(m_shapes));
-            const std::size_t end = m_shapes.size();
+            node_t packed {};
+            for (std::size_t axis = 0; axis < 3; axis++) {
+                packed.m_min[axis] = round_down_float(node.get_extents().first[axis]);
+                packed.m_max[axis] = round_up_float(node.get_extents().second[axis]);
+            }
+            const auto [shape_start, shape_end] = m_shapes.append(node.get_shapes());
+            packed.m_shape_start = shape_start;
+            if constexpr (MT)
+                packed.m_shape_count = shape_end - shape_start;
 
-            m_nodes.push_back({ { start, end }, node.get_extents() });
+            m_nodes.push_back(packed);
         });
 
-        auto generate_links = [&root, node_count]() -> std::vector<link_t> {
-            std::vector<link_t> t_links(node_count);
-            root.template traverse<ETraversalOrder::PreOrder>([&t_links](auto &n) {
-                auto &node = dynamic_cast<node_t &>(n);
-                std::size_t miss = get_miss_link(node);
-                std::size_t hit;
-                if (bool is_leaf = !node.left(); is_leaf)
-                    hit = miss;
-                else
-                    hit = dynamic_cast<const node_t *>(node.left())->get_id();
-                t_links[node.get_id()] = { hit, miss };
-            });
-            return t_links;
-        };
-
         if constexpr (MT) {
             for (std::size_t i = 0; i < 6; i++) {
-                root.template traverse<ETraversalOrder::PreOrder>([axis = static_cast<EMajorAxis>(i)](auto &n) {
-                    auto &node = dynamic_cast<node_t &>(n);
-                    node.reorder_children(axis);
+                root.template traverse<ETraversalOrder::PreOrder>([this, i](auto &n) {
+                    auto &node = dynamic_cast<tree_node_t &>(n);
+                    node.reorder_children(static_cast<EMajorAxis>(i));
+
+                    auto &packed = m_nodes[node.get_id()];
+                    packed.m_miss[i] = static_cast<std::uint32_t>(get_miss_link(node));
+
+                    if (node.is_leaf()) {
+                        packed.m_right = m_npos;
+                        return;
+                    }
+
+                    const auto first = dynamic_cast<const tree_node_t *>(node.left())->get_id();
+                    const auto second = dynamic_cast<const tree_node_t *>(node.right())->get_id();
+                    const bool swapped = first != node.get_id() + 1;
+                    packed.m_right = static_cast<std::uint32_t>(swapped ? first : second);
+                    packed.m_swapped |= static_cast<std::uint32_t>(swapped) << i;
                 });
-                m_links_lists[i] = generate_links();
             }
         } else {
-            m_links_lists[0] = generate_links();
+            root.template traverse<ETraversalOrder::PreOrder>([this](auto &n) {
+                auto &node = dynamic_cast<tree_node_t &>(n);
+                m_nodes[node.get_id()].m_miss = static_cast<std::uint32_t>(get_miss_link(node));
+            });
+
+            node_t sentinel {};
+            sentinel.m_shape_start = m_shapes.end();
+            sentinel.m_miss = m_npos;
+            m_nodes.push_back(sentinel);
         }
+
+        m_node_count = node_count;
+    }
+
+    /// Replaces every shape s with fn(s), refit has to be called afterwards
+    template<typename Fn> void transform_shapes(Fn &&fn, bool parallel = !ProgramConfig::single_thread) {
+        m_shapes.transform(std::forward<Fn>(fn), parallel);
+    }
+
+    /// Updates the extents of the nodes after the shapes have moved, the topology and the links stay the same
+    /// \return The cost of the tree relative to its cost before the first refit, see Detail::refit_rebuild_threshold
+    Real refit(bool parallel = !ProgramConfig::single_thread) noexcept {
+        if (!m_built_sah_cost)
+            m_built_sah_cost = sah_cost();
+
+        Utils::parallel_chunks(m_node_count, parallel ? ProgramConfig::preferred_thread_count() : 1,
+            [this](std::size_t, std::size_t start, std::size_t end) {
+                for (auto pos = static_cast<std::uint32_t>(start); pos < end; pos++)
+                    if (is_leaf(pos))
+                        set_extents(pos, m_shapes.extents(shape_range(pos)));
+            });
+
+        // children come after their parents in pre-order
+        for (auto pos = m_node_count; pos-- > 0;) {
+            if (!is_leaf(pos))
+                set_extents(pos, Shape::merge_extents(get_extents(pos + 1), get_extents(right_child(pos))));
+        }
+
+        if (m_node_count)
+            m_extents = get_extents(0);
+
+        bounds_changed();
+        return *m_built_sah_cost > 0 ? sah_cost() / *m_built_sah_cost : 1;
+    }
+
+    template<typename Archive> void serialise(Archive &archive) {
+        archive(m_shapes);
+        archive(m_extents);
+        archive(m_nodes);
+        archive(m_node_count);
     }
 
 private:
-    std::vector<shape_t> m_shapes {};
+    LeafStore<ShapeT> m_shapes {};
     std::pair<Point, Point> m_extents {};
-    std::vector<Node> m_nodes;
-    std::array<std::vector<link_t>, 6> m_links_lists {};
+    std::vector<node_t> m_nodes;
+    std::uint32_t m_node_count = 0;
+    std::optional<Real> m_built_sah_cost = std::nullopt;
+
+    /// The left child of an inner node is always the next node
+    [[nodiscard]] bool is_leaf(std::uint32_t pos) const noexcept {
+        if constexpr (MT) {
+            return m_nodes[pos].m_right == m_npos;
+        } else {
+            const auto miss = m_nodes[pos].m_miss;
+            return miss == pos + 1 || (miss == m_npos && pos + 1 == m_node_count);
+        }
+    }
+
+    /// The miss link of a left child is its sibling
+    [[nodiscard]] std::uint32_t right_child(std::uint32_t pos) const noexcept {
+        if constexpr (MT)
+            return m_nodes[pos].m_right;
+        else
+            return m_nodes[pos + 1].m_miss;
+    }
+
+    [[nodiscard]] std::pair<Point, Point> get_extents(std::uint32_t pos) const noexcept {
+        const auto &node = m_nodes[pos];
+        return {
+            Point(node.m_min[0], node.m_min[1], node.m_min[2]),
+            Point(node.m_max[0], node.m_max[1], node.m_max[2]),
+        };
+    }
+
+    void set_extents(std::uint32_t pos, const std::pair<Point, Point> &extents) noexcept {
+        for (std::size_t axis = 0; axis < 3; axis++) {
+            m_nodes[pos].m_min[axis] = round_down_float(extents.first[axis]);
+            m_nodes[pos].m_max[axis] = round_up_float(extents.second[axis]);
+        }
+    }
+
+    [[nodiscard]] Real sah_cost() const noexcept {
+        if (!m_node_count)
+            return 0;
+
+        SAHCost cost {};
+        for (std::uint32_t pos = 0; pos < m_node_count; pos++) {
+            if (is_leaf(pos))
+                cost.add_leaf(get_extents(pos), m_shapes.checks(shape_range(pos)));
+            else
+                cost.add_inner(get_extents(pos));
+        }
+        return cost.relative_to(get_extents(0));
+    }
+
+    struct FloatRay {
+        std::array<float, 3> m_origin;
+        std::array<float, 3> m_reciprocal;
+    };
+
+    static FloatRay to_float(const Ray &ray) noexcept {
+        FloatRay ret;
+        for (std::size_t axis = 0; axis < 3; axis++) {
+            ret.m_origin[axis] = static_cast<float>(ray.m_origin[axis]);
+            ret.m_reciprocal[axis] = static_cast<float>(ray.m_direction_reciprocals[axis]);
+        }
+        return ret;
+    }
+
+    static bool hits(const node_t &node, const FloatRay &ray, Real t_max) noexcept {
+        float t_near = 0;
+        float t_far = round_up_float(t_max);
+
+        for (std::size_t axis = 0; axis < 3; axis++) {
+            const float t_0 = (node.m_min[axis] - ray.m_origin[axis]) * ray.m_reciprocal[axis];
+            const float t_1 = (node.m_max[axis] - ray.m_origin[axis]) * ray.m_reciprocal[axis];
+
+            t_near = std::max(t_near, std::min(t_0, t_1));
+            t_far = std::min(t_far, std::max(t_0, t_1));
+        }
+
+        return t_near <= t_far * float_slab_far_scale;
+    }
+
+    [[nodiscard]] std::pair<std::uint32_t, std::uint32_t> shape_range(std::uint32_t pos) const noexcept {
+        if constexpr (MT)
+            return { m_nodes[pos].m_shape_start, m_nodes[pos].m_shape_start + m_nodes[pos].m_shape_count };
+        else
+            return { m_nodes[pos].m_shape_start, m_nodes[pos + 1].m_shape_start };
+    }
+
+    [[nodiscard]] std::uint32_t hit_link(std::uint32_t pos, std::size_t axis) const noexcept {
+        if constexpr (MT) {
+            const auto &node = m_nodes[pos];
+            if (node.m_right == m_npos)
+                return node.m_miss[axis];
+            return (node.m_swapped >> axis) & 1 ? node.m_right : pos + 1;
+        } else {
+            return pos + 1;
+        }
+    }
+
+    [[nodiscard]] std::uint32_t miss_link(std::uint32_t pos, std::size_t axis) const noexcept {
+        if constexpr (MT)
+            return m_nodes[pos].m_miss[axis];
+        else
+            return m_nodes[pos].m_miss;
+    }
 
 protected:
+    [[nodiscard]] std::optional<std::pair<Point, Point>> extents_impl() const noexcept override { return m_extents; }
+
     [[nodiscard]] std::optional<Intersection> intersect_impl(
         Ray ray, std::size_t &bound_checks, std::size_t &shape_checks) const noexcept override {
-        std::optional<Intersection> best = std::nullopt;
+        Hit best {};
 
         const auto axis = static_cast<std::size_t>(ray.m_major_direction);
-        const auto &links_list = m_links_lists[MT ? axis : 0];
+        const auto float_ray = to_float(ray);
 
-        for (std::size_t pos = 0; /*pos != npos*/ pos < links_list.size();) {
-            const auto &node = m_nodes[pos];
-            const auto &links = links_list[pos];
-            if constexpr (Paths::ProgramConfig::embed_ray_stats)
+        for (std::uint32_t pos = 0; pos < m_node_count;) {
+            if constexpr (Paths::ProgramConfig::embed_ray_stats) {
                 ++bound_checks;
-            if (Paths::Shape::AxisAlignedBox::ray_intersects(node.m_extents, ray)) {
-                if (const auto [se_min, se_max] = node.m_shape_extents; se_max - se_min) {
-                    if constexpr (Paths::ProgramConfig::embed_ray_stats)
-                        shape_checks += se_max - se_min;
-                    Intersection::replace(
-                        best, Shape::intersect_linear(ray, m_shapes.cbegin() + se_min, m_shapes.cbegin() + se_max));
-                }
-                if constexpr (MT)
-                    pos = links[0];
-                else
-                    ++pos;
-            } else {
-                pos = links[1];
+                NodeCacheModel::fetch(m_nodes[pos]);
+            }
+            if (!hits(m_nodes[pos], float_ray, best.m_distance)) {
+                pos = miss_link(pos, axis);
+                continue;
             }
+
+            if (const auto range = shape_range(pos); range.second - range.first) {
+                if constexpr (Paths::ProgramConfig::embed_ray_stats)
+                    shape_checks += m_shapes.checks(range);
+                m_shapes.closest_hit(ray, range, best);
+            }
+
+            pos = hit_link(pos, axis);
+        }
+
+        if (best.m_primitive == Hit::m_npos)
+            return std::nullopt;
+        return m_shapes.surface_at(ray, best);
+    }
+
+    [[nodiscard]] bool occluded_impl(
+        Ray ray, Real t_max, std::size_t &bound_checks, std::size_t &shape_checks) const noexcept override {
+        const auto axis = static_cast<std::size_t>(ray.m_major_direction);
+        const auto float_ray = to_float(ray);
+
+        for (std::uint32_t pos = 0; pos < m_node_count;) {
+            if constexpr (Paths::ProgramConfig::embed_ray_stats) {
+                ++bound_checks;
+                NodeCacheModel::fetch(m_nodes[pos]);
+            }
+            if (!hits(m_nodes[pos], float_ray, t_max)) {
+                pos = miss_link(pos, axis);
+                continue;
+            }
+
+            if (const auto range = shape_range(pos); range.second - range.first) {
+                if constexpr (Paths::ProgramConfig::embed_ray_stats)
+                    shape_checks += m_shapes.checks(range);
+                if (m_shapes.occluded(ray, t_max, range))
+                    return true;
+            }
+
+            pos = hit_link(pos, axis);
         }
 
-        return best;
+        return false;
     }
 };
 
@@ -1,18 +1,29 @@
 #pragma once
 
+#include "Leaves.hpp"
 #include "Traversal.hpp"
 
 namespace Paths::BVH::Detail {
 
 struct ThinBVHNode {
-    std::array<std::size_t, 2> shapeExtents; // diff. of 0 means empty node
+    std::pair<std::uint32_t, std::uint32_t> shapeExtents; // diff. of 0 means empty node
     std::pair<Point, Point> extents {};
     std::array<std::size_t, 2> children;
+
+    /// See Cache.hpp, std::pair cannot be copied byte by byte
+    template<typename Archive> void serialise(Archive &archive) {
+        archive(shapeExtents);
+        archive(extents);
+        archive(children);
+    }
 };
 
 template<typename ShapeT = void> struct ThinBVHTree final : public ShapeStore {
     typedef typename Shape::BoundableShapeT<ShapeT> shape_t;
 
+    /// An empty tree that is only to be filled by loading a cache into it, see Cache.hpp
+    ThinBVHTree() = default;
+
     explicit ThinBVHTree(const TraversableBVHTree<ShapeT> &tree) {
         const auto &root = dynamic_cast<const TraversableBVHNode<ShapeT> &>(tree.root());
 
@@ -21,72 +32,324 @@ template<typename ShapeT = void> struct ThinBVHTree final : public ShapeStore {
         root.template traverse<Detail::ETraversalOrder::BreadthFirst>([this](const auto &n, std::size_t stackDepth) {
             const auto &node = dynamic_cast<const TraversableBVHNode<ShapeT> &>(n);
 
-            const std::size_t start = shapes.size();
-            auto nodeShapes = node.get_shapes();
-            std::copy(nodeShapes.begin(), nodeShapes.end(), std::back_inserter(shapes));
-            const std::size_t end = shapes.size();
+            const auto shapeExtents = shapes.append(node.get_shapes());
 
             const std::size_t lhsChild = nodes.size() + stackDepth + 1;
-            nodes.push_back({ .shapeExtents = { start, end },
+            nodes.push_back({ .shapeExtents = shapeExtents,
                 .extents = node.get_extents(),
                 .children = { lhsChild, lhsChild + 1 } });
         });
 
-        /// TODO: use memoization here, for the (per-node current) depth calculations
-        root.template traverse<Detail::ETraversalOrder::PreOrder>([this](const auto &n) {
-            std::size_t currentDepth = 0;
-            const auto *current = std::addressof(n);
-            while (current->parent()) {
-                ++currentDepth;
-                current = current->parent();
-            }
-
-            maxDepth = std::max(maxDepth, currentDepth);
-        });
+        maxDepth = root.get_statistics().m_max_depth;
     }
 
-    std::vector<shape_t> shapes {};
+    LeafStore<ShapeT> shapes {};
     std::vector<ThinBVHNode> nodes {};
 
+    /// Replaces every shape s with fn(s), refit has to be called afterwards
+    template<typename Fn> void transformShapes(Fn &&fn, bool parallel = !ProgramConfig::single_thread) {
+        shapes.transform(std::forward<Fn>(fn), parallel);
+    }
+
+    /// Updates the extents of the nodes after the shapes have moved, the topology stays the same
+    /// \return The cost of the tree relative to its cost before the first refit, see Detail::refit_rebuild_threshold
+    Real refit(bool parallel = !ProgramConfig::single_thread) noexcept {
+        if (!builtSAHCost)
+            builtSAHCost = sahCost();
+
+        Utils::parallel_chunks(nodes.size(), parallel ? ProgramConfig::preferred_thread_count() : 1,
+            [this](std::size_t, std::size_t start, std::size_t end) {
+                for (std::size_t i = start; i < end; i++)
+                    if (isLeaf(nodes[i]))
+                        nodes[i].extents = shapes.extents(nodes[i].shapeExtents);
+            });
+
+        // children come after their parents in breadth first order
+        for (std::size_t i = nodes.size(); i-- > 0;) {
+            if (isLeaf(nodes[i]))
+                continue;
+            const auto [lhs, rhs] = nodes[i].children;
+            nodes[i].extents = Shape::merge_extents(nodes[lhs].extents, nodes[rhs].extents);
+        }
+
+        bounds_changed();
+        return *builtSAHCost > 0 ? sahCost() / *builtSAHCost : 1;
+    }
+
+    template<typename Archive> void serialise(Archive &archive) {
+        archive(shapes);
+        archive(nodes);
+        archive(maxDepth);
+    }
+
 protected:
     [[nodiscard]] std::optional<Intersection> intersect_impl(
         Ray ray, std::size_t &boundChecks, std::size_t &shapeChecks) const noexcept override {
-        std::vector<std::size_t> callStack(maxDepth + 1, 0);
+        if (stackSize() <= stackCapacity) {
+            std::array<std::pair<std::size_t, Real>, stackCapacity> callStack;
+            return closestHit(ray, callStack, boundChecks, shapeChecks);
+        }
+
+        std::vector<std::pair<std::size_t, Real>> callStack(stackSize());
+        return closestHit(ray, callStack, boundChecks, shapeChecks);
+    }
+
+    [[nodiscard]] bool occluded_impl(
+        Ray ray, Real tMax, std::size_t &boundChecks, std::size_t &shapeChecks) const noexcept override {
+        if (stackSize() <= stackCapacity) {
+            std::array<std::size_t, stackCapacity> callStack;
+            return anyHit(ray, tMax, callStack, boundChecks, shapeChecks);
+        }
+
+        std::vector<std::size_t> callStack(stackSize());
+        return anyHit(ray, tMax, callStack, boundChecks, shapeChecks);
+    }
+
+    [[nodiscard]] std::optional<std::pair<Point, Point>> extents_impl() const noexcept override {
+        return nodes[0].extents;
+    }
+
+    void intersect_packet_impl(std::span<const Ray> rays, std::span<std::optional<Intersection>> isects,
+        std::size_t &boundChecks, std::size_t &shapeChecks) const noexcept override {
+        if (stackSize() > stackCapacity) {
+            ShapeStore::intersect_packet_impl(rays, isects, boundChecks, shapeChecks);
+            return;
+        }
+
+        std::array<Hit, m_packet_size> hits {};
+        closestHitPacket(rays, hits, boundChecks, shapeChecks);
+
+        for (std::size_t i = 0; i < rays.size(); i++) {
+            if (hits[i].m_primitive == Hit::m_npos)
+                isects[i] = std::nullopt;
+            else
+                isects[i] = shapes.surface_at(rays[i], hits[i]);
+        }
+    }
+
+private:
+    /// Traversals of trees up to this deep keep their stacks on the call stack, deeper ones allocate them
+    static constexpr std::size_t stackCapacity = 64;
+
+    std::size_t maxDepth = 0;
+    std::optional<Real> builtSAHCost = std::nullopt;
+
+    /// A tree that is a single empty leaf has out of bounds children
+    [[nodiscard]] bool isLeaf(const ThinBVHNode &node) const noexcept {
+        return node.shapeExtents.second != node.shapeExtents.first || node.children[0] >= nodes.size();
+    }
+
+    [[nodiscard]] Real sahCost() const noexcept {
+        SAHCost cost {};
+        for (const auto &node : nodes) {
+            if (isLeaf(node))
+                cost.add_leaf(node.extents, shapes.checks(node.shapeExtents));
+            else
+                cost.add_inner(node.extents);
+        }
+        return cost.relative_to(nodes[0].extents);
+    }
+
+    /// Packets get split into groups of this many rays which are tested against a box at once
+    static constexpr std::size_t packetLanes = 4;
+    static constexpr std::size_t maxRayGroups = m_packet_size / packetLanes;
+
+    typedef Maths::simd_t<Real, packetLanes> vreal_t;
+
+    struct RayGroup {
+        std::array<vreal_t, 3> origin;
+        std::array<vreal_t, 3> reciprocal;
+
+        /// The distances of the closest hits so far, negative for the padding lanes of the last group
+        vreal_t tMax;
+    };
+
+    /// The lanes of the group whose rays enter the box before their tMax
+    static auto groupHits(const std::pair<Point, Point> &extents, const RayGroup &group) noexcept {
+        vreal_t tNear = vreal_t {};
+        vreal_t tFar = group.tMax;
+
+        for (std::size_t axis = 0; axis < 3; axis++) {
+            const vreal_t t0 = (extents.first[axis] - group.origin[axis]) * group.reciprocal[axis];
+            const vreal_t t1 = (extents.second[axis] - group.origin[axis]) * group.reciprocal[axis];
+
+            tNear = Maths::simd_max(tNear, Maths::simd_min(t0, t1));
+            tFar = Maths::simd_min(tFar, Maths::simd_max(t0, t1));
+        }
+
+        return tNear <= tFar;
+    }
+
+    /// Every pop pushes at most two nodes that are one level deeper
+    [[nodiscard]] std::size_t stackSize() const noexcept { return maxDepth + 2; }
+
+    /// \param callStack Should have room for stackSize() elements
+    [[nodiscard]] std::optional<Intersection> closestHit(Ray ray, std::span<std::pair<std::size_t, Real>> callStack,
+        std::size_t &boundChecks, std::size_t &shapeChecks) const noexcept {
+        Hit best {};
+
+        if constexpr (Paths::ProgramConfig::embed_ray_stats) {
+            ++boundChecks;
+            NodeCacheModel::fetch(nodes[0]);
+        }
+        const auto rootEntry = Shape::AxisAlignedBox::ray_entry(nodes[0].extents, ray, inf);
+        if (!rootEntry)
+            return std::nullopt;
+
+        // node indices along with the distances at which the ray enters them
         auto stackPointer = callStack.begin();
-        *stackPointer++ = 0;
+        *stackPointer++ = { 0, *rootEntry };
+
+        while (stackPointer != callStack.begin()) {
+            const auto [current, entry] = *--stackPointer;
+            if (entry > best.m_distance)
+                continue;
+
+            const auto &node = nodes[current];
+
+            if (node.shapeExtents.second - node.shapeExtents.first) {
+                if constexpr (Paths::ProgramConfig::embed_ray_stats)
+                    shapeChecks += shapes.checks(node.shapeExtents);
+                shapes.closest_hit(ray, node.shapeExtents, best);
+                continue;
+            }
+
+            auto [near, far] = node.children;
+
+            if constexpr (Paths::ProgramConfig::embed_ray_stats) {
+                boundChecks += 2;
+                NodeCacheModel::fetch(nodes[near]);
+                NodeCacheModel::fetch(nodes[far]);
+            }
+            auto nearEntry = Shape::AxisAlignedBox::ray_entry(nodes[near].extents, ray, best.m_distance);
+            auto farEntry = Shape::AxisAlignedBox::ray_entry(nodes[far].extents, ray, best.m_distance);
+
+            if (!nearEntry || (farEntry && *farEntry < *nearEntry)) {
+                std::swap(near, far);
+                std::swap(nearEntry, farEntry);
+            }
+
+            // the nearer child gets popped first
+            if (farEntry)
+                *stackPointer++ = { far, *farEntry };
+            if (nearEntry)
+                *stackPointer++ = { near, *nearEntry };
+        }
+
+        if (best.m_primitive == Hit::m_npos)
+            return std::nullopt;
+        return shapes.surface_at(ray, best);
+    }
+
+    /// Visits the nodes that any of the rays hit. Every stack entry remembers the first group of rays that hit the
+    /// parent, the groups before it are not tested against the node again.
+    void closestHitPacket(std::span<const Ray> rays, std::span<Hit> hits, std::size_t &boundChecks,
+        std::size_t &shapeChecks) const noexcept {
+        const std::size_t groupCount = (rays.size() + packetLanes - 1) / packetLanes;
+
+        std::array<RayGroup, maxRayGroups> groups {};
+        for (std::size_t i = 0; i < groupCount * packetLanes; i++) {
+            auto &group = groups[i / packetLanes];
+            const auto lane = i % packetLanes;
+
+            if (i >= rays.size()) {
+                group.tMax[lane] = -1;
+                continue;
+            }
+
+            for (std::size_t axis = 0; axis < 3; axis++) {
+                group.origin[axis][lane] = rays[i].m_origin[axis];
+                group.reciprocal[axis][lane] = rays[i].m_direction_reciprocals[axis];
+            }
+            group.tMax[lane] = inf;
+        }
 
-        std::optional<Intersection> best {};
+        // node indices along with the first groups that might hit them
+        std::array<std::pair<std::size_t, std::size_t>, stackCapacity> callStack;
+        auto stackPointer = callStack.begin();
+        *stackPointer++ = { 0, 0 };
 
         while (stackPointer != callStack.begin()) {
-            const auto current = *(stackPointer - 1);
-            --stackPointer;
+            const auto [current, firstCandidate] = *--stackPointer;
             const auto &node = nodes[current];
 
-            if constexpr (Paths::ProgramConfig::embed_ray_stats)
-                ++boundChecks;
-            if (!Shape::AxisAlignedBox::ray_intersects(node.extents, ray))
+            auto first = firstCandidate;
+            for (; first < groupCount; first++) {
+                if constexpr (Paths::ProgramConfig::embed_ray_stats)
+                    ++boundChecks;
+                if (Maths::simd_any(groupHits(node.extents, groups[first])))
+                    break;
+            }
+
+            if (first == groupCount)
+                continue;
+
+            if (node.shapeExtents.second - node.shapeExtents.first) {
+                for (auto group = first; group < groupCount; group++) {
+                    const auto mask = groupHits(node.extents, groups[group]);
+
+                    for (std::size_t lane = 0; lane < packetLanes; lane++) {
+                        if (!mask[lane])
+                            continue;
+
+                        const auto i = group * packetLanes + lane;
+                        if constexpr (Paths::ProgramConfig::embed_ray_stats)
+                            shapeChecks += shapes.checks(node.shapeExtents);
+                        if (shapes.closest_hit(rays[i], node.shapeExtents, hits[i]))
+                            groups[group].tMax[lane] = hits[i].m_distance;
+                    }
+                }
+
                 continue;
+            }
 
-            const auto [shapesStart, shapesEnd] = node.shapeExtents;
-            const auto shapesCount = shapesEnd - shapesStart;
+            // the child nearer to the first ray of the first group gets popped first, the lane 0 of any group but the
+            // last one is never padding
+            auto [near, far] = node.children;
+            const Point separation = (nodes[far].extents.first + nodes[far].extents.second)
+                - (nodes[near].extents.first + nodes[near].extents.second);
+            std::size_t axis = 0;
+            for (std::size_t i = 1; i < 3; i++)
+                if (std::abs(separation[i]) > std::abs(separation[axis]))
+                    axis = i;
+            if (separation[axis] * rays[first * packetLanes].m_direction[axis] < 0)
+                std::swap(near, far);
 
-            if (!shapesCount) {
+            *stackPointer++ = { far, first };
+            *stackPointer++ = { near, first };
+        }
+    }
+
+    /// \param callStack Should have room for stackSize() elements
+    [[nodiscard]] bool anyHit(Ray ray, Real tMax, std::span<std::size_t> callStack, std::size_t &boundChecks,
+        std::size_t &shapeChecks) const noexcept {
+        auto stackPointer = callStack.begin();
+        *stackPointer++ = 0;
+
+        while (stackPointer != callStack.begin()) {
+            const auto &node = nodes[*--stackPointer];
+
+            if constexpr (Paths::ProgramConfig::embed_ray_stats) {
+                ++boundChecks;
+                NodeCacheModel::fetch(node);
+            }
+            if (!Shape::AxisAlignedBox::ray_entry(node.extents, ray, tMax))
+                continue;
+
+            if (node.shapeExtents.second == node.shapeExtents.first) {
                 *stackPointer++ = node.children[1];
                 *stackPointer++ = node.children[0];
                 continue;
             }
 
             if constexpr (Paths::ProgramConfig::embed_ray_stats)
-                shapeChecks += shapesCount;
-            auto newIsection = Shape::intersect_linear(ray, shapes.cbegin() + shapesStart, shapes.cbegin() + shapesEnd);
-            Intersection::replace(best, std::move(newIsection));
+                shapeChecks += shapes.checks(node.shapeExtents);
+            if (shapes.occluded(ray, tMax, node.shapeExtents))
+                return true;
         }
 
-        return best;
+        return false;
     }
-
-private:
-    std::size_t maxDepth = 0;
 };
 
 }
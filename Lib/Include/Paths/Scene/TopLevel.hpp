@@ -0,0 +1,437 @@
+#pragma once
+
+#include <memory>
+
+#include "Maths/MatVec.hpp"
+#include "Traversal.hpp"
+
+namespace Paths::BVH {
+
+/// A store placed into the world by world = object * m_transform + m_offset, like Triangle::transformed moves
+/// vertices. The store is shared, any number of instances can refer to the same one.
+struct Instance {
+    std::shared_ptr<const ShapeStore> m_store;
+    Matrix m_transform = Maths::identity_matrix<Real, 3>();
+    Point m_offset { 0, 0, 0 };
+};
+
+/// The top level of a two level hierarchy: a BVH over the world space bounds of instances of other stores. Rays that
+/// reach an instance get moved into its object space and traced by the instanced store itself, so the shapes of a
+/// store exist once no matter how many times it gets instanced. Instances of unbounded stores (ones with planes) are
+/// kept out of the hierarchy and tested against every ray.
+class TopLevelBVH final : public ShapeStore {
+public:
+    void insert_instance(Instance instance) noexcept {
+        const auto inverse = Maths::inverse(instance.m_transform);
+        const bool identity = instance.m_transform.m_impl == Maths::identity_matrix<Real, 3>().m_impl
+            && instance.m_offset.impl_data() == Point(0, 0, 0).impl_data();
+
+        m_instances.push_back({
+            .m_instance = std::move(instance),
+            .m_inverse = inverse,
+            .m_normal_transform = Maths::transpose(inverse),
+            .m_identity = identity,
+        });
+        m_built = false;
+    }
+
+    /// (Re)builds the hierarchy over the instances, has to be called after inserting instances or after the instanced
+    /// stores change their bounds
+    void build() noexcept {
+        m_nodes.clear();
+        m_max_depth = 0;
+
+        std::vector<std::pair<Point, Point>> extents;
+        std::vector<PreparedInstance> bounded;
+        std::vector<PreparedInstance> unbounded;
+
+        for (auto &instance : m_instances) {
+            // stores that were empty at the last build may not be anymore
+            instance.m_empty = false;
+
+            const auto world_extents = instance.world_extents();
+            if (!world_extents) {
+                unbounded.push_back(std::move(instance));
+            } else if (world_extents->first[0] <= world_extents->second[0]) {
+                extents.push_back(*world_extents);
+                bounded.push_back(std::move(instance));
+            } else {
+                // empty stores are left out of the hierarchy but kept for later builds
+                unbounded.push_back(std::move(instance));
+                unbounded.back().m_empty = true;
+            }
+        }
+
+        m_bounded_count = bounded.size();
+
+        std::vector<std::uint32_t> order(bounded.size());
+        std::iota(order.begin(), order.end(), 0);
+        if (!order.empty()) {
+            m_nodes.emplace_back();
+            build_node(0, order, 0, order.size(), extents, 1);
+        }
+
+        m_instances.clear();
+        m_instances.reserve(bounded.size() + unbounded.size());
+        for (const auto index : order)
+            m_instances.push_back(std::move(bounded[index]));
+        for (auto &instance : unbounded)
+            m_instances.push_back(std::move(instance));
+
+        m_built = true;
+        bounds_changed();
+    }
+
+    [[nodiscard]] bool is_built() const noexcept { return m_built; }
+
+    [[nodiscard]] std::size_t instance_count() const noexcept { return m_instances.size(); }
+
+    /// Counts the shapes of every instance, shared stores are counted once per instance
+    [[nodiscard]] std::size_t total_shape_count() const noexcept override {
+        std::size_t count = 0;
+        for (const auto &instance : m_instances)
+            count += instance.m_instance.m_store->total_shape_count();
+        return count;
+    }
+
+protected:
+    [[nodiscard]] std::optional<Intersection> intersect_impl(
+        Ray ray, std::size_t &bound_checks, std::size_t &shape_checks) const noexcept override {
+        std::optional<Intersection> best = std::nullopt;
+
+        for (std::size_t i = m_bounded_count; i < m_instances.size(); i++)
+            if (!m_instances[i].m_empty)
+                Intersection::replace(best, m_instances[i].intersect(ray, bound_checks, shape_checks));
+
+        if (m_nodes.empty())
+            return best;
+
+        if (stack_size() <= m_stack_capacity) {
+            std::array<std::pair<std::size_t, Real>, m_stack_capacity> stack;
+            closest_hit(ray, stack, best, bound_checks, shape_checks);
+        } else {
+            std::vector<std::pair<std::size_t, Real>> stack(stack_size());
+            closest_hit(ray, stack, best, bound_checks, shape_checks);
+        }
+
+        return best;
+    }
+
+    [[nodiscard]] bool occluded_impl(
+        Ray ray, Real t_max, std::size_t &bound_checks, std::size_t &shape_checks) const noexcept override {
+        for (std::size_t i = m_bounded_count; i < m_instances.size(); i++)
+            if (!m_instances[i].m_empty && m_instances[i].occluded(ray, t_max, bound_checks, shape_checks))
+                return true;
+
+        if (m_nodes.empty())
+            return false;
+
+        if (stack_size() <= m_stack_capacity) {
+            std::array<std::size_t, m_stack_capacity> stack;
+            return any_hit(ray, t_max, stack, bound_checks, shape_checks);
+        }
+
+        std::vector<std::size_t> stack(stack_size());
+        return any_hit(ray, t_max, stack, bound_checks, shape_checks);
+    }
+
+    /// Identity instances get whole packets, transformed ones trace the rays of a packet one by one
+    void intersect_packet_impl(std::span<const Ray> rays, std::span<std::optional<Intersection>> isects,
+        std::size_t &bound_checks, std::size_t &shape_checks) const noexcept override {
+        if (stack_size() > m_stack_capacity) {
+            ShapeStore::intersect_packet_impl(rays, isects, bound_checks, shape_checks);
+            return;
+        }
+
+        std::fill(isects.begin(), isects.end(), std::nullopt);
+
+        for (std::size_t i = m_bounded_count; i < m_instances.size(); i++)
+            if (!m_instances[i].m_empty)
+                m_instances[i].intersect_packet(rays, isects, bound_checks, shape_checks);
+
+        if (m_nodes.empty())
+            return;
+
+        std::array<std::size_t, m_stack_capacity> stack;
+        auto stack_pointer = stack.begin();
+        *stack_pointer++ = 0;
+
+        while (stack_pointer != stack.begin()) {
+            const auto &node = m_nodes[*--stack_pointer];
+
+            bool hit = false;
+            for (std::size_t i = 0; i < rays.size() && !hit; i++) {
+                if constexpr (Paths::ProgramConfig::embed_ray_stats)
+                    ++bound_checks;
+                const Real t_max = isects[i] ? isects[i]->m_distance : inf;
+                hit = Shape::AxisAlignedBox::ray_entry(node.m_extents, rays[i], t_max).has_value();
+            }
+
+            if (!hit)
+                continue;
+
+            if (node.m_leaf) {
+                m_instances[node.m_start].intersect_packet(rays, isects, bound_checks, shape_checks);
+                continue;
+            }
+
+            *stack_pointer++ = node.m_start + 1;
+            *stack_pointer++ = node.m_start;
+        }
+    }
+
+    [[nodiscard]] std::optional<std::pair<Point, Point>> extents_impl() const noexcept override {
+        for (std::size_t i = m_bounded_count; i < m_instances.size(); i++)
+            if (!m_instances[i].m_empty)
+                return std::nullopt;
+        return m_nodes.empty() ? Shape::empty_extents : m_nodes[0].m_extents;
+    }
+
+private:
+    struct PreparedInstance {
+        Instance m_instance;
+        Matrix m_inverse;
+
+        /// Takes object space normals to world space
+        Matrix m_normal_transform;
+
+        /// Rays of identity instances are passed to the store as they are
+        bool m_identity;
+
+        /// Set by build for instances of stores that hold nothing
+        bool m_empty = false;
+
+        /// The bounds of the 8 transformed corners of the bounds of the store
+        [[nodiscard]] std::optional<std::pair<Point, Point>> world_extents() const noexcept {
+            const auto object_extents = m_instance.m_store->get_extents();
+            if (!object_extents || m_identity || object_extents->first[0] > object_extents->second[0])
+                return object_extents;
+
+            std::pair<Point, Point> extents = Shape::empty_extents;
+            for (std::size_t corner = 0; corner < 8; corner++) {
+                const Point p((corner & 1) ? object_extents->second[0] : object_extents->first[0],
+                    (corner & 2) ? object_extents->second[1] : object_extents->first[1],
+                    (corner & 4) ? object_extents->second[2] : object_extents->first[2]);
+                extents = Shape::merge_extents(extents, Point(p * m_instance.m_transform + m_instance.m_offset));
+            }
+            return extents;
+        }
+
+        /// The ray in object space with a normalised direction, along with how many object space units one world
+        /// space unit along the ray is
+        [[nodiscard]] std::pair<Ray, Real> to_object_space(const Ray &ray) const noexcept {
+            const Point origin = (ray.m_origin - m_instance.m_offset) * m_inverse;
+            const Point direction = ray.m_direction * m_inverse;
+            const Real scale = Maths::Magnitude(direction);
+            return { Ray(origin, direction / scale), scale };
+        }
+
+        [[nodiscard]] std::optional<Intersection> intersect(
+            const Ray &ray, std::size_t &bound_checks, std::size_t &shape_checks) const noexcept {
+            if (m_identity)
+                return m_instance.m_store->intersect_ray(ray, bound_checks, shape_checks);
+
+            const auto [object_ray, scale] = to_object_space(ray);
+            const auto isect = m_instance.m_store->intersect_ray(object_ray, bound_checks, shape_checks);
+            if (!isect)
+                return std::nullopt;
+
+            const Point normal = Maths::normalized(Point(isect->m_normal * m_normal_transform));
+            return Intersection(ray, isect->m_mat_index, isect->m_distance / scale, normal, isect->m_uv);
+        }
+
+        /// Replaces the hits in isects that the instance has closer hits than
+        void intersect_packet(std::span<const Ray> rays, std::span<std::optional<Intersection>> isects,
+            std::size_t &bound_checks, std::size_t &shape_checks) const noexcept {
+            if (!m_identity) {
+                for (std::size_t i = 0; i < rays.size(); i++)
+                    Intersection::replace(isects[i], intersect(rays[i], bound_checks, shape_checks));
+                return;
+            }
+
+            std::array<std::optional<Intersection>, m_packet_size> instance_isects;
+            m_instance.m_store->intersect_packet(
+                rays, std::span(instance_isects).first(rays.size()), bound_checks, shape_checks);
+            for (std::size_t i = 0; i < rays.size(); i++)
+                Intersection::replace(isects[i], std::move(instance_isects[i]));
+        }
+
+        [[nodiscard]] bool occluded(
+            const Ray &ray, Real t_max, std::size_t &bound_checks, std::size_t &shape_checks) const noexcept {
+            if (m_identity)
+                return m_instance.m_store->occluded(ray, t_max, bound_checks, shape_checks);
+
+            const auto [object_ray, scale] = to_object_space(ray);
+            return m_instance.m_store->occluded(object_ray, t_max * scale, bound_checks, shape_checks);
+        }
+    };
+
+    struct Node {
+        std::pair<Point, Point> m_extents;
+
+        /// The instance of leaves, the first of the two consecutive children of inner nodes
+        std::uint32_t m_start;
+
+        bool m_leaf;
+    };
+
+    /// Traversals of trees up to this deep keep their stacks on the call stack, deeper ones allocate them
+    static constexpr std::size_t m_stack_capacity = 64;
+
+    /// Bounded instances come first, in the order of the leaves of the hierarchy
+    std::vector<PreparedInstance> m_instances {};
+    std::size_t m_bounded_count = 0;
+
+    std::vector<Node> m_nodes {};
+    std::size_t m_max_depth = 0;
+    bool m_built = true;
+
+    /// Every pop pushes at most two nodes that are one level deeper
+    [[nodiscard]] std::size_t stack_size() const noexcept { return m_max_depth + 2; }
+
+    /// Leaves hold a single instance, the split of every inner node is the one with the lowest SAH cost among the
+    /// splits of the instances sorted by their centers along each axis
+    void build_node(std::size_t node_index, std::vector<std::uint32_t> &order, std::size_t start, std::size_t end,
+        const std::vector<std::pair<Point, Point>> &extents, std::size_t depth) noexcept {
+        m_max_depth = std::max(m_max_depth, depth);
+
+        std::pair<Point, Point> node_extents = Shape::empty_extents;
+        for (std::size_t i = start; i < end; i++)
+            node_extents = Shape::merge_extents(node_extents, extents[order[i]]);
+        m_nodes[node_index].m_extents = node_extents;
+
+        const std::size_t count = end - start;
+        if (count == 1) {
+            m_nodes[node_index].m_start = static_cast<std::uint32_t>(start);
+            m_nodes[node_index].m_leaf = true;
+            return;
+        }
+
+        const auto center = [&extents](std::uint32_t index, std::size_t axis) {
+            return extents[index].first[axis] + extents[index].second[axis];
+        };
+
+        std::vector<Real> right_areas(count);
+        std::vector<std::uint32_t> best_order;
+        std::size_t best_split = count / 2;
+        Real best_cost = inf;
+
+        for (std::size_t axis = 0; axis < 3; axis++) {
+            std::vector<std::uint32_t> axis_order(order.begin() + start, order.begin() + end);
+            std::sort(axis_order.begin(), axis_order.end(),
+                [&center, axis](auto lhs, auto rhs) { return center(lhs, axis) < center(rhs, axis); });
+
+            std::pair<Point, Point> right = Shape::empty_extents;
+            for (std::size_t i = count; i-- > 1;) {
+                right = Shape::merge_extents(right, extents[axis_order[i]]);
+                right_areas[i] = Shape::surface_area(right);
+            }
+
+            std::pair<Point, Point> left = Shape::empty_extents;
+            for (std::size_t i = 1; i < count; i++) {
+                left = Shape::merge_extents(left, extents[axis_order[i - 1]]);
+                const Real cost = Shape::surface_area(left) * static_cast<Real>(i)
+                    + right_areas[i] * static_cast<Real>(count - i);
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_split = i;
+                    best_order = axis_order;
+                }
+            }
+        }
+
+        std::copy(best_order.cbegin(), best_order.cend(), order.begin() + start);
+
+        const auto children = static_cast<std::uint32_t>(m_nodes.size());
+        m_nodes[node_index].m_start = children;
+        m_nodes[node_index].m_leaf = false;
+        m_nodes.emplace_back();
+        m_nodes.emplace_back();
+
+        build_node(children, order, start, start + best_split, extents, depth + 1);
+        build_node(children + 1, order, start + best_split, end, extents, depth + 1);
+    }
+
+    /// \param stack Should have room for stack_size() elements
+    void closest_hit(Ray ray, std::span<std::pair<std::size_t, Real>> stack, std::optional<Intersection> &best,
+        std::size_t &bound_checks, std::size_t &shape_checks) const noexcept {
+        const auto t_max = [&best] { return best ? best->m_distance : inf; };
+
+        if constexpr (Paths::ProgramConfig::embed_ray_stats) {
+            ++bound_checks;
+            NodeCacheModel::fetch(m_nodes[0]);
+        }
+        const auto root_entry = Shape::AxisAlignedBox::ray_entry(m_nodes[0].m_extents, ray, t_max());
+        if (!root_entry)
+            return;
+
+        // node indices along with the distances at which the ray enters them
+        auto stack_pointer = stack.begin();
+        *stack_pointer++ = { 0, *root_entry };
+
+        while (stack_pointer != stack.begin()) {
+            const auto [current, entry] = *--stack_pointer;
+            if (entry > t_max())
+                continue;
+
+            const auto &node = m_nodes[current];
+
+            if (node.m_leaf) {
+                Intersection::replace(best, m_instances[node.m_start].intersect(ray, bound_checks, shape_checks));
+                continue;
+            }
+
+            std::size_t near = node.m_start, far = node.m_start + 1;
+
+            if constexpr (Paths::ProgramConfig::embed_ray_stats) {
+                bound_checks += 2;
+                NodeCacheModel::fetch(m_nodes[near]);
+                NodeCacheModel::fetch(m_nodes[far]);
+            }
+            auto near_entry = Shape::AxisAlignedBox::ray_entry(m_nodes[near].m_extents, ray, t_max());
+            auto far_entry = Shape::AxisAlignedBox::ray_entry(m_nodes[far].m_extents, ray, t_max());
+
+            if (!near_entry || (far_entry && *far_entry < *near_entry)) {
+                std::swap(near, far);
+                std::swap(near_entry, far_entry);
+            }
+
+            // the nearer child gets popped first
+            if (far_entry)
+                *stack_pointer++ = { far, *far_entry };
+            if (near_entry)
+                *stack_pointer++ = { near, *near_entry };
+        }
+    }
+
+    /// \param stack Should have room for stack_size() elements
+    [[nodiscard]] bool any_hit(Ray ray, Real t_max, std::span<std::size_t> stack, std::size_t &bound_checks,
+        std::size_t &shape_checks) const noexcept {
+        auto stack_pointer = stack.begin();
+        *stack_pointer++ = 0;
+
+        while (stack_pointer != stack.begin()) {
+            const auto &node = m_nodes[*--stack_pointer];
+
+            if constexpr (Paths::ProgramConfig::embed_ray_stats) {
+                ++bound_checks;
+                NodeCacheModel::fetch(node);
+            }
+            if (!Shape::AxisAlignedBox::ray_entry(node.m_extents, ray, t_max))
+                continue;
+
+            if (node.m_leaf) {
+                if (m_instances[node.m_start].occluded(ray, t_max, bound_checks, shape_checks))
+                    return true;
+                continue;
+            }
+
+            *stack_pointer++ = node.m_start + 1;
+            *stack_pointer++ = node.m_start;
+        }
+
+        return false;
+    }
+};
+
+}
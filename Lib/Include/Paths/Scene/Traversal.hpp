@@ -1,13 +1,20 @@
 #pragma once
 
 #include <concepts>
+#include <bit>
+#include <deque>
+#include <numeric>
 #include <span>
 #include <stack>
 #include <type_traits>
 
+#include "Maths/Morton.hpp"
+#include "NodeCache.hpp"
 #include "Paths/Common.hpp"
 #include "Paths/Ray.hpp"
 #include "Paths/Shape/Shapes.hpp"
+#include "Utils/Parallel.hpp"
+#include "Utils/RadixSort.hpp"
 
 namespace Paths {
 
@@ -31,6 +38,99 @@ enum class ETraversalOrder {
     BreadthFirst,
 };
 
+/// Relative costs used by the surface area heuristic, only their ratio matters
+static constexpr Real sah_traversal_cost = 1;
+static constexpr Real sah_intersection_cost = 1;
+
+/// Conservative bound for the rounding errors of single precision slab tests, applied to the exit distances
+static constexpr float float_slab_far_scale = 1.f + 4.f * std::numeric_limits<float>::epsilon();
+
+/// Bounds stored in single precision are rounded outwards so that they contain the double precision ones
+static inline float round_down_float(Real v) noexcept {
+    const auto f = static_cast<float>(v);
+    return static_cast<Real>(f) > v ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+static inline float round_up_float(Real v) noexcept {
+    const auto f = static_cast<float>(v);
+    return static_cast<Real>(f) < v ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+/// Sums up the surface area heuristic cost of a tree node by node, in the same way as TreeStatistics::m_sah_cost
+struct SAHCost {
+    Real m_cost = 0;
+
+    void add_inner(const std::pair<Point, Point> &extents) noexcept {
+        m_cost += Shape::surface_area(extents) * sah_traversal_cost;
+    }
+
+    void add_leaf(const std::pair<Point, Point> &extents, std::size_t shape_count) noexcept {
+        m_cost += Shape::surface_area(extents) * static_cast<Real>(shape_count) * sah_intersection_cost;
+    }
+
+    [[nodiscard]] Real relative_to(const std::pair<Point, Point> &root_extents) const noexcept {
+        const auto root_area = Shape::surface_area(root_extents);
+        return root_area > 0 ? m_cost / root_area : m_cost;
+    }
+};
+
+/// Refitting keeps the topology, which gets worse the more the shapes move relative to each other. Rebuilding is
+/// likely to pay off once the cost of a refitted tree relative to the cost it had when it was built exceeds this.
+static constexpr Real refit_rebuild_threshold = 1.5;
+
+/// Spatial splits are only looked for where the children of the best object split overlap by more than this fraction
+/// of the surface area of the root, elsewhere they are unlikely to pay off
+static constexpr Real spatial_split_overlap_threshold = 1e-5;
+
+/// How many more references than shapes a tree with spatial splits may have, relative to the number of shapes
+static constexpr Real default_duplication_budget = .3;
+
+/// Nodes with at least this many shapes get their children built concurrently and their partitioning done in parallel
+static constexpr std::size_t parallel_build_threshold = 16384;
+
+/// Forking stops below this depth so that there are a few times more subtree builds than threads, for balance
+static inline std::size_t parallel_build_fork_depth() noexcept {
+    return std::bit_width(ProgramConfig::preferred_thread_count()) + 2;
+}
+
+}
+
+namespace Paths::BVH {
+
+enum class EPartitionType {
+    Middle,
+    Median,
+    BinnedSAH,
+
+    /// Not a partitioner per se, the whole tree is built at once as a linear BVH
+    Morton,
+
+    /// Binned SAH that may also split space, referencing shapes from both sides, see Detail::SpatialSplitBuilder
+    Spatial,
+};
+
+struct TreeStatistics {
+    std::size_t m_node_count = 0;
+    std::size_t m_leaf_count = 0;
+    std::size_t m_max_depth = 0;
+    std::size_t m_max_leaf_shapes = 0;
+
+    /// The number of shapes in the leaves, more than the number of shapes if spatial splits duplicated some
+    std::size_t m_reference_count = 0;
+
+    /// The expected cost of a ray that hits the root node, with the costs in Detail::sah_*_cost
+    Real m_sah_cost = 0;
+
+    /// Only known for trees built with Detail::BVHTree::build, 0 otherwise
+    Real m_build_seconds = 0;
+
+    /// The memory taken by the nodes of a Detail::BVHTree, 0 for other trees
+    std::size_t m_node_memory_bytes = 0;
+
+    /// The peak resident set size of the whole process right after the build, see m_build_seconds
+    std::size_t m_peak_resident_bytes = 0;
+};
+
 }
 
 namespace Paths::BVH {
@@ -107,7 +207,7 @@ private:
     }
 
     template<typename Callback, bool isConst> void traverse_impl_impl_bfs(Callback &cb) const {
-        std::list<node_pointer_t<isConst>> queue {};
+        std::deque<node_pointer_t<isConst>> queue {};
         queue.push_back(const_cast<node_pointer_t<isConst>>(this));
 
         while (!queue.empty()) {
@@ -158,41 +258,66 @@ public:
 
     [[nodiscard]] std::optional<Intersection> intersect_impl(
         Ray ray, std::size_t &bound_checks, std::size_t &shape_checks) const noexcept override {
+        return intersect_subtree(*this, ray, bound_checks, shape_checks);
+    }
+
+    [[nodiscard]] bool occluded_impl(
+        Ray ray, Real t_max, std::size_t &bound_checks, std::size_t &shape_checks) const noexcept override {
+        return occluded_subtree(*this, ray, t_max, bound_checks, shape_checks);
+    }
+
+    [[nodiscard]] std::optional<std::pair<Point, Point>> extents_impl() const noexcept override {
+        return get_extents();
+    }
+
+    /// Closest hit traversal of the subtree of node. When Node is a final node type, the children are reached with
+    /// static_casts and every call gets devirtualised, otherwise dynamic_cast is used.
+    template<typename Node>
+    [[nodiscard]] static std::optional<Intersection> intersect_subtree(
+        const Node &node, const Ray &ray, std::size_t &bound_checks, std::size_t &shape_checks) noexcept {
         if constexpr (Paths::ProgramConfig::embed_ray_stats)
             ++bound_checks;
 
-        if (!Paths::Shape::AxisAlignedBox::ray_intersects(get_extents(), ray))
+        if (!Paths::Shape::AxisAlignedBox::ray_intersects(node.get_extents(), ray))
             return std::nullopt;
 
-        if (left()) {
-            std::optional<Intersection> best = std::nullopt;
-            Intersection::replace(best,
-                dynamic_cast<const TraversableBVHNode *>(left())->intersect_impl(ray, bound_checks, shape_checks));
-            Intersection::replace(best,
-                dynamic_cast<const TraversableBVHNode *>(right())->intersect_impl(ray, bound_checks, shape_checks));
-            return best;
+        Hit best {};
+        const shape_t *best_shape = nullptr;
+        closest_hit_impl(node, ray, best, best_shape, bound_checks, shape_checks);
+
+        if (!best_shape)
+            return std::nullopt;
+        return Shape::surface_at(*best_shape, ray, best);
+    }
+
+    /// Any hit traversal of the subtree of node, see intersect_subtree
+    template<typename Node>
+    [[nodiscard]] static bool occluded_subtree(
+        const Node &node, const Ray &ray, Real t_max, std::size_t &bound_checks, std::size_t &shape_checks) noexcept {
+        if constexpr (Paths::ProgramConfig::embed_ray_stats)
+            ++bound_checks;
+
+        if (!Shape::AxisAlignedBox::ray_entry(node.get_extents(), ray, t_max))
+            return false;
+
+        if (node.left()) {
+            return occluded_subtree(child_of(node, node.left()), ray, t_max, bound_checks, shape_checks)
+                || occluded_subtree(child_of(node, node.right()), ray, t_max, bound_checks, shape_checks);
         }
 
-        const auto s = get_shapes();
+        const auto s = node.get_shapes();
         if constexpr (Paths::ProgramConfig::embed_ray_stats)
             shape_checks += s.size();
-        return Shape::intersect_linear(ray, s.begin(), s.end());
+        return Shape::occluded_linear(ray, t_max, s.begin(), s.end());
     }
 
     void calculate_extents() noexcept {
-        std::pair<Point, Point> extents { { +sensible_inf, +sensible_inf, +sensible_inf },
-            { -sensible_inf, -sensible_inf, -sensible_inf } };
+        std::pair<Point, Point> extents = Shape::empty_extents;
 
-        for (const auto &shapes = get_shapes(); const auto &s : shapes) {
-            Shape::apply(s, [&extents](const auto &s) {
-                extents.first = Maths::min(extents.first, s.m_extents.first);
-                extents.second = Maths::max(extents.second, s.m_extents.second);
-            });
-        }
+        for (const auto &shapes = get_shapes(); const auto &s : shapes)
+            Shape::apply(s, [&extents](const auto &s) { extents = Shape::merge_extents(extents, s.m_extents); });
 
-        extents.first = extents.first - epsilon_point;
-        extents.second = extents.second + epsilon_point;
-        set_extents(extents);
+        set_extents(Shape::padded_extents(extents));
     }
 
     [[nodiscard]] std::array<std::size_t, 3> get_major_axes() const noexcept {
@@ -211,8 +336,75 @@ public:
         return ret;
     }
 
+    [[nodiscard]] TreeStatistics get_statistics() const noexcept {
+        TreeStatistics stats {};
+        statistics_impl(stats, Shape::surface_area(get_extents()), 0);
+        return stats;
+    }
+
 protected:
     virtual void set_extents(std::pair<Point, Point>) noexcept = 0;
+
+private:
+    /// The children of a final node type are of the same type
+    template<typename Node> static const Node &child_of(const Node &, const BinaryTreeNode *child) noexcept {
+        if constexpr (std::is_final_v<Node>)
+            return static_cast<const Node &>(*child);
+        else
+            return dynamic_cast<const Node &>(*child);
+    }
+
+    /// Visits the children nearest first, skipping the ones that the ray enters beyond the best hit so far
+    template<typename Node>
+    static void closest_hit_impl(const Node &node, const Ray &ray, Hit &best, const shape_t *&best_shape,
+        std::size_t &bound_checks, std::size_t &shape_checks) noexcept {
+        if (!node.left()) {
+            const auto s = node.get_shapes();
+            if constexpr (Paths::ProgramConfig::embed_ray_stats)
+                shape_checks += s.size();
+            if (Shape::closest_hit_linear(ray, s.begin(), s.end(), best))
+                best_shape = &s[best.m_primitive];
+            return;
+        }
+
+        const auto *near = &child_of(node, node.left());
+        const auto *far = &child_of(node, node.right());
+
+        if constexpr (Paths::ProgramConfig::embed_ray_stats)
+            bound_checks += 2;
+        auto near_entry = Shape::AxisAlignedBox::ray_entry(near->get_extents(), ray, best.m_distance);
+        auto far_entry = Shape::AxisAlignedBox::ray_entry(far->get_extents(), ray, best.m_distance);
+
+        if (!near_entry || (far_entry && *far_entry < *near_entry)) {
+            std::swap(near, far);
+            std::swap(near_entry, far_entry);
+        }
+
+        if (near_entry)
+            closest_hit_impl(*near, ray, best, best_shape, bound_checks, shape_checks);
+        if (far_entry && *far_entry <= best.m_distance)
+            closest_hit_impl(*far, ray, best, best_shape, bound_checks, shape_checks);
+    }
+
+    void statistics_impl(TreeStatistics &stats, Real root_area, std::size_t depth) const noexcept {
+        const Real relative_area = root_area > 0 ? Shape::surface_area(get_extents()) / root_area : 1;
+
+        ++stats.m_node_count;
+        stats.m_max_depth = std::max(stats.m_max_depth, depth);
+
+        if (left()) {
+            stats.m_sah_cost += relative_area * Detail::sah_traversal_cost;
+            dynamic_cast<const TraversableBVHNode *>(left())->statistics_impl(stats, root_area, depth + 1);
+            dynamic_cast<const TraversableBVHNode *>(right())->statistics_impl(stats, root_area, depth + 1);
+            return;
+        }
+
+        const auto shape_count = get_shapes().size();
+        ++stats.m_leaf_count;
+        stats.m_reference_count += shape_count;
+        stats.m_max_leaf_shapes = std::max(stats.m_max_leaf_shapes, shape_count);
+        stats.m_sah_cost += relative_area * static_cast<Real>(shape_count) * Detail::sah_intersection_cost;
+    }
 };
 
 template<typename ShapeT = void>
@@ -228,6 +420,16 @@ protected:
         return dynamic_cast<const TraversableBVHNode<ShapeT> &>(this->root())
             .intersect_impl(ray, bound_checks, isect_checks);
     }
+
+    [[nodiscard]] bool occluded_impl(
+        Ray ray, Real t_max, std::size_t &bound_checks, std::size_t &isect_checks) const noexcept override {
+        return dynamic_cast<const TraversableBVHNode<ShapeT> &>(this->root())
+            .occluded_impl(ray, t_max, bound_checks, isect_checks);
+    }
+
+    [[nodiscard]] std::optional<std::pair<Point, Point>> extents_impl() const noexcept override {
+        return dynamic_cast<const TraversableBVHNode<ShapeT> &>(this->root()).get_extents();
+    }
 };
 
 template<typename ShapeT = void> class ThreadableBVHNode : public TraversableBVHNode<ShapeT> {
@@ -282,70 +484,319 @@ template<typename ShapeT = void> struct ThreadableBVHTree : public TraversableBV
     ~ThreadableBVHTree() noexcept override = default;
 };
 
-template<typename ShapeT = void> class IntrudableBVHNode : public ThreadableBVHNode<ShapeT> {
-public:
-    using shape_t = typename TraversableBVHNode<ShapeT>::shape_t;
+namespace Detail {
+
+/// std::partition, except that for large spans the predicate is evaluated concurrently beforehand and only the swapping
+/// is done serially. The resulting order only depends on the input and not on whether parallel is set.
+/// \return The number of shapes that satisfy pred, which are moved to the front
+template<typename T, typename Pred> std::size_t partition_shapes(std::span<T> shapes, Pred &&pred, bool parallel) {
+    if (shapes.size() < parallel_build_threshold)
+        return std::distance(shapes.begin(), std::partition(shapes.begin(), shapes.end(), pred));
+
+    std::vector<std::uint8_t> flags(shapes.size());
+    Utils::parallel_chunks(shapes.size(), parallel ? ProgramConfig::preferred_thread_count() : 1,
+        [&flags, &shapes, &pred](std::size_t, std::size_t start, std::size_t end) {
+            for (std::size_t i = start; i < end; i++)
+                flags[i] = static_cast<std::uint8_t>(std::invoke(pred, shapes[i]));
+        });
+
+    std::size_t lhs = 0;
+    std::size_t rhs = shapes.size();
+    for (;;) {
+        while (lhs < rhs && flags[lhs])
+            ++lhs;
+        while (lhs < rhs && !flags[rhs - 1])
+            --rhs;
+        if (lhs >= rhs)
+            break;
+        std::swap(shapes[lhs++], shapes[--rhs]);
+    }
 
-    ~IntrudableBVHNode() noexcept override = default;
+    return lhs;
+}
 
-    using ThreadableBVHNode<ShapeT>::get_shapes; // have the const function in this scope
+template<typename Node> static Point shape_center(const typename Node::shape_t &shape) noexcept {
+    return Shape::apply(shape, [](const auto &s) -> Point { return s.m_center; });
+}
 
-    virtual std::span<shape_t> get_shapes() noexcept = 0;
+/// Sorts the shapes by the 63 bit Morton codes of their centers, quantised within the extents of the centers
+/// \return The sorted codes
+template<typename Node>
+std::vector<std::uint64_t> sort_by_morton_codes(std::span<typename Node::shape_t> shapes, bool parallel) {
+    const std::size_t chunk_count = parallel ? ProgramConfig::preferred_thread_count() : 1;
+    static constexpr Real grid_size = (1 << 21) - 1;
+
+    std::vector<std::pair<Point, Point>> chunk_extents(chunk_count, Shape::empty_extents);
+    Utils::parallel_chunks(
+        shapes.size(), chunk_count, [&chunk_extents, &shapes](std::size_t chunk, std::size_t start, std::size_t end) {
+            for (std::size_t i = start; i < end; i++)
+                chunk_extents[chunk] = Shape::merge_extents(chunk_extents[chunk], shape_center<Node>(shapes[i]));
+        });
+    const auto extents = std::accumulate(chunk_extents.cbegin(), chunk_extents.cend(), Shape::empty_extents,
+        [](const auto &lhs, const auto &rhs) { return Shape::merge_extents(lhs, rhs); });
+    const Point scale = Point(grid_size, grid_size, grid_size)
+        / Maths::max(extents.second - extents.first, Point(sensible_eps, sensible_eps, sensible_eps));
+
+    std::vector<std::pair<std::uint64_t, std::uint32_t>> keys(shapes.size());
+    Utils::parallel_chunks(shapes.size(), chunk_count,
+        [&keys, &shapes, &extents, &scale](std::size_t, std::size_t start, std::size_t end) {
+            for (std::size_t i = start; i < end; i++) {
+                const Point cell = (shape_center<Node>(shapes[i]) - extents.first) * scale;
+                const auto code = Maths::morton_3d_63(static_cast<std::uint64_t>(cell[0]),
+                    static_cast<std::uint64_t>(cell[1]), static_cast<std::uint64_t>(cell[2]));
+                keys[i] = { code, static_cast<std::uint32_t>(i) };
+            }
+        });
 
-    bool split(std::size_t max_depth, std::size_t min_shapes) { return split_impl(max_depth, min_shapes, 0); }
+    Utils::radix_sort(keys, [](const auto &key) { return key.first; }, 63, chunk_count);
 
-    /// This function should only be valid when this->is_leaf()
-    /// \param rhs_start_index The index to get_shapes() with which the right hand side node should begin with
-    virtual void split_at(std::size_t rhs_start_index) noexcept = 0;
+    std::vector<typename Node::shape_t> sorted_shapes {};
+    sorted_shapes.reserve(shapes.size());
+    for (const auto &[code, index] : keys)
+        sorted_shapes.push_back(std::move(shapes[index]));
+    std::move(sorted_shapes.begin(), sorted_shapes.end(), shapes.begin());
 
-    /// This function should only be valid to call when children nodes are leaf nodes
-    virtual void unsplit_once() noexcept = 0;
+    std::vector<std::uint64_t> codes(keys.size());
+    std::transform(keys.cbegin(), keys.cend(), codes.begin(), [](const auto &key) { return key.first; });
+    return codes;
+}
 
-private:
-    enum class EPartitionType { Middle, Median, Average };
+/// Where a node with the given sorted Morton codes gets split: where the highest bit that differs among the codes
+/// changes, or in the middle if the codes are all the same
+static inline std::size_t morton_split(std::span<const std::uint64_t> codes) noexcept {
+    const auto differing = codes.front() ^ codes.back();
+    if (!differing)
+        return codes.size() / 2;
 
-    template<EPartitionType partitionType> struct Partitioner {
-        static std::size_t partition(std::size_t) { static_assert(partitionType != partitionType); }
-    };
+    const auto bit = std::uint64_t { 1 } << (std::bit_width(differing) - 1);
+    return std::distance(codes.begin(),
+        std::partition_point(codes.begin(), codes.end(), [bit](std::uint64_t code) { return !(code & bit); }));
+}
 
-    template<> struct Partitioner<EPartitionType::Median> {
-        IntrudableBVHNode &m_self;
+template<typename Node, EPartitionType partitionType> struct Partitioner {
+    static_assert(partitionType != partitionType, "unknown partition type");
+};
 
-        std::size_t partition(std::size_t axis) {
-            auto shapes = m_self.get_shapes();
+/// Splits a node into two at the median shape center
+template<typename Node> struct Partitioner<Node, EPartitionType::Median> {
+    Node &m_self;
 
-            std::sort(shapes.begin(), shapes.end(), [axis](const auto &lhs, const auto &rhs) -> bool {
-                auto lhs_center = Shape::apply(lhs, [](const auto &s) { return s.m_center; });
-                auto rhs_center = Shape::apply(rhs, [](const auto &s) { return s.m_center; });
-                return lhs_center[axis] < rhs_center[axis];
-            });
+    std::size_t partition(std::size_t axis) {
+        auto shapes = m_self.get_shapes();
+
+        std::sort(shapes.begin(), shapes.end(), [axis](const auto &lhs, const auto &rhs) -> bool {
+            return shape_center<Node>(lhs)[axis] < shape_center<Node>(rhs)[axis];
+        });
 
-            return shapes.size() / 2;
+        return shapes.size() / 2;
+    }
+};
+
+/// Splits a node into two at the spatial middle of its extents
+template<typename Node> struct Partitioner<Node, EPartitionType::Middle> {
+    Node &m_self;
+    bool m_parallel = false;
+
+    std::size_t partition(std::size_t axis) {
+        auto shapes = m_self.get_shapes();
+        auto extents = m_self.get_extents();
+
+        const auto middle = (extents.first[axis] + extents.second[axis]) / static_cast<Real>(2);
+
+        return partition_shapes(
+            shapes, [axis, middle](const auto &s) -> bool { return shape_center<Node>(s)[axis] < middle; },
+            m_parallel);
+    }
+};
+
+/// Splits a node at the bin boundary with the lowest surface area heuristic cost. The shape centers are put into
+/// m_bin_count bins on each axis and every boundary between two bins is considered as a candidate.
+/// Returns std::nullopt when not splitting is cheaper than the best candidate.
+template<typename Node> struct Partitioner<Node, EPartitionType::BinnedSAH> {
+    static constexpr std::size_t m_bin_count = 16;
+
+    Node &m_self;
+    bool m_parallel = false;
+
+    std::optional<std::size_t> partition(std::size_t min_shapes) {
+        auto shapes = m_self.get_shapes();
+
+        const Real parent_area = Shape::surface_area(m_self.get_extents());
+        if (parent_area <= 0)
+            return std::nullopt;
+
+        const auto center_extents = get_center_extents(shapes);
+        const auto bins = fill_bins(shapes, center_extents);
+
+        Real best_cost = static_cast<Real>(shapes.size()) * sah_intersection_cost;
+        std::optional<std::pair<std::size_t, std::size_t>> best_split = std::nullopt; // axis, first bin on the rhs
+
+        for (std::size_t axis = 0; axis < 3; axis++) {
+            if (!separable(center_extents, axis))
+                continue;
+
+            const auto &axis_bins = bins[axis];
+
+            // sweep from the right to get the areas and counts of every possible rhs
+            std::array<Real, m_bin_count> rhs_areas {};
+            std::array<std::size_t, m_bin_count> rhs_counts {};
+            std::pair<Point, Point> rhs_extents = Shape::empty_extents;
+            std::size_t rhs_count = 0;
+            for (std::size_t i = m_bin_count - 1; i > 0; i--) {
+                rhs_extents = Shape::merge_extents(rhs_extents, axis_bins[i].m_extents);
+                rhs_count += axis_bins[i].m_count;
+                rhs_areas[i] = Shape::surface_area(rhs_extents);
+                rhs_counts[i] = rhs_count;
+            }
+
+            std::pair<Point, Point> lhs_extents = Shape::empty_extents;
+            std::size_t lhs_count = 0;
+            for (std::size_t i = 1; i < m_bin_count; i++) {
+                lhs_extents = Shape::merge_extents(lhs_extents, axis_bins[i - 1].m_extents);
+                lhs_count += axis_bins[i - 1].m_count;
+
+                if (lhs_count < min_shapes || rhs_counts[i] < min_shapes || !lhs_count || !rhs_counts[i])
+                    continue;
+
+                const Real cost = sah_traversal_cost
+                    + (Shape::surface_area(lhs_extents) * static_cast<Real>(lhs_count)
+                          + rhs_areas[i] * static_cast<Real>(rhs_counts[i]))
+                        / parent_area * sah_intersection_cost;
+
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_split = { axis, i };
+                }
+            }
         }
+
+        if (!best_split)
+            return std::nullopt;
+
+        const auto [axis, split_bin] = *best_split;
+        return partition_shapes(
+            shapes,
+            [&center_extents, axis = axis, split_bin = split_bin](const auto &s) {
+                return bin_index(center_extents, axis, shape_center<Node>(s)) < split_bin;
+            },
+            m_parallel);
+    }
+
+private:
+    struct Bin {
+        std::pair<Point, Point> m_extents = Shape::empty_extents;
+        std::size_t m_count = 0;
     };
 
-    template<> struct Partitioner<EPartitionType::Middle> {
-        IntrudableBVHNode &m_self;
+    typedef std::array<std::array<Bin, m_bin_count>, 3> bins_t;
 
-        std::size_t partition(std::size_t axis) {
-            auto shapes = m_self.get_shapes();
-            auto extents = m_self.get_extents();
+    [[nodiscard]] std::size_t chunk_count() const noexcept {
+        return m_parallel && m_self.get_shapes().size() >= parallel_build_threshold
+            ? ProgramConfig::preferred_thread_count()
+            : 1;
+    }
+
+    static bool separable(const std::pair<Point, Point> &center_extents, std::size_t axis) {
+        return center_extents.second[axis] - center_extents.first[axis] > sensible_eps;
+    }
+
+    static std::size_t bin_index(const std::pair<Point, Point> &center_extents, std::size_t axis, Point center) {
+        const Real length = center_extents.second[axis] - center_extents.first[axis];
+        const auto index = static_cast<std::size_t>(
+            (center[axis] - center_extents.first[axis]) / length * static_cast<Real>(m_bin_count));
+        return std::min(index, m_bin_count - 1);
+    }
+
+    /// Merging the per-chunk results only takes minimums, maximums and sums, so the results do not depend on the
+    /// number of chunks
+
+    std::pair<Point, Point> get_center_extents(std::span<typename Node::shape_t> shapes) const {
+        std::vector<std::pair<Point, Point>> chunk_extents(chunk_count(), Shape::empty_extents);
+
+        Utils::parallel_chunks(shapes.size(), chunk_extents.size(),
+            [&chunk_extents, &shapes](std::size_t chunk, std::size_t start, std::size_t end) {
+                auto &extents = chunk_extents[chunk];
+                for (std::size_t i = start; i < end; i++)
+                    extents = Shape::merge_extents(extents, shape_center<Node>(shapes[i]));
+            });
 
-            std::pair<Point, Point> rhs_extents = extents;
-            const auto half_extent = (extents.second[axis] - extents.first[axis]) / static_cast<Real>(2);
-            rhs_extents.first[axis] += half_extent;
+        return std::accumulate(chunk_extents.cbegin(), chunk_extents.cend(), Shape::empty_extents,
+            [](const auto &lhs, const auto &rhs) { return Shape::merge_extents(lhs, rhs); });
+    }
 
-            auto rhs_count = std::distance(
-                std::partition(shapes.begin(), shapes.end(),
-                    [&rhs_extents](const shape_t &s) -> bool {
-                        return Shape::in_bounds(rhs_extents, Shape::apply(s, [](const auto &s) { return s.m_center; }));
-                    }),
-                shapes.end());
+    bins_t fill_bins(std::span<typename Node::shape_t> shapes, const std::pair<Point, Point> &center_extents) const {
+        std::vector<bins_t> chunk_bins(chunk_count());
+
+        Utils::parallel_chunks(shapes.size(), chunk_bins.size(),
+            [&chunk_bins, &shapes, &center_extents](std::size_t chunk, std::size_t start, std::size_t end) {
+                auto &bins = chunk_bins[chunk];
+                for (std::size_t i = start; i < end; i++) {
+                    Shape::apply(shapes[i], [&bins, &center_extents](const auto &s) {
+                        for (std::size_t axis = 0; axis < 3; axis++) {
+                            if (!separable(center_extents, axis))
+                                continue;
+                            auto &bin = bins[axis][bin_index(center_extents, axis, s.m_center)];
+                            bin.m_extents = Shape::merge_extents(bin.m_extents, s.m_extents);
+                            ++bin.m_count;
+                        }
+                    });
+                }
+            });
 
-            return shapes.size() - rhs_count;
+        bins_t bins {};
+        for (const auto &chunk : chunk_bins) {
+            for (std::size_t axis = 0; axis < 3; axis++) {
+                for (std::size_t i = 0; i < m_bin_count; i++) {
+                    bins[axis][i].m_extents
+                        = Shape::merge_extents(bins[axis][i].m_extents, chunk[axis][i].m_extents);
+                    bins[axis][i].m_count += chunk[axis][i].m_count;
+                }
+            }
         }
-    };
 
+        return bins;
+    }
+};
+
+}
+
+template<typename ShapeT = void> class IntrudableBVHNode : public ThreadableBVHNode<ShapeT> {
+public:
+    using shape_t = typename TraversableBVHNode<ShapeT>::shape_t;
+
+    ~IntrudableBVHNode() noexcept override = default;
+
+    using ThreadableBVHNode<ShapeT>::get_shapes; // have the const function in this scope
+
+    virtual std::span<shape_t> get_shapes() noexcept = 0;
+
+    /// Recursively splits this node. With parallel set, large subtrees are built concurrently and large nodes are
+    /// partitioned in parallel, the resulting tree is identical to the one built without it.
+    bool split(std::size_t max_depth, std::size_t min_shapes, EPartitionType partition_type = EPartitionType::Middle,
+        bool parallel = !ProgramConfig::single_thread) {
+        if (partition_type == EPartitionType::Morton)
+            return split_morton(max_depth, min_shapes, parallel);
+        if (partition_type == EPartitionType::Spatial)
+            return split_spatial(max_depth, min_shapes, Detail::default_duplication_budget, parallel);
+        return split_impl(max_depth, min_shapes, partition_type, parallel, 0);
+    }
+
+    /// Splits with EPartitionType::Spatial, allowing duplication_budget times the number of shapes extra references.
+    /// Nodes that cannot duplicate their shapes build a binned SAH tree instead.
+    virtual bool split_spatial(std::size_t max_depth, std::size_t min_shapes, Real duplication_budget,
+        bool parallel = !ProgramConfig::single_thread) {
+        return split_impl(max_depth, min_shapes, EPartitionType::BinnedSAH, parallel, 0);
+    }
+
+    /// This function should only be valid when this->is_leaf()
+    /// \param rhs_start_index The index to get_shapes() with which the right hand side node should begin with
+    /// \param calculate_extents If unset, setting the extents of the children is left to the caller
+    virtual void split_at(std::size_t rhs_start_index, bool calculate_extents = true) noexcept = 0;
+
+    /// This function should only be valid to call when children nodes are leaf nodes
+    virtual void unsplit_once() noexcept = 0;
+
+private:
     inline std::size_t select_axis_major() { return this->get_major_axes()[0]; }
 
     inline std::size_t select_axis_round_robin(std::size_t depth) { return depth % 3; }
@@ -379,7 +830,43 @@ private:
         return {0, false};
     }*/
 
-    bool split_impl(std::size_t max_depth, std::size_t min_shapes, std::size_t depth) {
+    template<EPartitionType partitionType> using partitioner_t = Detail::Partitioner<IntrudableBVHNode, partitionType>;
+
+    /// Tries the axes in the order of their lengths, returns the first split that leaves min_shapes on both sides
+    template<typename Partitioner>
+    std::optional<std::size_t> split_along_major_axes(Partitioner &&partitioner, std::size_t min_shapes) {
+        const auto shape_count = this->get_shapes().size();
+
+        for (auto axis : this->get_major_axes()) {
+            auto split_point = partitioner.partition(axis);
+
+            if (split_point < min_shapes || shape_count - split_point < min_shapes)
+                continue;
+
+            return split_point;
+        }
+
+        return std::nullopt;
+    }
+
+    std::optional<std::size_t> find_split(EPartitionType partition_type, std::size_t min_shapes, bool parallel) {
+        switch (partition_type) {
+        case EPartitionType::Middle:
+            return split_along_major_axes(partitioner_t<EPartitionType::Middle> { *this, parallel }, min_shapes);
+        case EPartitionType::Median:
+            return split_along_major_axes(partitioner_t<EPartitionType::Median> { *this }, min_shapes);
+        case EPartitionType::BinnedSAH:
+            return partitioner_t<EPartitionType::BinnedSAH> { *this, parallel }.partition(min_shapes);
+        case EPartitionType::Morton:
+        case EPartitionType::Spatial:
+            break; // see split_morton and split_spatial
+        }
+
+        return std::nullopt;
+    }
+
+    bool split_impl(std::size_t max_depth, std::size_t min_shapes, EPartitionType partition_type, bool parallel,
+        std::size_t depth) {
         this->calculate_extents();
         auto shapes = this->get_shapes();
 
@@ -388,25 +875,75 @@ private:
         if (shapes.size() <= min_shapes)
             return false;
 
-        auto major_axes = this->get_major_axes();
-        auto partitioner = Partitioner<EPartitionType::Middle> { *this };
+        const auto split_point = find_split(partition_type, min_shapes, parallel);
+        if (!split_point)
+            return false;
 
-        for (auto axis : major_axes) {
-            auto split_point = partitioner.partition(axis);
+        this->split_at(*split_point);
 
-            if (static_cast<std::size_t>(split_point) < min_shapes
-                || static_cast<std::size_t>(shapes.size() - split_point) < min_shapes)
-                continue;
+        auto *lhs = dynamic_cast<IntrudableBVHNode *>(this->left());
+        auto *rhs = dynamic_cast<IntrudableBVHNode *>(this->right());
+
+        // the children own disjoint ranges of the shapes so they can be built independently
+        auto split_lhs = [=] { lhs->split_impl(max_depth, min_shapes, partition_type, parallel, depth + 1); };
+        auto split_rhs = [=] { rhs->split_impl(max_depth, min_shapes, partition_type, parallel, depth + 1); };
+
+        if (parallel && shapes.size() >= Detail::parallel_build_threshold
+            && depth < Detail::parallel_build_fork_depth()) {
+            Utils::fork_join(split_lhs, split_rhs);
+        } else {
+            split_lhs();
+            split_rhs();
+        }
+
+        return true;
+    }
+
+    /// Builds a linear BVH: the shapes get sorted by the Morton codes of their centers once, after which finding the
+    /// split point of a node is a binary search. Much faster than the other partitioners, at the cost of the quality
+    /// of the tree, see BVHNode::optimise_treelets.
+    bool split_morton(std::size_t max_depth, std::size_t min_shapes, bool parallel) {
+        this->calculate_extents();
+        auto shapes = this->get_shapes();
+
+        if (!max_depth || shapes.size() <= min_shapes)
+            return false;
+
+        const auto codes = Detail::sort_by_morton_codes<IntrudableBVHNode>(shapes, parallel);
+        split_morton_impl(codes, max_depth, min_shapes, parallel, 0);
+
+        return true;
+    }
+
+    /// codes are those of the shapes of this node
+    void split_morton_impl(std::span<const std::uint64_t> codes, std::size_t max_depth, std::size_t min_shapes,
+        bool parallel, std::size_t depth) {
+        if (depth >= max_depth || codes.size() <= min_shapes) {
+            this->calculate_extents();
+            return;
+        }
+
+        // the extents are calculated bottom up instead of once for every level
+        const auto split_point = Detail::morton_split(codes);
+        this->split_at(split_point, false);
 
-            this->split_at(split_point);
+        auto *lhs = dynamic_cast<IntrudableBVHNode *>(this->left());
+        auto *rhs = dynamic_cast<IntrudableBVHNode *>(this->right());
 
-            dynamic_cast<IntrudableBVHNode *>(this->left())->split_impl(max_depth, min_shapes, depth + 1);
-            dynamic_cast<IntrudableBVHNode *>(this->right())->split_impl(max_depth, min_shapes, depth + 1);
+        auto split_lhs
+            = [=] { lhs->split_morton_impl(codes.first(split_point), max_depth, min_shapes, parallel, depth + 1); };
+        auto split_rhs
+            = [=] { rhs->split_morton_impl(codes.subspan(split_point), max_depth, min_shapes, parallel, depth + 1); };
 
-            return true;
+        if (parallel && codes.size() >= Detail::parallel_build_threshold
+            && depth < Detail::parallel_build_fork_depth()) {
+            Utils::fork_join(split_lhs, split_rhs);
+        } else {
+            split_lhs();
+            split_rhs();
         }
 
-        return false;
+        this->set_extents(Shape::merge_extents(lhs->get_extents(), rhs->get_extents()));
     }
 };
 
@@ -1,38 +1,50 @@
 #pragma once
 
+#include <chrono>
+
+#include "Utils/Memory.hpp"
+
+#include "SpatialSplits.hpp"
 #include "Traversal.hpp"
 
 namespace Paths::BVH::Detail {
 
+/// Nodes live in the arena of their tree, children are made in the arena of their parent and are never freed by
+/// themselves. Every node of a tree refers to the same shapes.
 template<typename ShapeT> class BVHNode final : public IntrudableBVHNode<ShapeT> {
 public:
     typedef Shape::BoundableShapeT<ShapeT> shape_t;
 
+    /// The most subtrees that optimise_treelets rearranges at once, the search is exponential in this
+    static constexpr std::size_t m_treelet_size = 7;
+
     BVHNode() noexcept = default;
 
     ~BVHNode() noexcept override = default;
 
-    explicit BVHNode(
-        std::shared_ptr<std::vector<shape_t>> shapes, std::pair<std::size_t, std::size_t> shape_extents = { 0, 0 })
-        : m_shapes_impl(std::move(shapes))
-        , m_shape_extents(shape_extents) {
+    BVHNode(std::vector<shape_t> *shapes, Utils::MonotonicArena *arena,
+        std::pair<std::size_t, std::size_t> shape_extents = { 0, 0 })
+        : m_shapes_impl(shapes)
+        , m_arena(arena)
+        , m_shape_extents(shape_extents)
+        , m_total_shape_count(shape_extents.second - shape_extents.first) {
         if (!this->get_shapes().empty())
             this->calculate_extents();
     }
 
-    [[nodiscard]] BinaryTreeNode *left() noexcept override { return m_children[0].get(); }
+    [[nodiscard]] BinaryTreeNode *left() noexcept override { return m_children[0]; }
 
-    [[nodiscard]] const BinaryTreeNode *left() const noexcept override { return m_children[0].get(); }
+    [[nodiscard]] const BinaryTreeNode *left() const noexcept override { return m_children[0]; }
 
-    [[nodiscard]] BinaryTreeNode *right() noexcept override { return m_children[1].get(); }
+    [[nodiscard]] BinaryTreeNode *right() noexcept override { return m_children[1]; }
 
-    [[nodiscard]] const BinaryTreeNode *right() const noexcept override { return m_children[1].get(); }
+    [[nodiscard]] const BinaryTreeNode *right() const noexcept override { return m_children[1]; }
 
     [[nodiscard]] BinaryTreeNode *parent() noexcept override { return m_parent; }
 
     [[nodiscard]] const BinaryTreeNode *parent() const noexcept override { return m_parent; }
 
-    void swap_children() noexcept override { m_children[0].swap(m_children[1]); }
+    void swap_children() noexcept override { std::swap(m_children[0], m_children[1]); }
 
     [[nodiscard]] std::size_t get_id() const noexcept override { return m_id; }
 
@@ -50,10 +62,10 @@ public:
 
     [[nodiscard]] std::size_t total_shape_count() const noexcept override { return m_total_shape_count; }
 
-    void split_at(std::size_t rhs_start_index) noexcept override {
+    void split_at(std::size_t rhs_start_index, bool calculate_extents = true) noexcept override {
         auto shapes = this->get_shapes();
         rhs_start_index = std::min(rhs_start_index, shapes.size());
-        m_children = { std::make_unique<BVHNode>(m_shapes_impl), std::make_unique<BVHNode>(m_shapes_impl) };
+        m_children = { m_arena->make<BVHNode>(m_shapes_impl, m_arena), m_arena->make<BVHNode>(m_shapes_impl, m_arena) };
 
         m_children[0]->m_shape_extents = { m_shape_extents.first, m_shape_extents.first + rhs_start_index };
         m_children[1]->m_shape_extents = { m_shape_extents.first + rhs_start_index, m_shape_extents.second };
@@ -61,12 +73,14 @@ public:
         for (auto &c : m_children) {
             c->m_total_shape_count = c->get_shapes().size();
             c->m_parent = this;
-            c->calculate_extents();
+            if (calculate_extents)
+                c->calculate_extents();
         }
 
         m_shape_extents = { 0, 0 };
     }
 
+    /// The children are left in the arena until the tree is destroyed
     void unsplit_once() noexcept override {
         m_shape_extents = {
             m_children[0]->m_shape_extents.first,
@@ -76,16 +90,239 @@ public:
         m_children = { nullptr, nullptr };
     }
 
+    /// Visits the subtree bottom up, and at every node finds the treelet of the m_treelet_size subtrees with the
+    /// largest areas below it and rearranges them into the topology with the lowest surface area heuristic cost.
+    /// Recovers most of the quality that the Morton builder gives up. Leaves are never split or merged.
+    void optimise_treelets(bool parallel = !ProgramConfig::single_thread) noexcept {
+        optimise_treelets_impl(parallel, 0);
+    }
+
+    /// Recalculates the extents of the subtree bottom up, for when its shapes have moved
+    void refit(bool parallel = !ProgramConfig::single_thread) noexcept { refit_impl(parallel, 0); }
+
+    /// Only the root of a tree can duplicate shapes, the shapes of the tree get replaced by the references of the
+    /// leaves in order. Refitting a tree built like this loses the clipped extents of the nodes.
+    bool split_spatial(std::size_t max_depth, std::size_t min_shapes, Real duplication_budget,
+        bool parallel = !ProgramConfig::single_thread) override {
+        if (m_parent || m_shape_extents != std::pair<std::size_t, std::size_t> { 0, m_shapes_impl->size() })
+            return IntrudableBVHNode<ShapeT>::split_spatial(max_depth, min_shapes, duplication_budget, parallel);
+
+        this->calculate_extents();
+        if (!max_depth || this->get_shapes().size() <= min_shapes)
+            return false;
+
+        typedef typename Detail::SpatialSplitBuilder<ShapeT>::Node build_node_t;
+        const auto root = Detail::SpatialSplitBuilder<ShapeT>(
+            std::as_const(*this).get_shapes(), max_depth, min_shapes, duplication_budget, parallel)
+                              .build();
+
+        std::vector<shape_t> references {};
+        references.reserve(root->m_reference_count);
+        auto collect = [this, &references](auto &self, const build_node_t &node) -> void {
+            if (!node.is_leaf()) {
+                self(self, *node.m_children[0]);
+                self(self, *node.m_children[1]);
+                return;
+            }
+            for (const auto index : node.m_shapes)
+                references.push_back((*m_shapes_impl)[index]);
+        };
+        collect(collect, *root);
+
+        *m_shapes_impl = std::move(references);
+        m_shape_extents = { 0, m_shapes_impl->size() };
+        m_total_shape_count = m_shapes_impl->size();
+        assemble_spatial(*root);
+
+        return !root->is_leaf();
+    }
+
 protected:
     void set_extents(std::pair<Point, Point> e) noexcept override { m_extents = e; }
 
-    std::shared_ptr<std::vector<shape_t>> m_shapes_impl { nullptr };
+    std::vector<shape_t> *m_shapes_impl = nullptr;
+    Utils::MonotonicArena *m_arena = nullptr;
     std::pair<std::size_t, std::size_t> m_shape_extents { 0, 0 };
     std::pair<Point, Point> m_extents {};
-    std::array<std::unique_ptr<BVHNode>, 2> m_children { nullptr, nullptr };
+    std::array<BVHNode *, 2> m_children { nullptr, nullptr };
     BVHNode *m_parent { nullptr };
     std::size_t m_id = 0;
     std::size_t m_total_shape_count = 0;
+
+    /// The surface area heuristic cost of the subtree, not normalised, only valid during optimise_treelets
+    Real m_sah_cost = 0;
+
+private:
+    static constexpr std::size_t m_treelet_subsets = 1 << m_treelet_size;
+
+    struct Treelet {
+        std::array<BVHNode *, m_treelet_size> m_leaves {};
+        std::size_t m_leaf_count = 0;
+
+        /// Indexed by subsets of the leaves
+        std::array<Real, m_treelet_subsets> m_costs {};
+        std::array<std::uint32_t, m_treelet_subsets> m_best_lhs {};
+
+        /// The root is not among these
+        std::array<BVHNode *, m_treelet_size - 2> m_inner {};
+        std::size_t m_inner_count = 0;
+
+        std::array<BVHNode *, m_treelet_size> m_leaf_nodes {};
+        std::array<BVHNode *, m_treelet_size - 2> m_inner_nodes {};
+        std::size_t m_inner_node_count = 0;
+    };
+
+    /// Gives the subtree the topology and the clipped extents of node
+    void assemble_spatial(const typename Detail::SpatialSplitBuilder<ShapeT>::Node &node) noexcept {
+        m_extents = Shape::padded_extents(node.m_extents);
+        if (node.is_leaf())
+            return;
+
+        this->split_at(node.m_children[0]->m_reference_count, false);
+        m_children[0]->assemble_spatial(*node.m_children[0]);
+        m_children[1]->assemble_spatial(*node.m_children[1]);
+    }
+
+    void refit_impl(bool parallel, std::size_t depth) noexcept {
+        if (this->is_leaf()) {
+            this->calculate_extents();
+            return;
+        }
+
+        auto refit_lhs = [this, parallel, depth] { m_children[0]->refit_impl(parallel, depth + 1); };
+        auto refit_rhs = [this, parallel, depth] { m_children[1]->refit_impl(parallel, depth + 1); };
+
+        if (parallel && m_total_shape_count >= Detail::parallel_build_threshold
+            && depth < Detail::parallel_build_fork_depth()) {
+            Utils::fork_join(refit_lhs, refit_rhs);
+        } else {
+            refit_lhs();
+            refit_rhs();
+        }
+
+        m_extents = Shape::merge_extents(m_children[0]->m_extents, m_children[1]->m_extents);
+    }
+
+    void optimise_treelets_impl(bool parallel, std::size_t depth) noexcept {
+        const Real area = Shape::surface_area(m_extents);
+
+        if (this->is_leaf()) {
+            m_sah_cost = area * static_cast<Real>(this->get_shapes().size()) * Detail::sah_intersection_cost;
+            return;
+        }
+
+        auto optimise_lhs = [this, parallel, depth] { m_children[0]->optimise_treelets_impl(parallel, depth + 1); };
+        auto optimise_rhs = [this, parallel, depth] { m_children[1]->optimise_treelets_impl(parallel, depth + 1); };
+
+        if (parallel && m_total_shape_count >= Detail::parallel_build_threshold
+            && depth < Detail::parallel_build_fork_depth()) {
+            Utils::fork_join(optimise_lhs, optimise_rhs);
+        } else {
+            optimise_lhs();
+            optimise_rhs();
+        }
+
+        m_sah_cost = area * Detail::sah_traversal_cost + m_children[0]->m_sah_cost + m_children[1]->m_sah_cost;
+        optimise_treelet();
+    }
+
+    void optimise_treelet() noexcept {
+        Treelet treelet {};
+
+        // grow the treelet by expanding its largest subtree
+        treelet.m_leaves[treelet.m_leaf_count++] = m_children[0];
+        treelet.m_leaves[treelet.m_leaf_count++] = m_children[1];
+        while (treelet.m_leaf_count < m_treelet_size) {
+            std::optional<std::size_t> largest = std::nullopt;
+            for (std::size_t i = 0; i < treelet.m_leaf_count; i++) {
+                const auto *leaf = treelet.m_leaves[i];
+                if (!leaf->is_leaf()
+                    && (!largest
+                        || Shape::surface_area(leaf->m_extents)
+                            > Shape::surface_area(treelet.m_leaves[*largest]->m_extents)))
+                    largest = i;
+            }
+
+            if (!largest)
+                break;
+
+            auto *expanded = treelet.m_leaves[*largest];
+            treelet.m_inner[treelet.m_inner_count++] = expanded;
+            treelet.m_leaves[*largest] = expanded->m_children[0];
+            treelet.m_leaves[treelet.m_leaf_count++] = expanded->m_children[1];
+        }
+
+        // two subtrees can only be arranged in one way
+        if (treelet.m_leaf_count < 3)
+            return;
+
+        const auto full_set = static_cast<std::uint32_t>((1 << treelet.m_leaf_count) - 1);
+        for (std::uint32_t set = 1; set <= full_set; set++) {
+            if (std::has_single_bit(set)) {
+                treelet.m_costs[set] = treelet.m_leaves[std::countr_zero(set)]->m_sah_cost;
+                continue;
+            }
+
+            std::pair<Point, Point> extents = Shape::empty_extents;
+            for (std::uint32_t rest = set; rest; rest &= rest - 1)
+                extents = Shape::merge_extents(extents, treelet.m_leaves[std::countr_zero(rest)]->m_extents);
+
+            // every partition is considered once by keeping the lowest leaf on the left hand side
+            const auto lowest = set & -set;
+            Real best_cost = std::numeric_limits<Real>::infinity();
+            for (std::uint32_t lhs = (set - 1) & set; lhs; lhs = (lhs - 1) & set) {
+                if (!(lhs & lowest))
+                    continue;
+
+                const Real cost = treelet.m_costs[lhs] + treelet.m_costs[set ^ lhs];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    treelet.m_best_lhs[set] = lhs;
+                }
+            }
+
+            treelet.m_costs[set] = Shape::surface_area(extents) * Detail::sah_traversal_cost + best_cost;
+        }
+
+        if (treelet.m_costs[full_set] >= m_sah_cost)
+            return;
+
+        // take the treelet apart, the root stays where it is
+        for (std::size_t i = 0; i <= treelet.m_inner_count; i++) {
+            auto *node = i ? treelet.m_inner[i - 1] : this;
+            for (auto &child : node->m_children) {
+                const auto leaves_end = treelet.m_leaves.begin() + treelet.m_leaf_count;
+                const auto it = std::find(treelet.m_leaves.begin(), leaves_end, child);
+                if (it != leaves_end)
+                    treelet.m_leaf_nodes[std::distance(treelet.m_leaves.begin(), it)] = child;
+                else
+                    treelet.m_inner_nodes[treelet.m_inner_node_count++] = child;
+            }
+        }
+
+        assemble_treelet(treelet, full_set);
+    }
+
+    void assemble_treelet(Treelet &treelet, std::uint32_t set) noexcept {
+        const auto lhs_set = treelet.m_best_lhs[set];
+
+        for (std::size_t i = 0; i < 2; i++) {
+            const auto child_set = i ? set ^ lhs_set : lhs_set;
+
+            if (std::has_single_bit(child_set)) {
+                m_children[i] = treelet.m_leaf_nodes[std::countr_zero(child_set)];
+            } else {
+                m_children[i] = treelet.m_inner_nodes[--treelet.m_inner_node_count];
+                m_children[i]->assemble_treelet(treelet, child_set);
+            }
+
+            m_children[i]->m_parent = this;
+        }
+
+        m_extents = Shape::merge_extents(m_children[0]->m_extents, m_children[1]->m_extents);
+        m_total_shape_count = m_children[0]->m_total_shape_count + m_children[1]->m_total_shape_count;
+        m_sah_cost = treelet.m_costs[set];
+    }
 };
 
 template<typename ShapeT = void> class BVHTree : public IntrudableBVHTree<ShapeT> {
@@ -95,17 +332,83 @@ public:
 
     explicit BVHTree(std::vector<shape_t> &&vec)
         : m_shapes(std::make_unique<std::vector<shape_t>>(std::move(vec)))
-        , m_root(std::make_unique<node_t>(m_shapes, std::make_pair<std::size_t, std::size_t>(0, m_shapes->size()))) {
-        // NewFatBVHNode<ShapeT> asd(shapes, {0, shapes->size()});
-    }
+        , m_arena(std::make_unique<Utils::MonotonicArena>())
+        , m_root(m_arena->make<node_t>(
+              m_shapes.get(), m_arena.get(), std::make_pair<std::size_t, std::size_t>(0, m_shapes->size()))) { }
 
     [[nodiscard]] node_t &root() noexcept override { return *m_root; }
 
     [[nodiscard]] const node_t &root() const noexcept override { return *m_root; }
 
+    /// Splits the root with the partitioner, like IntrudableBVHNode::split does, and keeps the build statistics
+    /// \param duplication_budget Only used by EPartitionType::Spatial
+    bool build(std::size_t max_depth, std::size_t min_shapes, EPartitionType partition_type,
+        Real duplication_budget = Detail::default_duplication_budget, bool parallel = !ProgramConfig::single_thread) {
+        const auto start = std::chrono::steady_clock::now();
+
+        const bool split = partition_type == EPartitionType::Spatial
+            ? m_root->split_spatial(max_depth, min_shapes, duplication_budget, parallel)
+            : m_root->split(max_depth, min_shapes, partition_type, parallel);
+
+        m_build_seconds = std::chrono::duration<Real>(std::chrono::steady_clock::now() - start).count();
+        m_peak_resident_bytes = Utils::peak_resident_bytes();
+
+        return split;
+    }
+
+    /// The statistics of the root, along with those of the last build if the tree was built with build()
+    [[nodiscard]] TreeStatistics get_statistics() const noexcept {
+        auto stats = m_root->get_statistics();
+        stats.m_build_seconds = m_build_seconds;
+        stats.m_node_memory_bytes = m_arena->reserved_bytes();
+        stats.m_peak_resident_bytes = m_peak_resident_bytes;
+        return stats;
+    }
+
+    /// Replaces every shape s with fn(s), refit has to be called afterwards
+    template<typename Fn> void transform_shapes(Fn &&fn, bool parallel = !ProgramConfig::single_thread) {
+        Utils::parallel_chunks(m_shapes->size(), parallel ? ProgramConfig::preferred_thread_count() : 1,
+            [this, &fn](std::size_t, std::size_t start, std::size_t end) {
+                for (std::size_t i = start; i < end; i++)
+                    (*m_shapes)[i] = std::invoke(fn, std::as_const((*m_shapes)[i]));
+            });
+    }
+
+    /// Updates the extents of the nodes after the shapes have moved, the topology stays the same
+    /// \return The cost of the tree relative to its cost before the first refit, see Detail::refit_rebuild_threshold
+    Real refit(bool parallel = !ProgramConfig::single_thread) noexcept {
+        if (!m_built_sah_cost)
+            m_built_sah_cost = m_root->get_statistics().m_sah_cost;
+
+        m_root->refit(parallel);
+        this->bounds_changed();
+
+        const auto cost = m_root->get_statistics().m_sah_cost;
+        return *m_built_sah_cost > 0 ? cost / *m_built_sah_cost : 1;
+    }
+
+protected:
+    /// Walks the concrete nodes so that rays do not go through RTTI or virtual calls per node
+    [[nodiscard]] std::optional<Intersection> intersect_impl(
+        Ray ray, std::size_t &bound_checks, std::size_t &isect_checks) const noexcept override {
+        return TraversableBVHNode<ShapeT>::intersect_subtree(*m_root, ray, bound_checks, isect_checks);
+    }
+
+    [[nodiscard]] bool occluded_impl(
+        Ray ray, Real t_max, std::size_t &bound_checks, std::size_t &isect_checks) const noexcept override {
+        return TraversableBVHNode<ShapeT>::occluded_subtree(*m_root, ray, t_max, bound_checks, isect_checks);
+    }
+
 private:
-    std::shared_ptr<std::vector<shape_t>> m_shapes;
-    std::unique_ptr<node_t> m_root { nullptr };
+    std::unique_ptr<std::vector<shape_t>> m_shapes;
+
+    /// Every node of the tree, which are released at once instead of node by node
+    std::unique_ptr<Utils::MonotonicArena> m_arena;
+    node_t *m_root = nullptr;
+
+    std::optional<Real> m_built_sah_cost = std::nullopt;
+    Real m_build_seconds = 0;
+    std::size_t m_peak_resident_bytes = 0;
 };
 
 }
@@ -0,0 +1,434 @@
+#pragma once
+
+#include <cstdint>
+
+#include "Leaves.hpp"
+#include "Maths/SIMD.hpp"
+#include "Traversal.hpp"
+
+namespace Paths::BVH::Detail {
+
+#ifdef __AVX__
+static constexpr std::size_t wide_bvh_default_width = 8;
+#else
+static constexpr std::size_t wide_bvh_default_width = 4;
+#endif
+
+/// A BVH with Width children per node, made by collapsing a binary tree. The child boxes of a node are stored in single
+/// precision and in SoA layout so that all of them get tested in one SIMD slab test.
+template<typename ShapeT = void, std::size_t Width = wide_bvh_default_width> class WideBVH final : public ShapeStore {
+    typedef Maths::simd_t<float, Width> vfloat_t;
+
+    struct Node {
+        std::array<vfloat_t, 3> m_min {};
+        std::array<vfloat_t, 3> m_max {};
+
+        /// The index of the child node, or the start of the leaf range if the child is a leaf. m_npos for unused slots
+        std::array<std::uint32_t, Width> m_child {};
+
+        /// The length of the leaf range, 0 for inner children
+        std::array<std::uint32_t, Width> m_shape_count {};
+    };
+
+    /// Nodes deeper than this get all the shapes of their subtrees, this bounds the traversal stack
+    static constexpr std::size_t m_max_depth = 32;
+    static constexpr std::size_t m_stack_capacity = m_max_depth * Width;
+
+public:
+    typedef Shape::BoundableShapeT<ShapeT> shape_t;
+    static constexpr std::uint32_t m_npos = std::numeric_limits<std::uint32_t>::max();
+
+    explicit WideBVH(const TraversableBVHTree<ShapeT> &tree) {
+        const auto &root = dynamic_cast<const TraversableBVHNode<ShapeT> &>(tree.root());
+
+        m_shapes.reserve(root.get_shapes().size());
+
+        if (root.is_leaf()) {
+            m_nodes.emplace_back();
+            std::fill(m_nodes[0].m_child.begin(), m_nodes[0].m_child.end(), m_npos);
+            if (!root.get_shapes().empty())
+                set_child(0, 0, root, 1);
+        } else {
+            collapse(root, 0);
+        }
+    }
+
+    [[nodiscard]] std::size_t total_shape_count() const noexcept override { return m_shapes.size(); }
+
+    [[nodiscard]] std::size_t node_count() const noexcept { return m_nodes.size(); }
+
+    /// Replaces every shape s with fn(s), refit has to be called afterwards
+    template<typename Fn> void transform_shapes(Fn &&fn, bool parallel = !ProgramConfig::single_thread) {
+        m_shapes.transform(std::forward<Fn>(fn), parallel);
+    }
+
+    /// Updates the child boxes after the shapes have moved, the topology stays the same
+    /// \return The cost of the tree relative to its cost before the first refit, see Detail::refit_rebuild_threshold
+    Real refit(bool parallel = !ProgramConfig::single_thread) noexcept {
+        if (!m_built_sah_cost)
+            m_built_sah_cost = sah_cost();
+
+        Utils::parallel_chunks(m_nodes.size(), parallel ? ProgramConfig::preferred_thread_count() : 1,
+            [this](std::size_t, std::size_t start, std::size_t end) {
+                for (std::size_t index = start; index < end; index++)
+                    for (std::size_t slot = 0; slot < Width; slot++)
+                        if (m_nodes[index].m_shape_count[slot])
+                            set_slot_extents(m_nodes[index], slot, m_shapes.extents(leaf_range(m_nodes[index], slot)));
+            });
+
+        // children come after their parents
+        for (std::size_t index = m_nodes.size(); index-- > 0;) {
+            auto &node = m_nodes[index];
+            for (std::size_t slot = 0; slot < Width; slot++)
+                if (node.m_child[slot] != m_npos && !node.m_shape_count[slot])
+                    set_slot_extents(node, slot, get_extents(m_nodes[node.m_child[slot]]));
+        }
+
+        bounds_changed();
+        return *m_built_sah_cost > 0 ? sah_cost() / *m_built_sah_cost : 1;
+    }
+
+private:
+    LeafStore<ShapeT> m_shapes {};
+    std::vector<Node> m_nodes {};
+    std::optional<Real> m_built_sah_cost = std::nullopt;
+
+    [[nodiscard]] static std::pair<std::uint32_t, std::uint32_t> leaf_range(const Node &node, std::size_t slot) {
+        return { node.m_child[slot], node.m_child[slot] + node.m_shape_count[slot] };
+    }
+
+    [[nodiscard]] static std::pair<Point, Point> get_slot_extents(const Node &node, std::size_t slot) noexcept {
+        return {
+            Point(node.m_min[0][slot], node.m_min[1][slot], node.m_min[2][slot]),
+            Point(node.m_max[0][slot], node.m_max[1][slot], node.m_max[2][slot]),
+        };
+    }
+
+    static void set_slot_extents(Node &node, std::size_t slot, const std::pair<Point, Point> &extents) noexcept {
+        for (std::size_t axis = 0; axis < 3; axis++) {
+            node.m_min[axis][slot] = round_down_float(extents.first[axis]);
+            node.m_max[axis][slot] = round_up_float(extents.second[axis]);
+        }
+    }
+
+    /// The union of the boxes of the used slots
+    [[nodiscard]] static std::pair<Point, Point> get_extents(const Node &node) noexcept {
+        std::pair<Point, Point> extents = Shape::empty_extents;
+        for (std::size_t slot = 0; slot < Width; slot++)
+            if (node.m_child[slot] != m_npos)
+                extents = Shape::merge_extents(extents, get_slot_extents(node, slot));
+        return extents;
+    }
+
+    [[nodiscard]] Real sah_cost() const noexcept {
+        SAHCost cost {};
+        for (const auto &node : m_nodes) {
+            cost.add_inner(get_extents(node));
+            for (std::size_t slot = 0; slot < Width; slot++)
+                if (node.m_shape_count[slot])
+                    cost.add_leaf(get_slot_extents(node, slot), m_shapes.checks(leaf_range(node, slot)));
+        }
+        return cost.relative_to(get_extents(m_nodes[0]));
+    }
+
+    static const TraversableBVHNode<ShapeT> &as_node(const BinaryTreeNode *node) noexcept {
+        return dynamic_cast<const TraversableBVHNode<ShapeT> &>(*node);
+    }
+
+    /// Picks up to Width descendants of a binary node by repeatedly opening the inner one with the largest surface area
+    static std::vector<const TraversableBVHNode<ShapeT> *> gather_children(const TraversableBVHNode<ShapeT> &node) {
+        std::vector<const TraversableBVHNode<ShapeT> *> children { &as_node(node.left()), &as_node(node.right()) };
+
+        while (children.size() < Width) {
+            auto largest = children.end();
+            Real largest_area = -1;
+
+            for (auto it = children.begin(); it != children.end(); it++) {
+                if ((*it)->is_leaf())
+                    continue;
+                if (const auto area = Shape::surface_area((*it)->get_extents()); area > largest_area) {
+                    largest_area = area;
+                    largest = it;
+                }
+            }
+
+            if (largest == children.end())
+                break;
+
+            const auto &opened = **largest;
+            *largest = &as_node(opened.left());
+            children.push_back(&as_node(opened.right()));
+        }
+
+        return children;
+    }
+
+    std::uint32_t collapse(const TraversableBVHNode<ShapeT> &node, std::size_t depth) {
+        const auto index = static_cast<std::uint32_t>(m_nodes.size());
+        m_nodes.emplace_back();
+        std::fill(m_nodes[index].m_child.begin(), m_nodes[index].m_child.end(), m_npos);
+
+        const auto children = gather_children(node);
+        for (std::size_t slot = 0; slot < children.size(); slot++)
+            set_child(index, slot, *children[slot], depth + 1);
+
+        return index;
+    }
+
+    void set_child(std::uint32_t index, std::size_t slot, const TraversableBVHNode<ShapeT> &child, std::size_t depth) {
+        const auto [min, max] = child.get_extents();
+        for (std::size_t axis = 0; axis < 3; axis++) {
+            m_nodes[index].m_min[axis][slot] = round_down_float(min[axis]);
+            m_nodes[index].m_max[axis][slot] = round_up_float(max[axis]);
+        }
+
+        if (!child.is_leaf() && depth < m_max_depth) {
+            const auto child_index = collapse(child, depth); // m_nodes might get reallocated
+            m_nodes[index].m_child[slot] = child_index;
+            m_nodes[index].m_shape_count[slot] = 0;
+            return;
+        }
+
+        std::vector<shape_t> shapes;
+        child.template traverse<ETraversalOrder::PreOrder>([&shapes](const auto &n) {
+            const auto node_shapes = as_node(&n).get_shapes();
+            std::copy(node_shapes.begin(), node_shapes.end(), std::back_inserter(shapes));
+        });
+
+        const auto [start, end] = m_shapes.append(shapes);
+        m_nodes[index].m_child[slot] = start == end ? m_npos : start;
+        m_nodes[index].m_shape_count[slot] = end - start;
+    }
+
+    struct SIMDRay {
+        std::array<vfloat_t, 3> m_origin;
+        std::array<vfloat_t, 3> m_reciprocal;
+    };
+
+    static SIMDRay broadcast(const Ray &ray) noexcept {
+        SIMDRay ret;
+        for (std::size_t axis = 0; axis < 3; axis++) {
+            ret.m_origin[axis] = vfloat_t {} + static_cast<float>(ray.m_origin[axis]);
+            ret.m_reciprocal[axis] = vfloat_t {} + static_cast<float>(ray.m_direction_reciprocals[axis]);
+        }
+        return ret;
+    }
+
+    /// Tests all the child boxes of a node against [0, t_max), returns their entry distances, infinity for misses
+    static vfloat_t slab_test(const Node &node, const SIMDRay &ray, Real t_max) noexcept {
+        vfloat_t t_near = vfloat_t {};
+        vfloat_t t_far = vfloat_t {} + round_up_float(t_max);
+        for (std::size_t axis = 0; axis < 3; axis++) {
+            const vfloat_t t_0 = (node.m_min[axis] - ray.m_origin[axis]) * ray.m_reciprocal[axis];
+            const vfloat_t t_1 = (node.m_max[axis] - ray.m_origin[axis]) * ray.m_reciprocal[axis];
+            t_near = Maths::simd_max(t_near, Maths::simd_min(t_0, t_1));
+            t_far = Maths::simd_min(t_far, Maths::simd_max(t_0, t_1));
+        }
+
+        constexpr vfloat_t miss = vfloat_t {} + std::numeric_limits<float>::infinity();
+        return t_near <= t_far * float_slab_far_scale ? t_near : miss;
+    }
+
+    static bool before(float entry, Real t_max) noexcept {
+        return entry <= round_up_float(t_max) * float_slab_far_scale;
+    }
+
+protected:
+    [[nodiscard]] std::optional<Intersection> intersect_impl(
+        Ray ray, std::size_t &bound_checks, std::size_t &shape_checks) const noexcept override {
+        Hit best {};
+
+        if (m_nodes.empty())
+            return std::nullopt;
+
+        const auto simd_ray = broadcast(ray);
+
+        // node indices along with the distances at which the ray enters them
+        std::array<std::pair<std::uint32_t, float>, m_stack_capacity> stack;
+        std::size_t stack_size = 0;
+        stack[stack_size++] = { 0, 0.f };
+
+        while (stack_size) {
+            const auto [node_index, node_entry] = stack[--stack_size];
+            if (!before(node_entry, best.m_distance))
+                continue;
+
+            const auto &node = m_nodes[node_index];
+            const auto entries = slab_test(node, simd_ray, best.m_distance);
+
+            if constexpr (Paths::ProgramConfig::embed_ray_stats) {
+                bound_checks += Width;
+                NodeCacheModel::fetch(node);
+            }
+
+            // the children that got hit, sorted by their entry distances
+            std::array<std::pair<float, std::size_t>, Width> hits;
+            std::size_t hit_count = 0;
+            for (std::size_t slot = 0; slot < Width; slot++) {
+                const float entry = entries[slot];
+                if (entry == std::numeric_limits<float>::infinity() || node.m_child[slot] == m_npos)
+                    continue;
+
+                std::size_t i = hit_count++;
+                for (; i > 0 && hits[i - 1].first > entry; i--)
+                    hits[i] = hits[i - 1];
+                hits[i] = { entry, slot };
+            }
+
+            for (std::size_t i = 0; i < hit_count; i++) {
+                const auto [entry, slot] = hits[i];
+                const auto count = node.m_shape_count[slot];
+                if (!count || !before(entry, best.m_distance))
+                    continue;
+
+                const auto range = std::pair { node.m_child[slot], node.m_child[slot] + count };
+                if constexpr (Paths::ProgramConfig::embed_ray_stats)
+                    shape_checks += m_shapes.checks(range);
+                m_shapes.closest_hit(ray, range, best);
+            }
+
+            // pushed farthest first so that the nearest gets popped first
+            for (std::size_t i = hit_count; i-- > 0;) {
+                const auto [entry, slot] = hits[i];
+                if (!node.m_shape_count[slot])
+                    stack[stack_size++] = { node.m_child[slot], entry };
+            }
+        }
+
+        if (best.m_primitive == Hit::m_npos)
+            return std::nullopt;
+        return m_shapes.surface_at(ray, best);
+    }
+
+    /// Visits the nodes that any of the rays hit. Every stack entry remembers the first ray that hit the parent, the
+    /// rays before it are not tested against the node again.
+    void intersect_packet_impl(std::span<const Ray> rays, std::span<std::optional<Intersection>> isects,
+        std::size_t &bound_checks, std::size_t &shape_checks) const noexcept override {
+        std::array<Hit, m_packet_size> hits {};
+        std::array<SIMDRay, m_packet_size> simd_rays;
+        for (std::size_t i = 0; i < rays.size(); i++)
+            simd_rays[i] = broadcast(rays[i]);
+
+        const auto ray_count = static_cast<std::uint32_t>(rays.size());
+
+        // node indices along with the first rays that might hit them
+        std::array<std::pair<std::uint32_t, std::uint32_t>, m_stack_capacity> stack;
+        std::size_t stack_size = 0;
+        if (!m_nodes.empty())
+            stack[stack_size++] = { 0, 0 };
+
+        while (stack_size) {
+            const auto [node_index, first_candidate] = stack[--stack_size];
+            const auto &node = m_nodes[node_index];
+
+            // the slots that every ray hits, and the first ray that hits every slot along with its entry distance
+            std::array<std::uint32_t, m_packet_size> slot_masks;
+            std::array<std::uint32_t, Width> first_ray;
+            std::array<float, Width> first_entry;
+            std::fill(first_ray.begin(), first_ray.end(), ray_count);
+
+            for (auto i = first_candidate; i < ray_count; i++) {
+                const auto entries = slab_test(node, simd_rays[i], hits[i].m_distance);
+                if constexpr (Paths::ProgramConfig::embed_ray_stats)
+                    bound_checks += Width;
+
+                slot_masks[i] = 0;
+                for (std::size_t slot = 0; slot < Width; slot++) {
+                    if (entries[slot] == std::numeric_limits<float>::infinity() || node.m_child[slot] == m_npos)
+                        continue;
+
+                    slot_masks[i] |= 1u << slot;
+                    if (first_ray[slot] == ray_count) {
+                        first_ray[slot] = i;
+                        first_entry[slot] = entries[slot];
+                    }
+                }
+            }
+
+            // inner children sorted by the entry distances of their first rays
+            std::array<std::pair<float, std::size_t>, Width> inner;
+            std::size_t inner_count = 0;
+
+            for (std::size_t slot = 0; slot < Width; slot++) {
+                if (first_ray[slot] == ray_count)
+                    continue;
+
+                const auto count = node.m_shape_count[slot];
+                if (!count) {
+                    std::size_t i = inner_count++;
+                    for (; i > 0 && inner[i - 1].first > first_entry[slot]; i--)
+                        inner[i] = inner[i - 1];
+                    inner[i] = { first_entry[slot], slot };
+                    continue;
+                }
+
+                const auto range = std::pair { node.m_child[slot], node.m_child[slot] + count };
+                for (auto i = first_ray[slot]; i < ray_count; i++) {
+                    if (!((slot_masks[i] >> slot) & 1))
+                        continue;
+                    if constexpr (Paths::ProgramConfig::embed_ray_stats)
+                        shape_checks += m_shapes.checks(range);
+                    m_shapes.closest_hit(rays[i], range, hits[i]);
+                }
+            }
+
+            // pushed farthest first so that the nearest gets popped first
+            for (std::size_t i = inner_count; i-- > 0;) {
+                const auto slot = inner[i].second;
+                stack[stack_size++] = { node.m_child[slot], first_ray[slot] };
+            }
+        }
+
+        for (std::size_t i = 0; i < rays.size(); i++) {
+            if (hits[i].m_primitive == Hit::m_npos)
+                isects[i] = std::nullopt;
+            else
+                isects[i] = m_shapes.surface_at(rays[i], hits[i]);
+        }
+    }
+
+    [[nodiscard]] std::optional<std::pair<Point, Point>> extents_impl() const noexcept override {
+        return get_extents(m_nodes[0]);
+    }
+
+    [[nodiscard]] bool occluded_impl(
+        Ray ray, Real t_max, std::size_t &bound_checks, std::size_t &shape_checks) const noexcept override {
+        if (m_nodes.empty())
+            return false;
+
+        const auto simd_ray = broadcast(ray);
+
+        std::array<std::uint32_t, m_stack_capacity> stack;
+        std::size_t stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size) {
+            const auto &node = m_nodes[stack[--stack_size]];
+            const auto entries = slab_test(node, simd_ray, t_max);
+
+            if constexpr (Paths::ProgramConfig::embed_ray_stats) {
+                bound_checks += Width;
+                NodeCacheModel::fetch(node);
+            }
+
+            for (std::size_t slot = 0; slot < Width; slot++) {
+                if (entries[slot] == std::numeric_limits<float>::infinity() || node.m_child[slot] == m_npos)
+                    continue;
+
+                if (const auto count = node.m_shape_count[slot]; count) {
+                    const auto range = std::pair { node.m_child[slot], node.m_child[slot] + count };
+                    if constexpr (Paths::ProgramConfig::embed_ray_stats)
+                        shape_checks += m_shapes.checks(range);
+                    if (m_shapes.occluded(ray, t_max, range))
+                        return true;
+                } else {
+                    stack[stack_size++] = node.m_child[slot];
+                }
+            }
+        }
+
+        return false;
+    }
+};
+
+}
@@ -48,17 +48,44 @@ public:
         return intersects_impl<false>(extents, ray);
     }
 
+    /// Returns the distance at which the ray enters the box if that happens before t_max, 0 if the ray starts inside
+    static constexpr std::optional<Real> ray_entry(
+        const std::pair<Point, Point> &extents, const Ray &ray, Real t_max) noexcept {
+        Real t_min = 0;
+
+        for (size_t i = 0; i < 3; ++i) {
+            const auto t_1 = (extents.first[i] - ray.m_origin[i]) * ray.m_direction_reciprocals[i];
+            const auto t_2 = (extents.second[i] - ray.m_origin[i]) * ray.m_direction_reciprocals[i];
+
+            t_min = std::max(t_min, std::min(t_1, t_2));
+            t_max = std::min(t_max, std::max(t_1, t_2));
+        }
+
+        if (t_min > t_max)
+            return std::nullopt;
+        return t_min;
+    }
+
     template<bool getDistance = false> [[nodiscard]] constexpr auto ray_intersects(const Ray &ray) const noexcept {
         return intersects_impl<getDistance>(m_extents, ray);
     }
 
     [[nodiscard]] constexpr std::optional<Intersection> intersect_ray(const Ray &ray) const noexcept {
-        const auto &[intersects, dist] = ray_intersects<true>(ray);
+        const auto hit = intersect_hit(ray);
+        if (!hit)
+            return std::nullopt;
+        return surface_at(ray, *hit);
+    }
 
-        if (!intersects)
+    [[nodiscard]] constexpr std::optional<Hit> intersect_hit(const Ray &ray) const noexcept {
+        const auto dist = intersect_distance(ray);
+        if (!dist)
             return std::nullopt;
+        return Hit { .m_distance = *dist };
+    }
 
-        auto isection = Intersection(ray, m_mat_index, dist);
+    [[nodiscard]] constexpr Intersection surface_at(const Ray &ray, const Hit &hit) const noexcept {
+        auto isection = Intersection(ray, m_mat_index, hit.m_distance);
 
         const auto p = isection.m_intersection_point - (m_extents.first + m_extents.second) * static_cast<Real>(.5);
         const auto d = (m_extents.first - m_extents.second) * static_cast<Real>(.5);
@@ -70,6 +97,13 @@ public:
         return isection;
     }
 
+    [[nodiscard]] constexpr std::optional<Real> intersect_distance(const Ray &ray) const noexcept {
+        const auto &[intersects, dist] = ray_intersects<true>(ray);
+        if (!intersects)
+            return std::nullopt;
+        return dist;
+    }
+
     std::pair<Point, Point> m_extents;
     Point m_center;
 
@@ -103,4 +137,32 @@ constexpr bool in_bounds(const std::pair<Point, Point> &b_0, Point p) {
     return true;
 }
 
+/// Extents that contain nothing, merging anything into these will yield the merged extents
+static constexpr std::pair<Point, Point> empty_extents { { +sensible_inf, +sensible_inf, +sensible_inf },
+    { -sensible_inf, -sensible_inf, -sensible_inf } };
+
+constexpr std::pair<Point, Point> merge_extents(const std::pair<Point, Point> &b_0, const std::pair<Point, Point> &b_1) {
+    return { Maths::min(b_0.first, b_1.first), Maths::max(b_0.second, b_1.second) };
+}
+
+constexpr std::pair<Point, Point> merge_extents(const std::pair<Point, Point> &b_0, Point p) {
+    return { Maths::min(b_0.first, p), Maths::max(b_0.second, p) };
+}
+
+/// Grows the extents by sensible_eps and a few ulps of their magnitude, so that extents with rounding errors in them
+/// (e.g. those of clipped shapes) still contain what they bound in single precision too
+constexpr std::pair<Point, Point> padded_extents(const std::pair<Point, Point> &b_0) {
+    const Point magnitude = Maths::max(Maths::abs(b_0.first), Maths::abs(b_0.second));
+    const Point padding = magnitude * (static_cast<Real>(4) * eps) + epsilon_point;
+    return { b_0.first - padding, b_0.second + padding };
+}
+
+/// Surface area of a box, 0 for empty extents
+constexpr Real surface_area(const std::pair<Point, Point> &b_0) {
+    const Point d = b_0.second - b_0.first;
+    if (d[0] < 0 || d[1] < 0 || d[2] < 0)
+        return 0;
+    return static_cast<Real>(2) * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
 }
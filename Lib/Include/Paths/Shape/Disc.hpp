@@ -43,14 +43,32 @@ public:
         , m_mat_index(mat_index) { }
 
     [[nodiscard]] constexpr std::optional<Intersection> intersect_ray(const Ray &ray) const noexcept {
-        auto i = m_impl.intersect_ray(ray);
-        i->m_mat_index = m_mat_index;
-        const auto d = i->m_intersection_point - m_impl.m_center;
+        const auto hit = intersect_hit(ray);
+        if (!hit)
+            return std::nullopt;
+        return surface_at(ray, *hit);
+    }
+
+    [[nodiscard]] constexpr std::optional<Hit> intersect_hit(const Ray &ray) const noexcept {
+        const auto t = intersect_distance(ray);
+        if (!t)
+            return std::nullopt;
+        return Hit { .m_distance = *t };
+    }
+
+    [[nodiscard]] constexpr Intersection surface_at(const Ray &ray, const Hit &hit) const noexcept {
+        return Intersection(ray, m_mat_index, hit.m_distance, m_impl.m_normal, { 0, 0 });
+    }
+
+    [[nodiscard]] constexpr std::optional<Real> intersect_distance(const Ray &ray) const noexcept {
+        const auto t = m_impl.intersect_distance(ray);
+        if (!t)
+            return std::nullopt;
 
+        const auto d = ray.m_origin + ray.m_direction * *t - m_impl.m_center;
         if (Maths::dot(d, d) > m_radius)
             return std::nullopt;
-        else
-            return i;
+        return t;
     }
 
     std::pair<Point, Point> m_extents;
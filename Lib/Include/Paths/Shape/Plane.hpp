@@ -31,6 +31,24 @@ public:
         return Intersection(ray, m_mat_index, t, m_normal, { 0, 0 });
     }
 
+    [[nodiscard]] constexpr std::optional<Hit> intersect_hit(const Ray &ray) const noexcept {
+        const auto t = intersect_distance(ray);
+        if (!t)
+            return std::nullopt;
+        return Hit { .m_distance = *t };
+    }
+
+    [[nodiscard]] constexpr Intersection surface_at(const Ray &ray, const Hit &hit) const noexcept {
+        return Intersection(ray, m_mat_index, hit.m_distance, m_normal, { 0, 0 });
+    }
+
+    [[nodiscard]] constexpr std::optional<Real> intersect_distance(const Ray &ray) const noexcept {
+        const auto t = intersect_impl(ray);
+        if (t < sensible_eps)
+            return std::nullopt;
+        return t;
+    }
+
     [[nodiscard]] constexpr Real intersect_impl(const Ray &ray) const noexcept {
         LIBGFX_NORMAL_CHECK(ray.m_direction);
         LIBGFX_NORMAL_CHECK(m_normal);
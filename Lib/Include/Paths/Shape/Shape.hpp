@@ -9,8 +9,11 @@
 namespace Paths::Concepts {
 
 template<typename T>
-concept Shape = requires(const T &s, const Ray &ray) {
+concept Shape = requires(const T &s, const Ray &ray, const Hit &hit) {
     { s.intersect_ray(ray) } -> std::convertible_to<std::optional<Intersection>>;
+    { s.intersect_distance(ray) } -> std::convertible_to<std::optional<Real>>;
+    { s.intersect_hit(ray) } -> std::convertible_to<std::optional<Hit>>;
+    { s.surface_at(ray, hit) } -> std::convertible_to<Intersection>;
 }
 &&requires(T &s) { true; };
 
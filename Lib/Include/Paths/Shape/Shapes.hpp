@@ -40,16 +40,50 @@ constexpr auto apply(auto &&shape, auto &&cb) {
         return std::invoke(cb, std::forward<ShapeT>(shape));
 }
 
+/// Replaces best with the closest hit among the shapes if that is closer, the primitive of the hit is the index of the
+/// shape within [begin, end). Returns whether best got replaced.
+template<typename It> bool closest_hit_linear(const Ray &ray, It begin, It end, Hit &best) {
+    bool replaced = false;
+
+    for (It it = begin; it < end; it++) {
+        const auto hit = apply(*it, [&ray]<Concepts::Shape T>(const T &s) { return s.intersect_hit(ray); });
+        if (!hit || hit->m_distance <= 0 || hit->m_distance >= best.m_distance)
+            continue;
+
+        best = *hit;
+        best.m_primitive = static_cast<std::uint32_t>(it - begin);
+        replaced = true;
+    }
+
+    return replaced;
+}
+
+/// Completes the Intersection of a hit on shape
+template<typename S> Intersection surface_at(const S &shape, const Ray &ray, const Hit &hit) {
+    return apply(shape, [&ray, &hit]<Concepts::Shape T>(const T &s) { return s.surface_at(ray, hit); });
+}
+
 template<typename It> std::optional<Intersection> intersect_linear(Ray ray, It begin, It end) {
-    std::optional<Intersection> best = std::nullopt;
+    Hit best {};
+    if (!closest_hit_linear(ray, begin, end, best))
+        return std::nullopt;
 
+    return surface_at(*(begin + best.m_primitive), ray, best);
+}
+
+/// Checks if any of the shapes gets hit by the ray closer than t_max, stops at the first such hit
+template<typename It> bool occluded_linear(Ray ray, Real t_max, It begin, It end) {
     for (It it = begin; it < end; it++) {
-        apply(*it, [ray, &best]<Concepts::Shape T>(const T &s) {
-            Intersection::replace(best, std::move(s.intersect_ray(ray)));
+        const bool occludes = apply(*it, [ray, t_max]<Concepts::Shape T>(const T &s) -> bool {
+            const auto t = s.intersect_distance(ray);
+            return t && *t > 0 && *t < t_max;
         });
+
+        if (occludes)
+            return true;
     }
 
-    return best;
+    return false;
 }
 
 template<typename ShapeT, typename From> std::vector<BoundableShapeT<ShapeT>> convert_shapes_vector(const From &store) {
@@ -13,23 +13,21 @@ public:
         , m_mat_index(mat_index) { }
 
     [[nodiscard]] constexpr std::optional<Intersection> intersect_ray(const Ray &ray) const noexcept {
-        const auto temp = ray.m_origin - m_center;
-
-        const Real a = Maths::dot(ray.m_direction, ray.m_direction);
-        const Real b = static_cast<Real>(2) * Maths::dot(temp, ray.m_direction);
-        const Real c = Maths::dot(temp, temp) - m_radius * m_radius;
-
-        const Real disc = b * b - a * c * static_cast<Real>(4);
-        if (disc < 0)
+        const auto hit = intersect_hit(ray);
+        if (!hit)
             return std::nullopt;
-        const Real sq_disc = std::sqrt(disc);
-
-        const Real s_0 = (-b + sq_disc) / (static_cast<Real>(2) * a);
-        const Real s_1 = (-b - sq_disc) / (static_cast<Real>(2) * a);
+        return surface_at(ray, *hit);
+    }
 
-        const Real t = (s_0 < 1) ? s_1 : (s_1 < 1) ? s_0 : std::min(s_0, s_1);
+    [[nodiscard]] constexpr std::optional<Hit> intersect_hit(const Ray &ray) const noexcept {
+        const auto distance = intersect_distance(ray);
+        if (!distance)
+            return std::nullopt;
+        return Hit { .m_distance = *distance };
+    }
 
-        Intersection isect(ray, m_mat_index, t);
+    [[nodiscard]] constexpr Intersection surface_at(const Ray &ray, const Hit &hit) const noexcept {
+        Intersection isect(ray, m_mat_index, hit.m_distance);
 
         isect.m_normal = Maths::normalized(isect.m_intersection_point - m_center);
         isect.m_going_in = Maths::dot(isect.m_normal, ray.m_direction) < 0;
@@ -43,6 +41,24 @@ public:
         return isect;
     }
 
+    [[nodiscard]] constexpr std::optional<Real> intersect_distance(const Ray &ray) const noexcept {
+        const auto temp = ray.m_origin - m_center;
+
+        const Real a = Maths::dot(ray.m_direction, ray.m_direction);
+        const Real b = static_cast<Real>(2) * Maths::dot(temp, ray.m_direction);
+        const Real c = Maths::dot(temp, temp) - m_radius * m_radius;
+
+        const Real disc = b * b - a * c * static_cast<Real>(4);
+        if (disc < 0)
+            return std::nullopt;
+        const Real sq_disc = std::sqrt(disc);
+
+        const Real s_0 = (-b + sq_disc) / (static_cast<Real>(2) * a);
+        const Real s_1 = (-b - sq_disc) / (static_cast<Real>(2) * a);
+
+        return (s_0 < 1) ? s_1 : (s_1 < 1) ? s_0 : std::min(s_0, s_1);
+    }
+
     Point m_center;
     std::pair<Point, Point> m_extents;
 
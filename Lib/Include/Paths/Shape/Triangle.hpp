@@ -7,12 +7,35 @@
 
 #pragma once
 
+#include "Maths/MatVec.hpp"
 #include "Shape.hpp"
 
 namespace Paths::Shape {
 
 namespace Detail {
 
+/// Moves the point of a hit on a triangle to where its barycentric coordinates say it is, which is much closer to the
+/// surface than going along the ray gets, and bounds the error of it as in Pharr et al., "Physically Based Rendering",
+/// 3.9.4
+/// \param barycentrics The weights of vertices[1] and vertices[2]
+static constexpr void set_triangle_point(
+    Intersection &isection, const std::array<Point, 3> &vertices, Maths::Vector<Real, 2> barycentrics) noexcept {
+    const std::array<Real, 3> weights { 1 - barycentrics[0] - barycentrics[1], barycentrics[0], barycentrics[1] };
+
+    isection.m_intersection_point = vertices[0] * weights[0] + vertices[1] * weights[1] + vertices[2] * weights[2];
+    isection.m_error = (Maths::abs(vertices[0] * weights[0]) + Maths::abs(vertices[1] * weights[1])
+                           + Maths::abs(vertices[2] * weights[2]))
+        * Paths::Detail::error_gamma(7);
+}
+
+/// a * b - c * d, off by at most a couple of ulps and with the right sign (Kahan's algorithm). The plain difference
+/// can get fused into an fma by the compiler, which makes the edge functions that neighbouring triangles compute for
+/// the edge they share disagree in sign and lets rays through.
+static inline Real difference_of_products(Real a, Real b, Real c, Real d) noexcept {
+    const Real cd = c * d;
+    return std::fma(a, b, -cd) + std::fma(-c, d, cd);
+}
+
 enum class ETriangleCenterType {
     InCenter,
     Centroid, // center of mass
@@ -49,6 +72,105 @@ public:
         , m_normal(Maths::normalized(Maths::cross(m_edges[0], m_edges[1]))) { }
 
     [[nodiscard]] constexpr std::optional<Intersection> intersect_ray(const Ray &ray) const noexcept {
+        const auto hit = intersect_hit(ray);
+        if (!hit)
+            return std::nullopt;
+        return surface_at(ray, *hit);
+    }
+
+    [[nodiscard]] constexpr std::optional<Hit> intersect_hit(const Ray &ray) const noexcept {
+        const auto hit = intersect_impl(ray);
+        if (!hit)
+            return std::nullopt;
+
+        const auto [t, u, v] = *hit;
+        return Hit { .m_distance = t, .m_barycentrics = { u, v } };
+    }
+
+    [[nodiscard]] constexpr Intersection surface_at(const Ray &ray, const Hit &hit) const noexcept {
+        Intersection isection(ray, m_mat_index, hit.m_distance, m_normal, hit.m_barycentrics);
+        set_triangle_point(isection, m_vertices, hit.m_barycentrics);
+        return isection;
+    }
+
+    [[nodiscard]] constexpr const std::array<Point, 3> &get_vertices() const noexcept { return m_vertices; }
+
+    [[nodiscard]] constexpr const std::array<Point, 2> &get_edges() const noexcept { return m_edges; }
+
+    /// The same triangle with its vertices multiplied by transform and then moved by offset, like STL models are
+    [[nodiscard]] constexpr TriangleImpl transformed(const Matrix &transform, Point offset) const noexcept {
+        std::array<Point, 3> vertices = m_vertices;
+        for (auto &v : vertices)
+            v = v * transform + offset;
+        return TriangleImpl(m_mat_index, vertices);
+    }
+
+    [[nodiscard]] constexpr std::optional<Real> intersect_distance(const Ray &ray) const noexcept {
+        const auto hit = intersect_impl(ray);
+        if (!hit)
+            return std::nullopt;
+        return (*hit)[0];
+    }
+
+    std::pair<Point, Point> m_extents;
+    Point m_center;
+    std::size_t m_mat_index;
+    Point m_normal;
+
+private:
+    /// Returns the distance and the barycentric coordinates u and v in that order, see
+    /// ProgramConfig::watertight_triangles
+    [[nodiscard]] constexpr std::optional<std::array<Real, 3>> intersect_impl(const Ray &ray) const noexcept {
+        if constexpr (ProgramConfig::watertight_triangles)
+            return intersect_watertight(ray);
+        else
+            return intersect_moller_trumbore(ray);
+    }
+
+    /// Woop et al., "Watertight Ray/Triangle Intersection". The vertices get moved and sheared so that the ray goes
+    /// from the origin along z, which leaves a 2D test of whether the origin is inside the triangle. Neighbouring
+    /// triangles compute the edge functions of the edges they share from the same values, so no ray goes through
+    /// between them. Exact zeros are not recomputed in higher precision, rays right on an edge hit both triangles.
+    [[nodiscard]] constexpr std::optional<std::array<Real, 3>> intersect_watertight(const Ray &ray) const noexcept {
+        const auto [x, y, z] = ray.m_shear.m_axes;
+        const auto &shear = ray.m_shear.m_shear;
+
+        std::array<Point, 3> sheared;
+        for (std::size_t i = 0; i < 3; i++) {
+            const Point vertex = m_vertices[i] - ray.m_origin;
+            sheared[i]
+                = Point(vertex[x] - shear[0] * vertex[z], vertex[y] - shear[1] * vertex[z], shear[2] * vertex[z]);
+        }
+        const auto &[a, b, c] = sheared;
+
+        // the edge functions, which are the barycentric coordinates of the vertices scaled by det
+        Real w_0 = difference_of_products(c[0], b[1], c[1], b[0]);
+        Real w_1 = difference_of_products(a[0], c[1], a[1], c[0]);
+        Real w_2 = difference_of_products(b[0], a[1], b[1], a[0]);
+        Real det = w_0 + w_1 + w_2;
+        if (det == 0)
+            return std::nullopt;
+
+        // rays can hit both sides
+        const Real sign = det < 0 ? -1 : 1;
+        w_0 *= sign;
+        w_1 *= sign;
+        w_2 *= sign;
+        det *= sign;
+
+        if (w_1 < 0 || w_2 < 0 || (parallelogram ? w_1 > det || w_2 > det : w_0 < 0))
+            return std::nullopt;
+
+        const auto t = w_0 * a[2] + w_1 * b[2] + w_2 * c[2];
+        if (t <= 0)
+            return std::nullopt;
+
+        return std::array<Real, 3> { t / det, w_1 / det, w_2 / det };
+    }
+
+    /// Möller–Trumbore
+    [[nodiscard]] constexpr std::optional<std::array<Real, 3>> intersect_moller_trumbore(
+        const Ray &ray) const noexcept {
         LIBGFX_NORMAL_CHECK(ray.m_direction);
         LIBGFX_NORMAL_CHECK(m_normal);
 
@@ -74,15 +196,9 @@ public:
         if (t <= sensible_eps)
             return std::nullopt;
 
-        return Intersection(ray, m_mat_index, t, m_normal, { u, v });
+        return std::array<Real, 3> { t, u, v };
     }
 
-    std::pair<Point, Point> m_extents;
-    Point m_center;
-    std::size_t m_mat_index;
-    Point m_normal;
-
-private:
     [[nodiscard]] static constexpr std::array<Real, 3> p_vec_k_calc(const std::array<Point, 3> &vertices) noexcept {
         return {
             Maths::Magnitude(vertices[1] - vertices[2]),
@@ -0,0 +1,76 @@
+#pragma once
+
+extern "C" {
+#include <sys/resource.h>
+}
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "SpinLock.hpp"
+
+namespace Utils {
+
+/// Hands out memory from large blocks that are all released at once when the arena is destroyed. Objects made in an
+/// arena are never destructed, their destructors must not have any effects that are relied on.
+/// Allocations can be made from multiple threads at once.
+class MonotonicArena {
+public:
+    static constexpr std::size_t m_default_block_size = 1 << 20;
+
+    explicit MonotonicArena(std::size_t block_size = m_default_block_size) noexcept
+        : m_block_size(block_size) { }
+
+    MonotonicArena(const MonotonicArena &) = delete;
+    MonotonicArena &operator=(const MonotonicArena &) = delete;
+
+    [[nodiscard]] void *allocate(std::size_t size, std::size_t alignment) noexcept {
+        std::lock_guard lock(m_lock);
+
+        void *ptr = m_cursor;
+        std::size_t space = m_space;
+        if (!std::align(alignment, size, ptr, space)) {
+            space = std::max(m_block_size, size + alignment);
+            m_blocks.push_back(std::make_unique_for_overwrite<std::byte[]>(space));
+            m_reserved_bytes += space;
+
+            ptr = m_blocks.back().get();
+            std::align(alignment, size, ptr, space);
+        }
+
+        m_cursor = static_cast<std::byte *>(ptr) + size;
+        m_space = space - size;
+        return ptr;
+    }
+
+    template<typename T, typename... Args> [[nodiscard]] T *make(Args &&...args) noexcept {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    /// The total size of the blocks, including what has not been handed out yet
+    [[nodiscard]] std::size_t reserved_bytes() const noexcept { return m_reserved_bytes; }
+
+private:
+    std::size_t m_block_size;
+    std::vector<std::unique_ptr<std::byte[]>> m_blocks {};
+    std::byte *m_cursor = nullptr;
+    std::size_t m_space = 0;
+    std::size_t m_reserved_bytes = 0;
+    Spinlock m_lock {};
+};
+
+/// The largest resident set size the process has had so far, 0 if it is not known
+[[nodiscard]] inline std::size_t peak_resident_bytes() noexcept {
+    struct rusage usage { };
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+    // in kilobytes on linux
+    return static_cast<std::size_t>(usage.ru_maxrss) * 1024;
+}
+
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+
+#include "ThreadPool.hpp"
+#include "WorkStealing.hpp"
+
+namespace Utils {
+
+/// Calls fn(chunk, start, end) for n_chunks contiguous chunks of [0, size) concurrently on the global ThreadPool.
+/// Returns when every chunk is processed.
+/// n_chunks is clamped to [1, size], chunk indices are always below the requested n_chunks.
+template<typename Fn> void parallel_chunks(std::size_t size, std::size_t n_chunks, Fn &&fn) {
+    n_chunks = std::max<std::size_t>(1, std::min(n_chunks, size));
+    const std::size_t chunk_size = size / n_chunks;
+
+    auto chunk_bounds = [size, n_chunks, chunk_size](std::size_t i) -> std::pair<std::size_t, std::size_t> {
+        return { i * chunk_size, (i + 1 == n_chunks) ? size : (i + 1) * chunk_size };
+    };
+
+    ThreadPool::global().run(n_chunks, [&fn, &chunk_bounds](std::size_t i) {
+        const auto [start, end] = chunk_bounds(i);
+        std::invoke(fn, i, start, end);
+    });
+}
+
+/// Calls fn(thread, i) for every i in [0, size) from n_threads tasks of the global ThreadPool, no two of which run with
+/// the same thread index at once. Every thread gets a contiguous run of the indices to go through in order and steals
+/// from the ends of the others' runs once done with its own, so neighbouring indices mostly end up on the same thread
+/// even when they take very different amounts of time. Returns the number of indices that got stolen.
+template<typename Fn> std::size_t parallel_for_stealing(std::size_t size, std::size_t n_threads, Fn &&fn) {
+    n_threads = std::max<std::size_t>(1, std::min(n_threads, size));
+
+    WorkStealingDeques<std::size_t> deques(n_threads);
+    for (std::size_t thread = 0; thread < n_threads; thread++)
+        for (std::size_t i = size * thread / n_threads; i < size * (thread + 1) / n_threads; i++)
+            deques.push(thread, i);
+
+    auto worker = [&deques, &fn](std::size_t thread) {
+        while (const auto i = deques.pop(thread))
+            std::invoke(fn, thread, *i);
+    };
+
+    ThreadPool::global().run(n_threads, worker);
+
+    return deques.steals();
+}
+
+/// Runs lhs and rhs as two tasks of the global ThreadPool, returns when both are done
+template<typename Lhs, typename Rhs> void fork_join(Lhs &&lhs, Rhs &&rhs) {
+    ThreadPool::global().run(2, [&lhs, &rhs](std::size_t i) {
+        if (i == 0)
+            std::invoke(lhs);
+        else
+            std::invoke(rhs);
+    });
+}
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "Parallel.hpp"
+
+namespace Utils {
+
+/// Stable least significant digit radix sort of values by key(value), an unsigned integer of which only the lower
+/// key_bits are looked at. Every pass histograms and scatters n_chunks contiguous chunks concurrently, passes over
+/// digits that are the same for every value are skipped.
+template<typename T, typename KeyFn>
+void radix_sort(std::vector<T> &values, KeyFn &&key, std::size_t key_bits, std::size_t n_chunks) {
+    static constexpr std::size_t digit_bits = 11;
+    static constexpr std::size_t digit_count = 1 << digit_bits;
+    typedef std::array<std::size_t, digit_count> histogram_t;
+
+    n_chunks = std::max<std::size_t>(1, std::min(n_chunks, values.size()));
+    std::vector<T> scratch(values.size());
+    std::vector<histogram_t> offsets(n_chunks);
+
+    for (std::size_t shift = 0; shift < key_bits; shift += digit_bits) {
+        auto digit_of = [&key, shift](const T &value) -> std::size_t {
+            return static_cast<std::size_t>(std::invoke(key, value) >> shift) & (digit_count - 1);
+        };
+
+        parallel_chunks(values.size(), n_chunks,
+            [&values, &offsets, &digit_of](std::size_t chunk, std::size_t start, std::size_t end) {
+                auto &histogram = offsets[chunk];
+                histogram.fill(0);
+                for (std::size_t i = start; i < end; i++)
+                    ++histogram[digit_of(values[i])];
+            });
+
+        // turn the per-chunk counts into the positions where every chunk starts writing every digit
+        std::size_t position = 0;
+        bool single_digit = false;
+        for (std::size_t digit = 0; digit < digit_count; digit++) {
+            std::size_t digit_total = 0;
+            for (auto &histogram : offsets) {
+                const auto count = histogram[digit];
+                histogram[digit] = position + digit_total;
+                digit_total += count;
+            }
+            single_digit |= digit_total == values.size();
+            position += digit_total;
+        }
+
+        if (single_digit)
+            continue;
+
+        parallel_chunks(values.size(), n_chunks,
+            [&values, &scratch, &offsets, &digit_of](std::size_t chunk, std::size_t start, std::size_t end) {
+                auto &positions = offsets[chunk];
+                for (std::size_t i = start; i < end; i++)
+                    scratch[positions[digit_of(values[i])]++] = std::move(values[i]);
+            });
+
+        std::swap(values, scratch);
+    }
+}
+
+}
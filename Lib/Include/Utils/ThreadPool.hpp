@@ -0,0 +1,163 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Utils {
+
+/// A fixed set of threads that run the tasks of every parallel loop of the process, see global(). Threads with nothing
+/// to do sleep on a condition variable instead of spinning.
+/// A thread that waits for its tasks to be done runs the unstarted tasks of the loops that its tasks started in the
+/// meantime, so tasks can start parallel loops of their own without running out of threads. It does not help with
+/// unrelated loops, a task of which (say a whole tile of a render) could keep it busy long after its own loop is done.
+class ThreadPool {
+public:
+    /// n_threads counts the threads that call run() too, 0 is one thread per core
+    explicit ThreadPool(std::size_t n_threads = 0) { start_workers(n_threads); }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool() noexcept { stop_workers(); }
+
+    /// The pool that all of the parallel helpers in Parallel.hpp submit to
+    [[nodiscard]] static ThreadPool &global() noexcept {
+        static ThreadPool pool {};
+        return pool;
+    }
+
+    /// The number of threads that tasks run on, counting the one that calls run()
+    [[nodiscard]] std::size_t thread_count() const noexcept { return m_workers.size() + 1; }
+
+    /// Replaces the threads of the pool, must not be called while any tasks are running. 0 is one thread per core.
+    void set_thread_count(std::size_t n_threads) {
+        stop_workers();
+        start_workers(n_threads);
+    }
+
+    /// Calls fn(i) for every i in [0, n_tasks) on the threads of the pool and on the calling thread, returns when every
+    /// call has returned. Tasks are started in order of their indices.
+    template<typename Fn> void run(std::size_t n_tasks, Fn &&fn) {
+        if (n_tasks <= 1 || m_workers.empty()) {
+            for (std::size_t i = 0; i < n_tasks; i++)
+                std::invoke(fn, i);
+            return;
+        }
+
+        using FnType = std::remove_reference_t<Fn>;
+        Job job {
+            .m_invoke = [](void *fn, std::size_t i) { std::invoke(*static_cast<FnType *>(fn), i); },
+            .m_fn = const_cast<void *>(static_cast<const void *>(std::addressof(fn))),
+            .m_size = n_tasks,
+            .m_parent = s_current_job,
+        };
+
+        std::unique_lock lock(m_mutex);
+        m_jobs.push_back(&job);
+        m_cv.notify_all();
+
+        // the tasks of this job go first, the job is off of m_jobs once they have all been started
+        while (job.m_done != job.m_size) {
+            if (Job *next = job.m_next != job.m_size ? &job : find_job(&job))
+                run_task(lock, *next);
+            else
+                m_cv.wait(lock);
+        }
+    }
+
+private:
+    /// A parallel loop, lives on the stack of the thread that called run() with it
+    struct Job {
+        void (*m_invoke)(void *fn, std::size_t i);
+        void *m_fn;
+        std::size_t m_size;
+
+        /// The job of the task that called run() with this one, which cannot be done before this one is
+        Job *m_parent = nullptr;
+
+        std::size_t m_next = 0;
+        std::size_t m_done = 0;
+    };
+
+    /// The job of the task that the thread is running, nullptr outside of tasks
+    static inline thread_local Job *s_current_job = nullptr;
+
+    /// Guards m_jobs, the counters of the jobs and m_stopping
+    std::mutex m_mutex {};
+    /// Notified when a job is added, when one is done and when the workers are being stopped
+    std::condition_variable m_cv {};
+    /// Jobs with tasks that have not been started
+    std::vector<Job *> m_jobs {};
+    bool m_stopping = false;
+
+    std::vector<std::thread> m_workers {};
+
+    /// The newest job with tasks that have not been started, those are the likeliest to be holding up the others. If
+    /// ancestor is given, only jobs started by its tasks (directly or through other jobs) are considered.
+    Job *find_job(const Job *ancestor = nullptr) noexcept {
+        for (auto it = m_jobs.rbegin(); it != m_jobs.rend(); ++it) {
+            if (!ancestor)
+                return *it;
+            for (const Job *job = (*it)->m_parent; job; job = job->m_parent)
+                if (job == ancestor)
+                    return *it;
+        }
+        return nullptr;
+    }
+
+    void run_task(std::unique_lock<std::mutex> &lock, Job &job) {
+        const std::size_t i = job.m_next++;
+        if (job.m_next == job.m_size)
+            std::erase(m_jobs, &job);
+
+        lock.unlock();
+        Job *const outer_job = std::exchange(s_current_job, &job);
+        job.m_invoke(job.m_fn, i);
+        s_current_job = outer_job;
+        lock.lock();
+
+        if (++job.m_done == job.m_size)
+            m_cv.notify_all();
+    }
+
+    void worker_fn() {
+        std::unique_lock lock(m_mutex);
+        while (!m_stopping) {
+            if (Job *job = find_job())
+                run_task(lock, *job);
+            else
+                m_cv.wait(lock);
+        }
+    }
+
+    void start_workers(std::size_t n_threads) {
+        if (n_threads == 0)
+            n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+        m_stopping = false;
+        m_workers.reserve(n_threads - 1);
+        for (std::size_t i = 1; i < n_threads; i++)
+            m_workers.emplace_back(&ThreadPool::worker_fn, this);
+    }
+
+    void stop_workers() noexcept {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stopping = true;
+        }
+        m_cv.notify_all();
+
+        for (auto &worker : m_workers)
+            worker.join();
+        m_workers.clear();
+    }
+};
+
+}
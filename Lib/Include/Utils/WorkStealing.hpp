@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "SpinLock.hpp"
+
+namespace Utils {
+
+/// A deque of work items for every thread. Threads take items from the front of their own deque and, once that is
+/// empty, steal them from the backs of the others. Items that get pushed to a deque one after the other are done by
+/// the same thread in that order unless some other thread runs out of work, and the ones that get stolen are the ones
+/// the owner would have gotten to last.
+template<typename T> class WorkStealingDeques {
+public:
+    explicit WorkStealingDeques(std::size_t n_threads)
+        : m_deques(std::max<std::size_t>(1, n_threads)) { }
+
+    [[nodiscard]] std::size_t thread_count() const noexcept { return m_deques.size(); }
+
+    void push(std::size_t thread, T item) {
+        auto &deque = m_deques[thread];
+        std::lock_guard lock(deque.m_lock);
+        deque.m_items.push_back(std::move(item));
+    }
+
+    /// The next item of thread, std::nullopt once every deque is empty
+    [[nodiscard]] std::optional<T> pop(std::size_t thread) {
+        if (auto item = take(thread, false))
+            return item;
+
+        for (std::size_t i = 1; i < m_deques.size(); i++) {
+            if (auto item = take((thread + i) % m_deques.size(), true)) {
+                m_steals.fetch_add(1, std::memory_order_relaxed);
+                return item;
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    /// The number of items that got taken by some thread other than the one they were pushed for
+    [[nodiscard]] std::size_t steals() const noexcept { return m_steals.load(std::memory_order_relaxed); }
+
+private:
+    /// Aligned so that threads working on their own deques do not share cache lines
+    struct alignas(64) Deque {
+        Spinlock m_lock {};
+        std::deque<T> m_items {};
+    };
+
+    std::vector<Deque> m_deques;
+    std::atomic<std::size_t> m_steals { 0 };
+
+    std::optional<T> take(std::size_t thread, bool from_back) {
+        auto &deque = m_deques[thread];
+        std::lock_guard lock(deque.m_lock);
+        if (deque.m_items.empty())
+            return std::nullopt;
+
+        T item = std::move(from_back ? deque.m_items.back() : deque.m_items.front());
+        if (from_back)
+            deque.m_items.pop_back();
+        else
+            deque.m_items.pop_front();
+        return item;
+    }
+};
+
+}
@@ -6,6 +6,8 @@
 #include <functional>
 #include <vector>
 
+#include "Utils/Parallel.hpp"
+
 namespace Paths::Image {
 
 template<typename Callback> static void for_each_channel(std::array<std::vector<float>, 3> &channels, Callback &&cb) {
@@ -18,10 +20,13 @@ template<std::size_t type> static inline bool export_impl(const std::string &fil
 
     for_each_channel(channels, [&](auto, auto &c) { c = std::vector<float>(image.size()); });
 
-    for (size_t i = 0; i < image.size(); i++) {
-        for_each_channel(
-            channels, [&](std::size_t j, std::vector<float> &c) { c[i] = static_cast<float>(image.data()[i][j]); });
-    }
+    Utils::parallel_chunks(image.size(), ProgramConfig::preferred_thread_count(),
+        [&](std::size_t, std::size_t start, std::size_t end) {
+            for (size_t i = start; i < end; i++) {
+                for_each_channel(channels,
+                    [&](std::size_t j, std::vector<float> &c) { c[i] = static_cast<float>(image.data()[i][j]); });
+            }
+        });
 
     float *channels_ptr[3];
     for_each_channel(channels, [&channels_ptr](auto i, auto &c) { channels_ptr[2 - i] = c.data(); });
@@ -5,6 +5,8 @@
 
 #include "lodepng.h"
 
+#include "Utils/Parallel.hpp"
+
 namespace Paths::Image {
 
 bool Exporter<PNGExporter>::export_to(const std::string &filename, ImageView image) {
@@ -17,17 +19,20 @@ bool Exporter<PNGExporter>::export_to(const std::string &filename, ImageView ima
             Filters::Unary::clamp(0, 1), Filters::Unary::oper([](ColorChannelType v) { return v * 255.; }));
 
     std::vector<unsigned char> image_data(image.size() * 4);
-    for (size_t y = 0; y < image.m_height; y++) {
-        for (size_t x = 0; x < image.m_width; x++) {
-            const auto &color = image.at(x, y);
-
-            const auto idx = (x + y * image.m_width) * 4;
-            image_data[idx + 0] = static_cast<uint8_t>(filter(color[0]));
-            image_data[idx + 1] = static_cast<uint8_t>(filter(color[1]));
-            image_data[idx + 2] = static_cast<uint8_t>(filter(color[2]));
-            image_data[idx + 3] = 255;
-        }
-    }
+    Utils::parallel_chunks(image.m_height, ProgramConfig::preferred_thread_count(),
+        [&](std::size_t, std::size_t start, std::size_t end) {
+            for (size_t y = start; y < end; y++) {
+                for (size_t x = 0; x < image.m_width; x++) {
+                    const auto &color = image.at(x, y);
+
+                    const auto idx = (x + y * image.m_width) * 4;
+                    image_data[idx + 0] = static_cast<uint8_t>(filter(color[0]));
+                    image_data[idx + 1] = static_cast<uint8_t>(filter(color[1]));
+                    image_data[idx + 2] = static_cast<uint8_t>(filter(color[2]));
+                    image_data[idx + 3] = 255;
+                }
+            }
+        });
 
     auto res = lodepng::encode(filename, image_data, image.m_width, image.m_height, LCT_RGBA, 8);
 
@@ -2,7 +2,8 @@
 
 namespace Paths {
 
-[[nodiscard]] Color MonteCarloIntegrator::sample(Ray ray, Scene &scene) const noexcept {
+[[nodiscard]] Color MonteCarloIntegrator::sample_hit(
+    Ray ray, const std::optional<Intersection> &first_isection, Scene &scene) const noexcept {
     Color w_o { 0, 0, 0 };
     Color cur_a { 1, 1, 1 };
     Real previous_cosine = 1;
@@ -11,6 +12,7 @@ namespace Paths {
     std::size_t shape_checks = 0;
 
     Ray current_ray = ray;
+    std::optional<Intersection> isection = first_isection;
 
     for (size_t depth = 0;; depth++) {
         if (depth > 7) {
@@ -18,12 +20,13 @@ namespace Paths {
                 break;
         }
 
-        auto isection = scene.intersect_ray(current_ray, bound_checks, shape_checks);
+        if (depth)
+            isection = scene.intersect_ray(current_ray, bound_checks, shape_checks);
         if (!isection)
             break;
 
         const auto material = scene.get_material(isection->m_mat_index);
-        const Point safe_reflection_spot = isection->m_intersection_point + isection->m_oriented_normal * sensible_eps;
+        const Point safe_reflection_spot = isection->offset_origin();
 
         /*Color lambertian{};
         for (const auto &light: dotLights) {
@@ -2,9 +2,10 @@
 
 namespace Paths {
 
-[[nodiscard]] Color WhittedIntegrator::sample(Ray ray, Scene &scene) const noexcept {
+[[nodiscard]] Color WhittedIntegrator::sample_hit(
+    Ray ray, const std::optional<Intersection> &isection, Scene &scene) const noexcept {
     std::size_t bound_checks = 0, shape_checks = 0;
-    const Color res = sample_impl(ray, scene, 0, bound_checks, shape_checks);
+    const Color res = shade(ray, isection, scene, 0, bound_checks, shape_checks);
     return res;
 }
 
@@ -13,8 +14,11 @@ namespace Paths {
     if (depth >= 8)
         return {};
 
-    auto isection = scene.intersect_ray(ray, bound_checks, shape_checks);
+    return shade(ray, scene.intersect_ray(ray, bound_checks, shape_checks), scene, depth, bound_checks, shape_checks);
+}
 
+[[nodiscard]] Color WhittedIntegrator::shade(Ray ray, const std::optional<Intersection> &isection, Scene &scene,
+    std::size_t depth, std::size_t &bound_checks, std::size_t &shape_checks) const noexcept {
     if (!isection)
         return {};
 
@@ -26,7 +30,7 @@ namespace Paths {
         = EAction::Diffuse;
 
     const auto material = scene.get_material(isection->m_mat_index);
-    const Point safe_reflection_spot = isection->m_intersection_point + isection->m_oriented_normal * sensible_eps;
+    const Point safe_reflection_spot = isection->offset_origin();
 
     if (material.m_reflectance >= 0.95)
         action = EAction::Mirror;
@@ -39,8 +43,7 @@ namespace Paths {
             const Point l = light.m_position - isection->m_intersection_point;
             const auto l_dist = Maths::Magnitude(l);
 
-            if (auto itemp = scene.intersect_ray(Ray(safe_reflection_spot, l / l_dist), bound_checks, shape_checks);
-                itemp && itemp->m_distance < l_dist)
+            if (scene.occluded(Ray(safe_reflection_spot, l / l_dist), l_dist, bound_checks, shape_checks))
                 continue;
 
             const auto [c_lamb, c_spec] = Detail::blinn_phong_coefficients(
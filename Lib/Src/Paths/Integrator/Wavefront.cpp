@@ -0,0 +1,220 @@
+#include "Paths/Integrator/Wavefront.hpp"
+
+#include <chrono>
+
+#include "Maths/Morton.hpp"
+#include "Paths/Scene/NodeCache.hpp"
+#include "Utils/Parallel.hpp"
+#include "Utils/RadixSort.hpp"
+
+namespace Paths {
+
+void WavefrontIntegrator::set_camera(Camera c) noexcept {
+    m_camera = c;
+    m_camera.prepare();
+    m_back_buffer.resize(c.m_resolution[0], c.m_resolution[1]);
+
+    const auto width = c.m_resolution[0], height = c.m_resolution[1];
+    constexpr std::size_t tile_side = 8;
+
+    m_pixel_order.clear();
+    m_pixel_order.reserve(width * height);
+    for (std::size_t tile_y = 0; tile_y < height; tile_y += tile_side)
+        for (std::size_t tile_x = 0; tile_x < width; tile_x += tile_side)
+            for (std::size_t y = tile_y; y < std::min(tile_y + tile_side, height); y++)
+                for (std::size_t x = tile_x; x < std::min(tile_x + tile_side, width); x++)
+                    m_pixel_order.push_back(static_cast<std::uint32_t>(y * width + x));
+}
+
+void WavefrontIntegrator::do_render() noexcept {
+    for (std::size_t start = 0; start < m_pixel_order.size(); start += m_max_wave_size) {
+        generate(start, std::min(start + m_max_wave_size, m_pixel_order.size()));
+
+        for (std::size_t bounce = 0; !m_rays.empty(); bounce++) {
+            roulette();
+            retire();
+
+            if (bounce == 0) {
+                RayStatistics camera_statistics {};
+                extend(true, false, camera_statistics);
+            } else {
+                const auto start_time = std::chrono::steady_clock::now();
+                if (m_sort_rays)
+                    sort_queue(m_rays, m_paths, m_sort_scratch);
+                const auto sorted_time = std::chrono::steady_clock::now();
+                extend(false, m_model_node_cache, m_ray_statistics);
+                const auto extended_time = std::chrono::steady_clock::now();
+
+                m_ray_statistics.m_rays += m_rays.size();
+                m_ray_statistics.m_sort_seconds += std::chrono::duration<Real>(sorted_time - start_time).count();
+                m_ray_statistics.m_extend_seconds += std::chrono::duration<Real>(extended_time - sorted_time).count();
+            }
+
+            shade();
+            retire();
+        }
+    }
+}
+
+void WavefrontIntegrator::generate(std::size_t start, std::size_t end) noexcept {
+    const auto width = m_camera.m_resolution[0];
+
+    m_rays.reserve(end - start);
+    m_paths.resize(end - start);
+    m_hits.resize(end - start);
+
+    for (std::size_t i = start; i < end; i++) {
+        const auto pixel = m_pixel_order[i];
+        m_rays.push_back(m_camera.make_ray(pixel % width, pixel / width));
+        m_paths[i - start] = PathState { .m_pixel = pixel };
+    }
+}
+
+void WavefrontIntegrator::roulette() noexcept {
+    Utils::parallel_chunks(m_paths.size(), ProgramConfig::preferred_thread_count(),
+        [this](std::size_t, std::size_t start, std::size_t end) {
+            for (std::size_t i = start; i < end; i++)
+                if (m_paths[i].m_depth > 7 && Maths::Random::uniform_normalised() > .8)
+                    m_paths[i].m_alive = false;
+        });
+}
+
+void WavefrontIntegrator::sort_queue(
+    std::vector<Ray> &rays, std::vector<PathState> &paths, SortScratch &scratch) noexcept {
+    if (rays.empty())
+        return;
+
+    std::pair<Point, Point> bounds = Shape::empty_extents;
+    for (const auto &ray : rays)
+        bounds = Shape::merge_extents(bounds, ray.m_origin);
+
+    const Point min_size(sensible_eps, sensible_eps, sensible_eps);
+    const Point scale = Point(1023, 1023, 1023) / Maths::max(bounds.second - bounds.first, min_size);
+
+    // 3 bits of direction over 30 bits of Morton code
+    static constexpr std::size_t key_bits = 33;
+
+    scratch.m_keys.resize(rays.size());
+    Utils::parallel_chunks(rays.size(), ProgramConfig::preferred_thread_count(),
+        [&rays, &scratch, &bounds, &scale](std::size_t, std::size_t start, std::size_t end) {
+            for (std::size_t i = start; i < end; i++) {
+                const Point cell = (rays[i].m_origin - bounds.first) * scale;
+                const auto morton = Maths::morton_3d(static_cast<std::uint32_t>(cell[0]),
+                    static_cast<std::uint32_t>(cell[1]), static_cast<std::uint32_t>(cell[2]));
+                const auto direction = static_cast<std::uint64_t>(rays[i].m_major_direction);
+                scratch.m_keys[i] = { direction << 30 | morton, static_cast<std::uint32_t>(i) };
+            }
+        });
+
+    Utils::radix_sort(
+        scratch.m_keys, [](const auto &key) { return key.first; }, key_bits, ProgramConfig::preferred_thread_count());
+
+    // rays have no default, the copies of the first one all get overwritten
+    scratch.m_rays.resize(rays.size(), rays.front());
+    scratch.m_paths.resize(paths.size());
+    Utils::parallel_chunks(rays.size(), ProgramConfig::preferred_thread_count(),
+        [&rays, &paths, &scratch](std::size_t, std::size_t start, std::size_t end) {
+            for (std::size_t i = start; i < end; i++) {
+                const auto index = scratch.m_keys[i].second;
+                scratch.m_rays[i] = rays[index];
+                scratch.m_paths[i] = paths[index];
+            }
+        });
+
+    std::swap(rays, scratch.m_rays);
+    std::swap(paths, scratch.m_paths);
+}
+
+void WavefrontIntegrator::extend(bool coherent, bool model_node_cache, RayStatistics &stats) noexcept {
+    struct ChunkStatistics {
+        std::size_t m_bound_checks = 0;
+        std::size_t m_shape_checks = 0;
+        BVH::NodeCacheModel m_node_cache {};
+    };
+    std::vector<ChunkStatistics> chunk_stats(ProgramConfig::preferred_thread_count());
+
+    Utils::parallel_chunks(m_rays.size(), chunk_stats.size(),
+        [this, coherent, model_node_cache, &chunk_stats](std::size_t chunk, std::size_t start, std::size_t end) {
+            auto &[bound_checks, shape_checks, node_cache] = chunk_stats[chunk];
+
+            if (coherent) {
+                for (std::size_t i = start; i < end; i += ShapeStore::m_packet_size) {
+                    const auto count = std::min(ShapeStore::m_packet_size, end - i);
+                    m_scene->intersect_packet(std::span(m_rays).subspan(i, count),
+                        std::span(m_hits).subspan(i, count), bound_checks, shape_checks);
+                }
+                return;
+            }
+
+            const auto trace = [&] {
+                for (std::size_t i = start; i < end; i++)
+                    m_hits[i] = m_scene->intersect_ray(m_rays[i], bound_checks, shape_checks);
+            };
+
+            if (model_node_cache)
+                node_cache.record(trace);
+            else
+                trace();
+        });
+
+    for (const auto &chunk : chunk_stats) {
+        stats.m_bound_checks += chunk.m_bound_checks;
+        stats.m_shape_checks += chunk.m_shape_checks;
+        stats.m_node_fetches += chunk.m_node_cache.m_fetches;
+        stats.m_node_misses += chunk.m_node_cache.m_misses;
+    }
+}
+
+void WavefrontIntegrator::shade() noexcept {
+    Utils::parallel_chunks(m_paths.size(), ProgramConfig::preferred_thread_count(),
+        [this](std::size_t, std::size_t start, std::size_t end) {
+            for (std::size_t i = start; i < end; i++) {
+                auto &path = m_paths[i];
+                const auto &isection = m_hits[i];
+
+                if (!isection) {
+                    path.m_alive = false;
+                    continue;
+                }
+
+                const auto material = m_scene->get_material(isection->m_mat_index);
+                const Point safe_reflection_spot = isection->offset_origin();
+
+                path.m_radiance = path.m_radiance
+                    + (isection->m_going_in ? material.m_emittance : Color {}) * path.m_throughput
+                        * path.m_previous_cosine;
+                path.m_throughput = path.m_throughput * material.m_albedo;
+
+                if (Maths::Random::uniform_normalised() > material.m_reflectance)
+                    m_rays[i] = Ray(safe_reflection_spot, Maths::Random::unit_vector());
+                else
+                    m_rays[i] = Ray(safe_reflection_spot,
+                        Detail::reflect_vector(m_rays[i].m_direction, isection->m_oriented_normal));
+
+                path.m_previous_cosine = Maths::dot(m_rays[i].m_direction, isection->m_oriented_normal);
+                ++path.m_depth;
+            }
+        });
+}
+
+void WavefrontIntegrator::retire() noexcept {
+    const auto width = m_camera.m_resolution[0];
+    std::size_t alive = 0;
+
+    for (std::size_t i = 0; i < m_paths.size(); i++) {
+        if (!m_paths[i].m_alive) {
+            m_back_buffer.at(m_paths[i].m_pixel % width, m_paths[i].m_pixel / width) = m_paths[i].m_radiance;
+            continue;
+        }
+
+        m_rays[alive] = m_rays[i];
+        m_paths[alive] = m_paths[i];
+        ++alive;
+    }
+
+    m_rays.erase(m_rays.begin() + static_cast<std::ptrdiff_t>(alive), m_rays.end());
+    m_paths.erase(m_paths.begin() + static_cast<std::ptrdiff_t>(alive), m_paths.end());
+    m_hits.erase(m_hits.begin() + static_cast<std::ptrdiff_t>(alive), m_hits.end());
+}
+
+}
@@ -34,11 +34,15 @@ static sol::state new_lua_state() {
     Detail::add_image_view_to_lua(lua);
     Detail::add_integrator_to_lua(lua);
 
-    auto main_table = lua.create_table_with("printCamera", [](const Paths::Camera &camera) {
-        fmt::print("Position: {}\n", camera.m_position);
-        fmt::print("Ray transform: {}\n", camera.m_ray_transform);
-        fmt::print("Resolution: {}\n", camera.m_resolution);
-    });
+    auto main_table = lua.create_table_with(
+        "printCamera",
+        [](const Paths::Camera &camera) {
+            fmt::print("Position: {}\n", camera.m_position);
+            fmt::print("Ray transform: {}\n", camera.m_ray_transform);
+            fmt::print("Resolution: {}\n", camera.m_resolution);
+        },
+        "threadCount", [] { return ProgramConfig::preferred_thread_count(); },
+        "setThreadCount", [](std::size_t n_threads) { Utils::ThreadPool::global().set_thread_count(n_threads); });
 
     lua["paths"] = main_table;
 
@@ -7,10 +7,48 @@
 #include "Paths/Integrator/Sampler/MonteCarlo.hpp"
 #include "Paths/Integrator/Sampler/Statistics.hpp"
 #include "Paths/Integrator/Sampler/Whitted.hpp"
+#include "Paths/Integrator/Wavefront.hpp"
 
 namespace Paths::Lua::Detail {
 
+static Paths::Integrator *unwrap_averager(IntegratorWrapper &self) noexcept {
+    Paths::Integrator *integrator = self.m_impl.get();
+    if (auto *averager = dynamic_cast<Paths::IntegratorAverager *>(integrator); averager)
+        integrator = std::addressof(averager->get_integrator());
+    return integrator;
+}
+
+static Paths::WavefrontIntegrator *as_wavefront(IntegratorWrapper &self) noexcept {
+    return dynamic_cast<Paths::WavefrontIntegrator *>(unwrap_averager(self));
+}
+
+static Paths::SamplerWrapperIntegrator *as_sampler_wrapper(IntegratorWrapper &self) noexcept {
+    return dynamic_cast<Paths::SamplerWrapperIntegrator *>(unwrap_averager(self));
+}
+
 extern void add_integrator_to_lua(sol::state &lua) {
+    using ray_statistics_t = Paths::WavefrontIntegrator::RayStatistics;
+    auto ray_statistics_compat = lua.new_usertype<ray_statistics_t>("rayStatistics", sol::no_constructor);
+    ray_statistics_compat["rays"] = SOL_PROPERTY(ray_statistics_t, m_rays);
+    ray_statistics_compat["boundChecks"] = SOL_PROPERTY(ray_statistics_t, m_bound_checks);
+    ray_statistics_compat["shapeChecks"] = SOL_PROPERTY(ray_statistics_t, m_shape_checks);
+    ray_statistics_compat["sortSeconds"] = SOL_PROPERTY(ray_statistics_t, m_sort_seconds);
+    ray_statistics_compat["extendSeconds"] = SOL_PROPERTY(ray_statistics_t, m_extend_seconds);
+    ray_statistics_compat["mraysPerSecond"] = &ray_statistics_t::mrays_per_second;
+    ray_statistics_compat["boundChecksPerRay"] = &ray_statistics_t::bound_checks_per_ray;
+    ray_statistics_compat["nodeFetches"] = SOL_PROPERTY(ray_statistics_t, m_node_fetches);
+    ray_statistics_compat["nodeMisses"] = SOL_PROPERTY(ray_statistics_t, m_node_misses);
+    ray_statistics_compat["nodeMissesPerRay"] = &ray_statistics_t::node_misses_per_ray;
+
+    using tile_statistics_t = Paths::SamplerWrapperIntegrator::TileStatistics;
+    auto tile_statistics_compat = lua.new_usertype<tile_statistics_t>("tileStatistics", sol::no_constructor);
+    tile_statistics_compat["renders"] = SOL_PROPERTY(tile_statistics_t, m_renders);
+    tile_statistics_compat["tiles"] = SOL_PROPERTY(tile_statistics_t, m_tiles);
+    tile_statistics_compat["steals"] = SOL_PROPERTY(tile_statistics_t, m_steals);
+    tile_statistics_compat["slowestTileSeconds"] = SOL_PROPERTY(tile_statistics_t, m_slowest_tile_seconds);
+    tile_statistics_compat["renderSeconds"] = SOL_PROPERTY(tile_statistics_t, m_render_seconds);
+    tile_statistics_compat["idleFraction"] = &tile_statistics_t::idle_fraction;
+
     auto integrator_compat = lua.new_usertype<IntegratorWrapper>("integrator", sol::default_constructor);
 
     integrator_compat["newSamplerWrapper"] = [](const std::string &sampler) -> IntegratorWrapper {
@@ -30,6 +68,35 @@ extern void add_integrator_to_lua(sol::state &lua) {
         };
     };
 
+    integrator_compat["newWavefront"] = [](bool sort_rays) -> IntegratorWrapper {
+        return {
+            .m_impl = std::make_unique<Paths::WavefrontIntegrator>(sort_rays),
+        };
+    };
+
+    integrator_compat["setModelNodeCache"] = [](IntegratorWrapper &self, bool model) {
+        if (auto *wavefront = as_wavefront(self); wavefront)
+            wavefront->set_model_node_cache(model);
+    };
+
+    integrator_compat["getRayStatistics"] = [](IntegratorWrapper &self) -> std::optional<ray_statistics_t> {
+        if (const auto *wavefront = as_wavefront(self); wavefront)
+            return wavefront->get_ray_statistics();
+        return std::nullopt;
+    };
+
+    integrator_compat["getTileStatistics"] = [](IntegratorWrapper &self) -> std::optional<tile_statistics_t> {
+        if (const auto *sampler_wrapper = as_sampler_wrapper(self); sampler_wrapper)
+            return sampler_wrapper->get_tile_statistics();
+        return std::nullopt;
+    };
+
+    integrator_compat["getTileTimes"] = [](IntegratorWrapper &self) -> std::optional<Paths::Image::ImageView> {
+        if (const auto *sampler_wrapper = as_sampler_wrapper(self); sampler_wrapper)
+            return sampler_wrapper->get_tile_times();
+        return std::nullopt;
+    };
+
     integrator_compat["wrapInAverager"] = [](IntegratorWrapper &self) {
         auto ptr = std::move(self.m_impl);
         self.m_impl = std::make_unique<Paths::IntegratorAverager>(std::move(ptr));
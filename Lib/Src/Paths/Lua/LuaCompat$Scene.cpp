@@ -35,6 +35,11 @@ extern void add_scene_to_lua(sol::state &lua) {
         std::size_t _;
         return self.m_impl->intersect_ray(ray, _, _);
     };
+
+    scene_compat["occluded"] = [](const SceneWrapper &self, Paths::Ray ray, Real t_max) -> bool {
+        std::size_t _;
+        return self.m_impl->occluded(ray, t_max, _, _);
+    };
 }
 
 }
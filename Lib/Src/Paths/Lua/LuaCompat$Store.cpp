@@ -1,15 +1,36 @@
 #include "Paths/Lua/LuaCompat.hpp"
 
+#include <charconv>
+
 #include "Paths/STL/Binary.hpp"
+#include "Paths/Scene/Cache.hpp"
 #include "Paths/Scene/TBVH.hpp"
 #include "Paths/Scene/ThinBVH.hpp"
+#include "Paths/Scene/TopLevel.hpp"
 #include "Paths/Scene/Tree.hpp"
+#include "Paths/Scene/WideBVH.hpp"
 
 namespace Paths::Lua::Detail {
 
+static BVH::EPartitionType partition_type_from_name(const sol::optional<std::string> &name) {
+    if (!name || *name == "middle")
+        return BVH::EPartitionType::Middle;
+    if (*name == "median")
+        return BVH::EPartitionType::Median;
+    if (*name == "sah")
+        return BVH::EPartitionType::BinnedSAH;
+    if (*name == "morton")
+        return BVH::EPartitionType::Morton;
+    if (*name == "spatial")
+        return BVH::EPartitionType::Spatial;
+
+    fmt::print(stderr, "unknown partitioner \"{}\", using \"middle\"\n", *name);
+    return BVH::EPartitionType::Middle;
+}
+
 template<typename ToShapeT = void>
-static std::shared_ptr<ShapeStore> tree_construction_helper(
-    const std::shared_ptr<ShapeStore> &src, std::size_t max_depth, std::size_t min_shapes) {
+static std::shared_ptr<ShapeStore> tree_construction_helper(const std::shared_ptr<ShapeStore> &src,
+    std::size_t max_depth, std::size_t min_shapes, BVH::EPartitionType partition_type, Real duplication_budget) {
     std::vector<Shape::BoundableShapeT<ToShapeT>> ret_vec;
 
     auto attempt = [&src, &ret_vec]<typename Cast>() -> bool {
@@ -25,10 +46,58 @@ static std::shared_ptr<ShapeStore> tree_construction_helper(
         return nullptr;
 
     auto res = std::make_shared<BVH::Detail::BVHTree<ToShapeT>>(std::move(ret_vec));
-    res->root().split(max_depth, min_shapes);
+    res->build(max_depth, min_shapes, partition_type, duplication_budget);
     return res;
 }
 
+static std::optional<BVH::TreeStatistics> get_tree_statistics(const std::shared_ptr<ShapeStore> &ptr) {
+    if (auto built = std::dynamic_pointer_cast<BVH::Detail::BVHTree<>>(ptr); built)
+        return built->get_statistics();
+    else if (auto built_tri = std::dynamic_pointer_cast<BVH::Detail::BVHTree<Shape::Triangle>>(ptr); built_tri)
+        return built_tri->get_statistics();
+    else if (auto tree = std::dynamic_pointer_cast<BVH::TraversableBVHTree<>>(ptr); tree)
+        return dynamic_cast<const BVH::TraversableBVHNode<> &>(tree->root()).get_statistics();
+    else if (auto tree_tri = std::dynamic_pointer_cast<BVH::TraversableBVHTree<Shape::Triangle>>(ptr); tree_tri)
+        return dynamic_cast<const BVH::TraversableBVHNode<Shape::Triangle> &>(tree_tri->root()).get_statistics();
+    return std::nullopt;
+}
+
+static bool optimise_treelets(const std::shared_ptr<ShapeStore> &ptr) {
+    if (auto tree = std::dynamic_pointer_cast<BVH::Detail::BVHTree<>>(ptr); tree)
+        tree->root().optimise_treelets();
+    else if (auto tree_tri = std::dynamic_pointer_cast<BVH::Detail::BVHTree<Shape::Triangle>>(ptr); tree_tri)
+        tree_tri->root().optimise_treelets();
+    else
+        return false;
+    return true;
+}
+
+/// Moves the triangles of a triangle BVH, flattened or not, like STL models are moved and refits the BVH
+/// \return The relative cost that refit returns, std::nullopt if the store is not a triangle BVH
+static std::optional<Real> transform_triangles(
+    const std::shared_ptr<ShapeStore> &ptr, const Matrix &transform, Point offset) {
+    const auto fn = [&transform, &offset](const Shape::Triangle &t) { return t.transformed(transform, offset); };
+
+    if (auto tree = std::dynamic_pointer_cast<BVH::Detail::BVHTree<Shape::Triangle>>(ptr); tree) {
+        tree->transform_shapes(fn);
+        return tree->refit();
+    } else if (auto thin = std::dynamic_pointer_cast<BVH::Detail::ThinBVHTree<Shape::Triangle>>(ptr); thin) {
+        thin->transformShapes(fn);
+        return thin->refit();
+    } else if (auto tbvh = std::dynamic_pointer_cast<BVH::Detail::ThreadedBVH<Shape::Triangle, false>>(ptr); tbvh) {
+        tbvh->transform_shapes(fn);
+        return tbvh->refit();
+    } else if (auto mtbvh = std::dynamic_pointer_cast<BVH::Detail::ThreadedBVH<Shape::Triangle, true>>(ptr); mtbvh) {
+        mtbvh->transform_shapes(fn);
+        return mtbvh->refit();
+    } else if (auto wide = std::dynamic_pointer_cast<BVH::Detail::WideBVH<Shape::Triangle>>(ptr); wide) {
+        wide->transform_shapes(fn);
+        return wide->refit();
+    }
+
+    return std::nullopt;
+}
+
 static std::shared_ptr<ShapeStore> to_thin_bvh(const std::shared_ptr<ShapeStore> &ptr) {
     if (auto fat_bvh = std::dynamic_pointer_cast<BVH::TraversableBVHTree<>>(ptr); fat_bvh)
         return std::make_shared<BVH::Detail::ThinBVHTree<>>(*fat_bvh);
@@ -37,6 +106,14 @@ static std::shared_ptr<ShapeStore> to_thin_bvh(const std::shared_ptr<ShapeStore>
     return nullptr;
 }
 
+static std::shared_ptr<ShapeStore> to_wide_bvh(const std::shared_ptr<ShapeStore> &ptr) {
+    if (auto fat_bvh = std::dynamic_pointer_cast<BVH::TraversableBVHTree<>>(ptr); fat_bvh)
+        return std::make_shared<BVH::Detail::WideBVH<>>(*fat_bvh);
+    else if (auto fat_bvh_tri = std::dynamic_pointer_cast<BVH::TraversableBVHTree<Shape::Triangle>>(ptr); fat_bvh_tri)
+        return std::make_shared<BVH::Detail::WideBVH<Shape::Triangle>>(*fat_bvh_tri);
+    return nullptr;
+}
+
 template<bool MT = true> static std::shared_ptr<ShapeStore> to_tbvh(const std::shared_ptr<ShapeStore> &ptr) {
     auto fat_bvh = std::dynamic_pointer_cast<BVH::ThreadableBVHTree<>>(ptr);
     if (fat_bvh)
@@ -49,6 +126,33 @@ template<bool MT = true> static std::shared_ptr<ShapeStore> to_tbvh(const std::s
     return nullptr;
 }
 
+/// Keys are passed around as hex strings, Lua integers cannot hold every 64 bit key
+static std::optional<std::uint64_t> parse_cache_key(const std::string &str) {
+    std::uint64_t key = 0;
+    const auto [end, ec] = std::from_chars(str.data(), str.data() + str.size(), key, 16);
+    if (ec != std::errc() || end != str.data() + str.size())
+        return std::nullopt;
+    return key;
+}
+
+static bool save_bvh_cache(const std::shared_ptr<ShapeStore> &ptr, std::uint64_t key, const std::string &path) {
+    if (auto thin = std::dynamic_pointer_cast<BVH::Detail::ThinBVHTree<Shape::Triangle>>(ptr); thin)
+        return BVH::Cache::save(*thin, key, path);
+    else if (auto tbvh = std::dynamic_pointer_cast<BVH::Detail::ThreadedBVH<Shape::Triangle, false>>(ptr); tbvh)
+        return BVH::Cache::save(*tbvh, key, path);
+    else if (auto mtbvh = std::dynamic_pointer_cast<BVH::Detail::ThreadedBVH<Shape::Triangle, true>>(ptr); mtbvh)
+        return BVH::Cache::save(*mtbvh, key, path);
+    return false;
+}
+
+static std::shared_ptr<ShapeStore> load_bvh_cache(std::uint64_t key, const std::string &path) {
+    if (auto thin = BVH::Cache::load<BVH::Detail::ThinBVHTree<Shape::Triangle>>(key, path); thin)
+        return thin;
+    else if (auto tbvh = BVH::Cache::load<BVH::Detail::ThreadedBVH<Shape::Triangle, false>>(key, path); tbvh)
+        return tbvh;
+    return BVH::Cache::load<BVH::Detail::ThreadedBVH<Shape::Triangle, true>>(key, path);
+}
+
 template<typename ConvFn, typename... Args> bool to_helper(StoreWrapper &self, ConvFn &&conv_fn, Args... args) {
     auto conv = conv_fn(self.m_impl, args...);
     if (!conv)
@@ -66,18 +170,26 @@ StoreWrapper make_helper(const StoreWrapper &self, ConvFn &&conv_fn, Args... arg
 }
 
 static void add_conversion_functions(auto &type) {
-    type["toBVHTree"] = [](StoreWrapper &self, std::size_t max_depth, std::size_t min_shapes) -> bool {
-        return to_helper(self, &tree_construction_helper<>, max_depth, min_shapes);
+    // the duplication budget is only used by the "spatial" partitioner
+    type["toBVHTree"] = [](StoreWrapper &self, std::size_t max_depth, std::size_t min_shapes,
+                            sol::optional<std::string> partitioner, sol::optional<Real> budget) -> bool {
+        return to_helper(self, &tree_construction_helper<>, max_depth, min_shapes,
+            partition_type_from_name(partitioner), budget.value_or(BVH::Detail::default_duplication_budget));
     };
-    type["toBVHTreeTri"] = [](StoreWrapper &self, std::size_t max_depth, std::size_t min_shapes) -> bool {
-        return to_helper(self, &tree_construction_helper<Shape::Triangle>, max_depth, min_shapes);
+    type["toBVHTreeTri"] = [](StoreWrapper &self, std::size_t max_depth, std::size_t min_shapes,
+                               sol::optional<std::string> partitioner, sol::optional<Real> budget) -> bool {
+        return to_helper(self, &tree_construction_helper<Shape::Triangle>, max_depth, min_shapes,
+            partition_type_from_name(partitioner), budget.value_or(BVH::Detail::default_duplication_budget));
     };
-    type["makeBVHTree"] = [](const StoreWrapper &self, std::size_t max_depth, std::size_t min_shapes) -> StoreWrapper {
-        return make_helper(self, &tree_construction_helper<>, max_depth, min_shapes);
+    type["makeBVHTree"] = [](const StoreWrapper &self, std::size_t max_depth, std::size_t min_shapes,
+                              sol::optional<std::string> partitioner, sol::optional<Real> budget) -> StoreWrapper {
+        return make_helper(self, &tree_construction_helper<>, max_depth, min_shapes,
+            partition_type_from_name(partitioner), budget.value_or(BVH::Detail::default_duplication_budget));
     };
-    type["makeBVHTreeTri"]
-        = [](const StoreWrapper &self, std::size_t max_depth, std::size_t min_shapes) -> StoreWrapper {
-        return make_helper(self, &tree_construction_helper<Shape::Triangle>, max_depth, min_shapes);
+    type["makeBVHTreeTri"] = [](const StoreWrapper &self, std::size_t max_depth, std::size_t min_shapes,
+                                 sol::optional<std::string> partitioner, sol::optional<Real> budget) -> StoreWrapper {
+        return make_helper(self, &tree_construction_helper<Shape::Triangle>, max_depth, min_shapes,
+            partition_type_from_name(partitioner), budget.value_or(BVH::Detail::default_duplication_budget));
     };
 
     type["toThinBVH"] = [](StoreWrapper &self) -> bool { return to_helper(self, to_thin_bvh); };
@@ -86,9 +198,22 @@ static void add_conversion_functions(auto &type) {
     type["makeThinBVH"] = [](StoreWrapper &self) -> StoreWrapper { return make_helper(self, to_thin_bvh); };
     type["makeTBVH"] = [](StoreWrapper &self) -> StoreWrapper { return make_helper(self, to_tbvh<false>); };
     type["makeMTBVH"] = [](StoreWrapper &self) -> bool { return to_helper(self, to_tbvh<true>); };
+    type["toWideBVH"] = [](StoreWrapper &self) -> bool { return to_helper(self, to_wide_bvh); };
+    type["makeWideBVH"] = [](StoreWrapper &self) -> StoreWrapper { return make_helper(self, to_wide_bvh); };
 }
 
 extern void add_store_to_lua(sol::state &lua) {
+    auto tree_statistics_compat = lua.new_usertype<BVH::TreeStatistics>("treeStatistics", sol::no_constructor);
+    tree_statistics_compat["nodeCount"] = SOL_PROPERTY(BVH::TreeStatistics, m_node_count);
+    tree_statistics_compat["leafCount"] = SOL_PROPERTY(BVH::TreeStatistics, m_leaf_count);
+    tree_statistics_compat["maxDepth"] = SOL_PROPERTY(BVH::TreeStatistics, m_max_depth);
+    tree_statistics_compat["maxLeafShapes"] = SOL_PROPERTY(BVH::TreeStatistics, m_max_leaf_shapes);
+    tree_statistics_compat["referenceCount"] = SOL_PROPERTY(BVH::TreeStatistics, m_reference_count);
+    tree_statistics_compat["sahCost"] = SOL_PROPERTY(BVH::TreeStatistics, m_sah_cost);
+    tree_statistics_compat["buildSeconds"] = SOL_PROPERTY(BVH::TreeStatistics, m_build_seconds);
+    tree_statistics_compat["nodeMemory"] = SOL_PROPERTY(BVH::TreeStatistics, m_node_memory_bytes);
+    tree_statistics_compat["peakResidentMemory"] = SOL_PROPERTY(BVH::TreeStatistics, m_peak_resident_bytes);
+
     auto store_compat = lua.new_usertype<StoreWrapper>("store", sol::default_constructor);
 
     store_compat[sol::meta_function::concatenation] = [](StoreWrapper lhs, StoreWrapper rhs) -> StoreWrapper {
@@ -138,11 +263,78 @@ extern void add_store_to_lua(sol::state &lua) {
         return { ptr };
     };
 
+    store_compat["newTopLevel"] = []() -> StoreWrapper { return { std::make_shared<BVH::TopLevelBVH>() }; };
+
+    // the instanced store is shared, not moved like insertChild moves it
+    store_compat["insertInstance"]
+        = [](StoreWrapper &self, const StoreWrapper &other, Matrix transform, Point offset) -> bool {
+        auto top_level = std::dynamic_pointer_cast<BVH::TopLevelBVH>(self.m_impl);
+        if (!top_level || !other.m_impl)
+            return false;
+        top_level->insert_instance({ .m_store = other.m_impl, .m_transform = transform, .m_offset = offset });
+        return true;
+    };
+
+    store_compat["buildTopLevel"] = [](StoreWrapper &self) -> bool {
+        auto top_level = std::dynamic_pointer_cast<BVH::TopLevelBVH>(self.m_impl);
+        if (!top_level)
+            return false;
+        top_level->build();
+        return true;
+    };
+
     store_compat["insertChild"]
         = [](StoreWrapper &self, StoreWrapper &other) { self.m_impl->insert_child(std::move(other.m_impl)); };
 
+    // children moved through transformTriangles invalidate their parents by themselves, this is for anything else
+    store_compat["invalidateChildren"] = [](StoreWrapper &self) { self.m_impl->invalidate_children(); };
+
     store_compat["clear"] = [](StoreWrapper &self) { self.m_impl = nullptr; };
 
+    store_compat["buildStats"] = [](const StoreWrapper &self) -> std::optional<BVH::TreeStatistics> {
+        return get_tree_statistics(self.m_impl);
+    };
+
+    store_compat["optimiseTreelets"] = [](StoreWrapper &self) -> bool { return optimise_treelets(self.m_impl); };
+
+    store_compat["transformTriangles"]
+        = [](StoreWrapper &self, Matrix transform, Point offset) -> std::optional<Real> {
+        return transform_triangles(self.m_impl, transform, offset);
+    };
+
+    // the key of a triangle BVH built from an STL file, parameters should describe how the BVH gets built
+    store_compat["bvhCacheKey"] = [](const std::string &filename, std::size_t material_index, Point offset,
+                                      Matrix transform, const std::string &parameters) -> std::optional<std::string> {
+        const auto file_hash = BVH::Cache::hash_file(filename);
+        if (!file_hash)
+            return std::nullopt;
+
+        BVH::Cache::Hasher hasher {};
+        hasher.add(*file_hash);
+        hasher.add(material_index);
+        hasher.add(offset);
+        hasher.add(transform);
+        hasher.add(std::string_view(parameters));
+        return fmt::format("{:016x}", hasher.m_state);
+    };
+
+    // only flattened triangle BVHs (thin, threaded and multiple threaded) can be cached
+    store_compat["saveBVHCache"] = [](const StoreWrapper &self, const std::string &path, const std::string &key) {
+        const auto parsed = parse_cache_key(key);
+        return parsed && save_bvh_cache(self.m_impl, *parsed, path);
+    };
+
+    store_compat["loadBVHCache"]
+        = [](const std::string &path, const std::string &key) -> std::optional<StoreWrapper> {
+        const auto parsed = parse_cache_key(key);
+        if (!parsed)
+            return std::nullopt;
+        auto store = load_bvh_cache(*parsed, path);
+        if (!store)
+            return std::nullopt;
+        return StoreWrapper { std::move(store) };
+    };
+
     add_conversion_functions(store_compat);
 }
 
@@ -0,0 +1,78 @@
+#include "Utils/Utils.hpp"
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include <cstdio>
+
+#include "Paths/Scene/Scene.hpp"
+
+#include "Paths/Scene/Cache.hpp"
+
+namespace Paths::BVH::Cache {
+
+MappedFile::~MappedFile() noexcept {
+    if (m_data)
+        munmap(m_data, m_size);
+}
+
+std::optional<MappedFile> MappedFile::open(const std::string &path) noexcept {
+    auto fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return std::nullopt;
+    auto close_guard = Utils::ScopeGuard::make_guard([fd] { close(fd); });
+
+    struct stat stats { };
+    if (fstat(fd, &stats) < 0 || stats.st_size <= 0)
+        return std::nullopt;
+
+    const auto size = static_cast<std::size_t>(stats.st_size);
+
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED)
+        return std::nullopt;
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    return MappedFile(mapped, size);
+}
+
+extern std::optional<std::uint64_t> hash_file(const std::string &path) noexcept {
+    const auto file = MappedFile::open(path);
+    if (!file)
+        return std::nullopt;
+
+    Hasher hasher {};
+    hasher.add_bytes(file->data());
+    return hasher.m_state;
+}
+
+bool Writer::write_to(const std::string &path) const noexcept {
+    const auto temp_path = path + ".tmp";
+
+    auto fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+
+    bool written = true;
+    for (std::size_t offset = 0; offset < m_buffer.size();) {
+        const auto res = write(fd, m_buffer.data() + offset, m_buffer.size() - offset);
+        if (res <= 0) {
+            written = false;
+            break;
+        }
+        offset += static_cast<std::size_t>(res);
+    }
+
+    if (close(fd) < 0 || !written || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+}
@@ -0,0 +1,13 @@
+#include "Paths/Scene/Scene.hpp"
+
+namespace Paths::BVH {
+
+std::shared_ptr<ShapeStore> make_store_hierarchy(std::span<const std::shared_ptr<ShapeStore>> stores) noexcept {
+    auto hierarchy = std::make_shared<TopLevelBVH>();
+    for (const auto &store : stores)
+        hierarchy->insert_instance({ .m_store = store });
+    hierarchy->build();
+    return hierarchy;
+}
+
+}
@@ -0,0 +1,58 @@
+#include "benchmark/benchmark.h"
+
+#include <atomic>
+#include <new>
+
+#include "bvh_queries.hpp"
+
+// global operator new is replaced for the whole of this executable, which is why these are not with the other
+// benchmarks
+
+static std::atomic_size_t s_allocation_count { 0 };
+
+void *operator new(std::size_t size) {
+    s_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = std::malloc(size ? size : 1); ptr)
+        return ptr;
+    std::abort();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+/// Reports the heap allocations per ray, expected to be 0
+template<typename Store = Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle>, typename Query>
+static void allocations_per_query(benchmark::State &state, Query &&query) {
+    const auto store = BVHBench::make_flattened_bvh<Store>();
+
+    const auto allocations_before = s_allocation_count.load();
+    const auto rays = BVHBench::run_queries(state, *store, query);
+    const auto allocations = s_allocation_count.load() - allocations_before;
+
+    state.counters["allocs_per_ray"] = static_cast<double>(allocations) / static_cast<double>(rays);
+}
+
+static void allocations_thin_closest_hit(benchmark::State &state) {
+    allocations_per_query(state, BVHBench::closest_hit);
+}
+
+BENCHMARK(allocations_thin_closest_hit);
+
+static void allocations_mtbvh_closest_hit(benchmark::State &state) {
+    allocations_per_query<Paths::BVH::Detail::ThreadedBVH<Paths::Shape::Triangle, true>>(state, BVHBench::closest_hit);
+}
+
+BENCHMARK(allocations_mtbvh_closest_hit);
+
+static void allocations_wide_closest_hit(benchmark::State &state) {
+    allocations_per_query<Paths::BVH::Detail::WideBVH<Paths::Shape::Triangle>>(state, BVHBench::closest_hit);
+}
+
+BENCHMARK(allocations_wide_closest_hit);
+
+static void allocations_thin_any_hit(benchmark::State &state) { allocations_per_query(state, BVHBench::any_hit); }
+
+BENCHMARK(allocations_thin_any_hit);
+
+BENCHMARK_MAIN();
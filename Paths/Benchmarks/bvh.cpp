@@ -0,0 +1,36 @@
+#include "benchmark/benchmark.h"
+
+#include "bvh_queries.hpp"
+
+/// Labelled with the precision of the geometry so that runs of builds with and without PATHS_SINGLE_PRECISION can be
+/// told apart
+template<typename Store = Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle>, typename Query>
+static void bvh_query(benchmark::State &state, Query &&query) {
+    const auto store = BVHBench::make_flattened_bvh<Store>();
+    const auto rays = BVHBench::run_queries(state, *store, query);
+
+    state.SetItemsProcessed(static_cast<std::int64_t>(rays));
+    state.SetLabel(sizeof(Paths::Real) == sizeof(float) ? "float" : "double");
+    state.counters["mrays_per_second"] = benchmark::Counter(static_cast<double>(rays) / 1'000'000,
+        benchmark::Counter::kIsRate);
+}
+
+static void bvh_thin_closest_hit(benchmark::State &state) { bvh_query(state, BVHBench::closest_hit); }
+
+BENCHMARK(bvh_thin_closest_hit);
+
+static void bvh_mtbvh_closest_hit(benchmark::State &state) {
+    bvh_query<Paths::BVH::Detail::ThreadedBVH<Paths::Shape::Triangle, true>>(state, BVHBench::closest_hit);
+}
+
+BENCHMARK(bvh_mtbvh_closest_hit);
+
+static void bvh_wide_closest_hit(benchmark::State &state) {
+    bvh_query<Paths::BVH::Detail::WideBVH<Paths::Shape::Triangle>>(state, BVHBench::closest_hit);
+}
+
+BENCHMARK(bvh_wide_closest_hit);
+
+static void bvh_thin_any_hit(benchmark::State &state) { bvh_query(state, BVHBench::any_hit); }
+
+BENCHMARK(bvh_thin_any_hit);
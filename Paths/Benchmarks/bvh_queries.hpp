@@ -0,0 +1,50 @@
+#pragma once
+
+#include "benchmark/benchmark.h"
+
+#include "../Tests/bvh_utils.hpp"
+
+namespace BVHBench {
+
+inline const std::vector<Paths::Shape::Triangle> &triangles() {
+    static const auto triangles = BVHTest::make_triangle_soup(65536);
+    return triangles;
+}
+
+inline const std::vector<Paths::Ray> &rays() {
+    static const auto rays = BVHTest::make_rays(4096);
+    return rays;
+}
+
+template<typename Store = Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle>>
+std::shared_ptr<Paths::ShapeStore> make_flattened_bvh() {
+    Paths::BVH::Detail::BVHTree<Paths::Shape::Triangle> tree { std::vector(triangles()) };
+    tree.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+    return std::make_shared<Store>(tree);
+}
+
+/// Runs query for every ray on every iteration of state, returns the number of queries made
+template<typename Query>
+std::size_t run_queries(benchmark::State &state, const Paths::ShapeStore &store, Query &&query) {
+    std::size_t bound_checks = 0, shape_checks = 0, n_queries = 0;
+
+    for (auto _ : state) {
+        for (const auto &ray : rays())
+            benchmark::DoNotOptimize(query(store, ray, bound_checks, shape_checks));
+        n_queries += rays().size();
+    }
+
+    return n_queries;
+}
+
+inline constexpr auto closest_hit = [](const Paths::ShapeStore &store, const Paths::Ray &ray,
+                                        std::size_t &bound_checks, std::size_t &shape_checks) {
+    return store.intersect_ray(ray, bound_checks, shape_checks);
+};
+
+inline constexpr auto any_hit = [](const Paths::ShapeStore &store, const Paths::Ray &ray, std::size_t &bound_checks,
+                                    std::size_t &shape_checks) {
+    return store.occluded(ray, 20, bound_checks, shape_checks);
+};
+
+}
@@ -0,0 +1,63 @@
+#include "benchmark/benchmark.h"
+
+#include "Paths/Integrator/Wavefront.hpp"
+#include "bvh_queries.hpp"
+
+/// Renders the benchmark soup lit from inside with the wavefront integrator, with sorting off for an argument of 0.
+/// Reports the throughput of the secondary rays, which counts the time spent sorting them, and the node cache misses
+/// of one more render with the node cache modelled, which is what sorting is meant to bring down.
+static void wavefront_render(benchmark::State &state) {
+    Paths::Scene scene {};
+    scene.insert_material({ .m_albedo = { .7, .7, .7 }, .m_emittance = { 1, 1, 1 } });
+    scene.insert_store(BVHBench::make_flattened_bvh<Paths::BVH::Detail::WideBVH<Paths::Shape::Triangle>>());
+
+    Paths::Camera camera {};
+    camera.m_position = { 0, 0, -30 };
+    camera.m_resolution = { 512, 512 };
+    camera.m_aperture_diameter = 0;
+    camera.set_look_at({ 0, 0, 0 });
+
+    Paths::WavefrontIntegrator integrator { state.range(0) != 0 };
+    integrator.set_camera(camera);
+    integrator.set_scene(&scene);
+
+    for (auto _ : state)
+        integrator.do_render();
+
+    const auto stats = integrator.get_ray_statistics();
+    state.counters["secondary_mrays_per_second"] = stats.mrays_per_second();
+    state.counters["bound_checks_per_ray"] = stats.bound_checks_per_ray();
+    state.counters["sort_seconds"] = stats.m_sort_seconds;
+
+    // modelling the cache slows the traversal down, so it is kept out of the timed renders
+    integrator.reset_ray_statistics();
+    integrator.set_model_node_cache(true);
+    integrator.do_render();
+
+    const auto &modelled = integrator.get_ray_statistics();
+    state.counters["node_misses_per_ray"] = modelled.node_misses_per_ray();
+    state.counters["node_miss_rate"]
+        = modelled.m_node_fetches ? static_cast<double>(modelled.m_node_misses) / modelled.m_node_fetches : 0;
+}
+
+BENCHMARK(wavefront_render)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+static void wavefront_sort_queue(benchmark::State &state) {
+    const auto rays = BVHTest::make_rays(Paths::WavefrontIntegrator::m_max_wave_size);
+    const std::vector<Paths::WavefrontIntegrator::PathState> paths(rays.size());
+    Paths::WavefrontIntegrator::SortScratch scratch {};
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto queue_rays = rays;
+        auto queue_paths = paths;
+        state.ResumeTiming();
+
+        Paths::WavefrontIntegrator::sort_queue(queue_rays, queue_paths, scratch);
+        benchmark::DoNotOptimize(queue_rays.data());
+    }
+
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * rays.size()));
+}
+
+BENCHMARK(wavefront_sort_queue)->Unit(benchmark::kMillisecond);
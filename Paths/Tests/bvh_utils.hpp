@@ -0,0 +1,159 @@
+#pragma once
+
+#include <numbers>
+#include <random>
+
+#include "Paths/Scene/Scene.hpp"
+#include "Paths/Scene/Cache.hpp"
+#include "Paths/Scene/TBVH.hpp"
+#include "Paths/Scene/ThinBVH.hpp"
+#include "Paths/Scene/TopLevel.hpp"
+#include "Paths/Scene/Tree.hpp"
+#include "Paths/Scene/WideBVH.hpp"
+
+namespace BVHTest {
+
+/// A soup of small triangles scattered inside a cube, deterministic for a given seed
+inline std::vector<Paths::Shape::Triangle> make_triangle_soup(std::size_t count, std::uint32_t seed = 1) {
+    std::mt19937 engine { seed };
+    std::uniform_real_distribution<Paths::Real> position_dist(-10, 10);
+    std::uniform_real_distribution<Paths::Real> offset_dist(-.5, .5);
+
+    std::vector<Paths::Shape::Triangle> triangles;
+    triangles.reserve(count);
+
+    for (std::size_t i = 0; i < count; i++) {
+        const Paths::Point base { position_dist(engine), position_dist(engine), position_dist(engine) };
+        std::array<Paths::Point, 3> vertices {
+            base,
+            base + Paths::Point(offset_dist(engine), offset_dist(engine), offset_dist(engine)),
+            base + Paths::Point(offset_dist(engine), offset_dist(engine), offset_dist(engine)),
+        };
+        triangles.emplace_back(i, vertices);
+    }
+
+    return triangles;
+}
+
+/// Rays starting outside of the soup, aimed at random points inside it
+inline std::vector<Paths::Ray> make_rays(std::size_t count, std::uint32_t seed = 2) {
+    std::mt19937 engine { seed };
+    std::uniform_real_distribution<Paths::Real> dist(-1, 1);
+
+    std::vector<Paths::Ray> rays;
+    rays.reserve(count);
+
+    for (std::size_t i = 0; i < count; i++) {
+        const Paths::Point origin = Maths::normalized(Paths::Point(dist(engine), dist(engine), dist(engine))) * 30.;
+        const Paths::Point target = Paths::Point(dist(engine), dist(engine), dist(engine)) * 10.;
+        rays.emplace_back(origin, Maths::normalized(target - origin));
+    }
+
+    return rays;
+}
+
+/// A closed latitude-longitude sphere, neighbouring triangles are made from the exact same vertices
+inline std::vector<Paths::Shape::Triangle> make_sphere_mesh(
+    Paths::Point center, Paths::Real radius, std::size_t rings, std::size_t segments) {
+    const auto vertex = [&](std::size_t ring, std::size_t segment) -> Paths::Point {
+        const auto theta = std::numbers::pi * static_cast<double>(ring) / static_cast<double>(rings);
+        const auto phi = 2 * std::numbers::pi * static_cast<double>(segment % segments) / static_cast<double>(segments);
+
+        // sin(pi) is not quite 0, which would leave the segments of the bottom pole apart
+        const auto sin_theta = ring == rings ? 0. : std::sin(theta);
+        const Paths::Point direction(static_cast<Paths::Real>(sin_theta * std::cos(phi)),
+            static_cast<Paths::Real>(std::cos(theta)), static_cast<Paths::Real>(sin_theta * std::sin(phi)));
+        return center + direction * radius;
+    };
+
+    std::vector<Paths::Shape::Triangle> triangles;
+    for (std::size_t ring = 0; ring < rings; ring++) {
+        for (std::size_t segment = 0; segment < segments; segment++) {
+            const auto top_left = vertex(ring, segment), top_right = vertex(ring, segment + 1);
+            const auto bottom_left = vertex(ring + 1, segment), bottom_right = vertex(ring + 1, segment + 1);
+
+            // the poles get one triangle per segment
+            if (ring != 0)
+                triangles.emplace_back(triangles.size(), std::array { top_left, top_right, bottom_left });
+            if (ring != rings - 1)
+                triangles.emplace_back(triangles.size(), std::array { top_right, bottom_right, bottom_left });
+        }
+    }
+
+    return triangles;
+}
+
+template<typename T> std::shared_ptr<Paths::ShapeStore> make_linear_store(const std::vector<T> &shapes) {
+    auto store = std::make_shared<Paths::LinearShapeStore<T>>();
+    store->m_shapes = shapes;
+    return store;
+}
+
+/// The centers of the shapes of every leaf of a tree, with the leaves in pre-order
+template<typename ShapeT>
+std::vector<std::vector<Paths::Point>> leaf_centers(const Paths::BVH::Detail::BVHTree<ShapeT> &tree) {
+    std::vector<std::vector<Paths::Point>> leaves {};
+
+    tree.root().template traverse<Paths::BVH::Detail::ETraversalOrder::PreOrder>(
+        [&leaves](const Paths::BVH::BinaryTreeNode &node) {
+            if (!node.is_leaf())
+                return;
+
+            const auto &leaf = dynamic_cast<const Paths::BVH::TraversableBVHNode<ShapeT> &>(node);
+            auto &centers = leaves.emplace_back();
+            for (const auto &shape : leaf.get_shapes())
+                centers.push_back(shape.m_center);
+        });
+
+    return leaves;
+}
+
+/// Checks that two stores report the same closest hit for every ray. Stores test shapes in different ways, the
+/// distances they report are allowed to differ by 0.0001. Single precision geometry gets some thousand ulps of the
+/// distance if that is more, which rays grazing slivers need.
+inline bool same_hits(
+    const Paths::ShapeStore &lhs, const Paths::ShapeStore &rhs, const std::vector<Paths::Ray> &rays) {
+    std::size_t bound_checks = 0, shape_checks = 0;
+
+    for (const auto &ray : rays) {
+        const auto lhs_isect = lhs.intersect_ray(ray, bound_checks, shape_checks);
+        const auto rhs_isect = rhs.intersect_ray(ray, bound_checks, shape_checks);
+
+        if (lhs_isect.has_value() != rhs_isect.has_value())
+            return false;
+        if (!lhs_isect)
+            continue;
+
+#ifdef PATHS_SINGLE_PRECISION
+        const Paths::Real tolerance = std::max<Paths::Real>(0.0001, lhs_isect->m_distance * 2048 * Paths::eps);
+#else
+        const Paths::Real tolerance = 0.0001;
+#endif
+        if (lhs_isect->m_mat_index != rhs_isect->m_mat_index
+            || std::abs(lhs_isect->m_distance - rhs_isect->m_distance) > tolerance)
+            return false;
+    }
+
+    return true;
+}
+
+/// Checks that a store reports a ray as occluded iff the closest hit of the reference store is before t_max, for
+/// t_max well before and well after the closest hit
+inline bool same_occlusion(
+    const Paths::ShapeStore &reference, const Paths::ShapeStore &store, const std::vector<Paths::Ray> &rays) {
+    std::size_t bound_checks = 0, shape_checks = 0;
+
+    for (const auto &ray : rays) {
+        const auto isect = reference.intersect_ray(ray, bound_checks, shape_checks);
+        const Paths::Real distance = isect ? isect->m_distance : 100;
+
+        if (store.occluded(ray, distance * .5, bound_checks, shape_checks))
+            return false;
+        if (store.occluded(ray, distance * 2, bound_checks, shape_checks) != isect.has_value())
+            return false;
+    }
+
+    return true;
+}
+
+}
@@ -0,0 +1,646 @@
+#include <gtest/gtest.h>
+
+#include <filesystem>
+
+#include "bvh_utils.hpp"
+
+using TriangleTree = Paths::BVH::Detail::BVHTree<Paths::Shape::Triangle>;
+
+TEST(bvh, partitioners) {
+    const auto triangles = BVHTest::make_triangle_soup(4096);
+    const auto rays = BVHTest::make_rays(2048);
+    const auto linear = BVHTest::make_linear_store(triangles);
+
+    for (auto type : { Paths::BVH::EPartitionType::Middle, Paths::BVH::EPartitionType::Median,
+             Paths::BVH::EPartitionType::BinnedSAH }) {
+        TriangleTree tree { std::vector(triangles) };
+        tree.root().split(22, 4, type);
+
+        const auto stats = tree.root().get_statistics();
+        EXPECT_EQ(stats.m_node_count, stats.m_leaf_count * 2 - 1);
+        EXPECT_LE(stats.m_max_depth, 22);
+        EXPECT_GT(stats.m_sah_cost, 0);
+
+        EXPECT_TRUE(BVHTest::same_hits(*linear, tree, rays));
+    }
+}
+
+TEST(bvh, sah_cost) {
+    const auto triangles = BVHTest::make_triangle_soup(4096);
+
+    TriangleTree middle { std::vector(triangles) };
+    middle.root().split(22, 4, Paths::BVH::EPartitionType::Middle);
+
+    TriangleTree sah { std::vector(triangles) };
+    sah.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+
+    TriangleTree unsplit { std::vector(triangles) };
+
+    EXPECT_LT(sah.root().get_statistics().m_sah_cost, unsplit.root().get_statistics().m_sah_cost);
+    EXPECT_LE(sah.root().get_statistics().m_sah_cost, middle.root().get_statistics().m_sah_cost);
+}
+
+TEST(bvh, parallel_build) {
+    // large enough for the root and its children to take the parallel paths
+    const auto triangles = BVHTest::make_triangle_soup(65536);
+
+    for (auto type : { Paths::BVH::EPartitionType::Middle, Paths::BVH::EPartitionType::BinnedSAH }) {
+        TriangleTree serial { std::vector(triangles) };
+        serial.build(22, 4, type, Paths::BVH::Detail::default_duplication_budget, false);
+
+        // the nodes of both subtrees of the root get made in the same arena at once
+        TriangleTree parallel { std::vector(triangles) };
+        parallel.build(22, 4, type, Paths::BVH::Detail::default_duplication_budget, true);
+
+        const auto serial_stats = serial.get_statistics();
+        const auto parallel_stats = parallel.get_statistics();
+        EXPECT_EQ(serial_stats.m_node_count, parallel_stats.m_node_count);
+        EXPECT_EQ(serial_stats.m_max_depth, parallel_stats.m_max_depth);
+        EXPECT_EQ(serial_stats.m_sah_cost, parallel_stats.m_sah_cost);
+        EXPECT_GT(parallel_stats.m_build_seconds, 0);
+        EXPECT_GE(parallel_stats.m_node_memory_bytes, parallel_stats.m_node_count * sizeof(TriangleTree::node_t));
+        EXPECT_GT(parallel_stats.m_peak_resident_bytes, 0);
+
+        // the shapes of the root are all in its descendants by now, the leaves have to match one by one
+        const auto serial_leaves = BVHTest::leaf_centers(serial);
+        const auto parallel_leaves = BVHTest::leaf_centers(parallel);
+        ASSERT_EQ(serial_leaves.size(), serial_stats.m_leaf_count);
+        ASSERT_EQ(serial_leaves.size(), parallel_leaves.size());
+        for (std::size_t i = 0; i < serial_leaves.size(); i++) {
+            ASSERT_EQ(serial_leaves[i].size(), parallel_leaves[i].size());
+            for (std::size_t j = 0; j < serial_leaves[i].size(); j++)
+                for (std::size_t k = 0; k < 3; k++)
+                    ASSERT_EQ(serial_leaves[i][j][k], parallel_leaves[i][j][k]);
+        }
+    }
+}
+
+TEST(bvh, wide) {
+    const auto triangles = BVHTest::make_triangle_soup(4096);
+    const auto rays = BVHTest::make_rays(2048);
+    const auto linear = BVHTest::make_linear_store(triangles);
+
+    TriangleTree tree { std::vector(triangles) };
+    tree.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+
+    const Paths::BVH::Detail::WideBVH<Paths::Shape::Triangle, 4> wide_4 { tree };
+    const Paths::BVH::Detail::WideBVH<Paths::Shape::Triangle, 8> wide_8 { tree };
+
+    EXPECT_EQ(wide_4.total_shape_count(), triangles.size());
+    EXPECT_EQ(wide_8.total_shape_count(), triangles.size());
+    EXPECT_LT(wide_8.node_count(), wide_4.node_count());
+
+    EXPECT_TRUE(BVHTest::same_hits(*linear, wide_4, rays));
+    EXPECT_TRUE(BVHTest::same_hits(*linear, wide_8, rays));
+}
+
+TEST(bvh, morton) {
+    // large enough for the emission to take the parallel paths
+    const auto triangles = BVHTest::make_triangle_soup(16384);
+    const auto rays = BVHTest::make_rays(2048);
+    const auto linear = BVHTest::make_linear_store(triangles);
+
+    TriangleTree tree { std::vector(triangles) };
+    tree.root().split(64, 4, Paths::BVH::EPartitionType::Morton);
+
+    const auto stats = tree.root().get_statistics();
+    EXPECT_EQ(stats.m_node_count, stats.m_leaf_count * 2 - 1);
+    EXPECT_LE(stats.m_max_leaf_shapes, 4);
+    EXPECT_TRUE(BVHTest::same_hits(*linear, tree, rays));
+
+    tree.root().optimise_treelets();
+
+    const auto optimised_stats = tree.root().get_statistics();
+    EXPECT_EQ(optimised_stats.m_leaf_count, stats.m_leaf_count);
+    EXPECT_LT(optimised_stats.m_sah_cost, stats.m_sah_cost);
+    EXPECT_TRUE(BVHTest::same_hits(*linear, tree, rays));
+
+    const Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle> thin { tree };
+    const Paths::BVH::Detail::ThreadedBVH<Paths::Shape::Triangle, true> threaded_mt { tree };
+    EXPECT_TRUE(BVHTest::same_hits(*linear, thin, rays));
+    EXPECT_TRUE(BVHTest::same_hits(*linear, threaded_mt, rays));
+}
+
+TEST(bvh, spatial_splits) {
+    // the soup along with long slivers crossing the whole of it diagonally
+    auto triangles = BVHTest::make_triangle_soup(4096);
+    for (std::size_t i = 0; i < 64; i++) {
+        const auto offset = static_cast<Paths::Real>(i) * .3 - 9.6;
+        triangles.emplace_back(4096 + i,
+            std::array<Paths::Point, 3> { Paths::Point(-10, -10, offset), Paths::Point(10, 10, offset),
+                Paths::Point(10, 10.2, offset + .1) });
+    }
+    const auto rays = BVHTest::make_rays(2048);
+    const auto linear = BVHTest::make_linear_store(triangles);
+
+    TriangleTree binned { std::vector(triangles) };
+    binned.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+
+    TriangleTree spatial { std::vector(triangles) };
+    spatial.root().split_spatial(22, 4, .3);
+
+    const auto binned_stats = binned.root().get_statistics();
+    const auto stats = spatial.root().get_statistics();
+    EXPECT_EQ(binned_stats.m_reference_count, triangles.size());
+    EXPECT_GT(stats.m_reference_count, triangles.size());
+    EXPECT_LE(stats.m_reference_count, triangles.size() + triangles.size() * 3 / 10);
+    EXPECT_LT(stats.m_sah_cost, binned_stats.m_sah_cost);
+
+    const Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle> thin { spatial };
+    const Paths::BVH::Detail::WideBVH<Paths::Shape::Triangle> wide { spatial };
+
+    EXPECT_TRUE(BVHTest::same_hits(*linear, spatial, rays));
+    EXPECT_TRUE(BVHTest::same_hits(*linear, thin, rays));
+    EXPECT_TRUE(BVHTest::same_hits(*linear, wide, rays));
+    EXPECT_TRUE(BVHTest::same_occlusion(*linear, spatial, rays));
+    EXPECT_TRUE(BVHTest::same_occlusion(*linear, thin, rays));
+
+    // no budget means no duplicates
+    TriangleTree no_budget { std::vector(triangles) };
+    no_budget.root().split_spatial(22, 4, 0);
+    EXPECT_EQ(no_budget.root().get_statistics().m_reference_count, triangles.size());
+}
+
+TEST(bvh, refit) {
+    const auto triangles = BVHTest::make_triangle_soup(4096);
+    const auto rays = BVHTest::make_rays(2048);
+
+    // rigid motions keep the cost the same, moving every triangle around does not
+    const Paths::Matrix identity { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+    const auto move = [&identity](const Paths::Shape::Triangle &t) { return t.transformed(identity, { 1, 2, -3 }); };
+    const auto scatter = [&identity](const Paths::Shape::Triangle &t) {
+        // pseudo random offsets in [-5, 5) that only depend on the triangle
+        const auto noise = [](Paths::Real v) { return (v * 4375.85 - std::floor(v * 4375.85) - .5) * 10; };
+        const auto [x, y, z] = t.m_center.impl_data();
+        return t.transformed(identity, { noise(y), noise(z), noise(x) });
+    };
+
+    std::vector<Paths::Shape::Triangle> moved {};
+    std::vector<Paths::Shape::Triangle> scattered {};
+    for (const auto &t : triangles) {
+        moved.push_back(move(t));
+        scattered.push_back(scatter(moved.back()));
+    }
+    const auto moved_linear = BVHTest::make_linear_store(moved);
+    const auto scattered_linear = BVHTest::make_linear_store(scattered);
+
+    auto check = [&](auto &store, auto &&transform) {
+        transform(move);
+        EXPECT_NEAR(store.refit(), 1, 1e-3);
+        EXPECT_TRUE(BVHTest::same_hits(*moved_linear, store, rays));
+
+        transform(scatter);
+        EXPECT_GT(store.refit(), 1.1);
+        EXPECT_TRUE(BVHTest::same_hits(*scattered_linear, store, rays));
+    };
+
+    TriangleTree tree { std::vector(triangles) };
+    tree.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+    Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle> thin { tree };
+    Paths::BVH::Detail::ThreadedBVH<Paths::Shape::Triangle, false> threaded { tree };
+    Paths::BVH::Detail::ThreadedBVH<Paths::Shape::Triangle, true> threaded_mt { tree };
+    Paths::BVH::Detail::WideBVH<Paths::Shape::Triangle> wide { tree };
+
+    check(tree, [&tree](auto &&fn) { tree.transform_shapes(fn); });
+    check(thin, [&thin](auto &&fn) { thin.transformShapes(fn); });
+    check(threaded, [&threaded](auto &&fn) { threaded.transform_shapes(fn); });
+    check(threaded_mt, [&threaded_mt](auto &&fn) { threaded_mt.transform_shapes(fn); });
+    check(wide, [&wide](auto &&fn) { wide.transform_shapes(fn); });
+}
+
+TEST(bvh, instancing) {
+    const auto triangles = BVHTest::make_triangle_soup(1024);
+    const auto rays = BVHTest::make_rays(2048);
+
+    TriangleTree tree { std::vector(triangles) };
+    tree.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+    const auto thin = std::make_shared<Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle>>(tree);
+
+    // scaled down, rotated and sheared copies on a 3x3x3 grid, the same shapes moved one by one as the reference
+    Paths::BVH::TopLevelBVH top_level {};
+    std::vector<Paths::Shape::Triangle> moved {};
+    for (std::size_t i = 0; i < 27; i++) {
+        const Paths::Real angle = static_cast<Paths::Real>(i) * .7;
+        const Paths::Real scale = .2 + static_cast<Paths::Real>(i % 4) * .05;
+        const Paths::Matrix transform { std::cos(angle) * scale, -std::sin(angle) * scale, 0,
+            std::sin(angle) * scale, std::cos(angle) * scale, 0, .1, 0, scale };
+        const Paths::Point offset { static_cast<Paths::Real>(i % 3) * 7 - 7,
+            static_cast<Paths::Real>(i / 3 % 3) * 7 - 7, static_cast<Paths::Real>(i / 9) * 7 - 7 };
+
+        top_level.insert_instance({ .m_store = thin, .m_transform = transform, .m_offset = offset });
+        for (const auto &t : triangles)
+            moved.push_back(t.transformed(transform, offset));
+    }
+
+    // an instance of an empty store is ignored, one of an unbounded store is tested against every ray
+    auto unbounded = std::make_shared<Paths::LinearShapeStore<>>();
+    unbounded->insert_shape(Paths::Shape::Plane(1024, { 0, -9, 0 }, { 0, 1, 0 }));
+    top_level.insert_instance({ .m_store = std::make_shared<Paths::LinearShapeStore<>>() });
+    top_level.insert_instance({ .m_store = unbounded });
+    top_level.build();
+
+    std::vector<Paths::Shape::Shape> reference_shapes(moved.begin(), moved.end());
+    reference_shapes.emplace_back(Paths::Shape::Plane(1024, { 0, -9, 0 }, { 0, 1, 0 }));
+    const auto reference = BVHTest::make_linear_store(reference_shapes);
+
+    EXPECT_EQ(top_level.instance_count(), 29);
+    EXPECT_FALSE(top_level.get_extents().has_value());
+    EXPECT_TRUE(BVHTest::same_hits(*reference, top_level, rays));
+    EXPECT_TRUE(BVHTest::same_occlusion(*reference, top_level, rays));
+
+    // a store that was empty at one build and got shapes since is not left out of the next one
+    auto empty = std::make_shared<Paths::LinearShapeStore<>>();
+    Paths::BVH::TopLevelBVH filled_later {};
+    filled_later.insert_instance({ .m_store = empty });
+    filled_later.build();
+
+    empty->insert_shape(Paths::Shape::Plane(1025, { 0, -9, 0 }, { 0, 1, 0 }));
+    filled_later.build();
+
+    std::size_t bound_checks = 0, shape_checks = 0;
+    const Paths::Ray down { { 0, 0, 0 }, { 0, -1, 0 } };
+    const auto isect = filled_later.intersect_ray(down, bound_checks, shape_checks);
+    ASSERT_TRUE(isect.has_value());
+    EXPECT_EQ(isect->m_mat_index, 1025);
+    EXPECT_TRUE(filled_later.occluded(down, 10, bound_checks, shape_checks));
+    EXPECT_FALSE(filled_later.get_extents().has_value());
+}
+
+TEST(bvh, scene_hierarchy) {
+    const auto triangles = BVHTest::make_triangle_soup(4096);
+    const auto rays = BVHTest::make_rays(2048);
+
+    // the soup split into 64 stores, along with a store of a plane
+    Paths::Scene scene {};
+    for (std::size_t start = 0; start < triangles.size(); start += 64) {
+        const std::vector part(triangles.begin() + start, triangles.begin() + start + 64);
+        TriangleTree tree { std::vector(part) };
+        tree.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+        scene.insert_store(std::make_shared<Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle>>(tree));
+    }
+
+    auto planes = std::make_shared<Paths::LinearShapeStore<>>();
+    planes->insert_shape(Paths::Shape::Plane(4096, { 0, -9, 0 }, { 0, 1, 0 }));
+    scene.insert_store(planes);
+
+    std::vector<Paths::Shape::Shape> reference_shapes(triangles.begin(), triangles.end());
+    reference_shapes.emplace_back(Paths::Shape::Plane(4096, { 0, -9, 0 }, { 0, 1, 0 }));
+    const auto reference = BVHTest::make_linear_store(reference_shapes);
+
+    EXPECT_TRUE(BVHTest::same_hits(*reference, scene, rays));
+    EXPECT_TRUE(BVHTest::same_occlusion(*reference, scene, rays));
+
+    std::size_t bound_checks = 0, shape_checks = 0;
+    std::array<std::optional<Paths::Intersection>, Paths::ShapeStore::m_packet_size> isects;
+    for (std::size_t start = 0; start < rays.size(); start += Paths::ShapeStore::m_packet_size) {
+        const auto packet = std::span(rays).subspan(start, Paths::ShapeStore::m_packet_size);
+        scene.intersect_packet(packet, isects, bound_checks, shape_checks);
+
+        for (std::size_t i = 0; i < packet.size(); i++) {
+            const auto expected = reference->intersect_ray(packet[i], bound_checks, shape_checks);
+            ASSERT_EQ(expected.has_value(), isects[i].has_value());
+            if (!expected)
+                continue;
+            EXPECT_NEAR(expected->m_distance, isects[i]->m_distance, 0.0001);
+        }
+    }
+
+    // stores inserted after tracing rays show up in the rebuilt hierarchy
+    const Paths::Ray ray { { 0, 0, -30 }, { 0, 0, 1 } };
+    auto sphere = std::make_shared<Paths::LinearShapeStore<>>();
+    sphere->insert_shape(Paths::Shape::Sphere(4097, { 0, 0, -25 }, 1));
+    scene.insert_store(sphere);
+
+    const auto isect = scene.intersect_ray(ray, bound_checks, shape_checks);
+    ASSERT_TRUE(isect.has_value());
+    EXPECT_EQ(isect->m_mat_index, 4097);
+    EXPECT_NEAR(isect->m_distance, 4, 0.0001);
+
+    // and so do stores that get refitted, however deep down the scene they are, without invalidating anything by hand
+    TriangleTree far_tree { std::vector { Paths::Shape::Triangle(4098, { Paths::Point(100, -1, -28),
+                                              Paths::Point(100, 1, -28), Paths::Point(102, 0, -28) }) } };
+    auto far = std::make_shared<Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle>>(far_tree);
+    auto group = std::make_shared<Paths::LinearShapeStore<>>();
+    group->insert_child(far);
+    scene.insert_store(group);
+    EXPECT_EQ(scene.intersect_ray(ray, bound_checks, shape_checks)->m_mat_index, 4097);
+
+    const Paths::Matrix identity { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+    far->transformShapes([&](const Paths::Shape::Triangle &t) { return t.transformed(identity, { -101, 0, 0 }); });
+    far->refit();
+
+    const auto moved_isect = scene.intersect_ray(ray, bound_checks, shape_checks);
+    ASSERT_TRUE(moved_isect.has_value());
+    EXPECT_EQ(moved_isect->m_mat_index, 4098);
+    EXPECT_NEAR(moved_isect->m_distance, 2, 0.0001);
+}
+
+TEST(bvh, flattened) {
+    const auto triangles = BVHTest::make_triangle_soup(4096);
+    const auto rays = BVHTest::make_rays(2048);
+    const auto linear = BVHTest::make_linear_store(triangles);
+
+    TriangleTree tree { std::vector(triangles) };
+    tree.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+
+    const Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle> thin { tree };
+    const Paths::BVH::Detail::ThreadedBVH<Paths::Shape::Triangle, false> threaded { tree };
+    const Paths::BVH::Detail::ThreadedBVH<Paths::Shape::Triangle, true> threaded_mt { tree };
+
+    EXPECT_TRUE(BVHTest::same_hits(*linear, thin, rays));
+    EXPECT_TRUE(BVHTest::same_hits(*linear, threaded, rays));
+    EXPECT_TRUE(BVHTest::same_hits(*linear, threaded_mt, rays));
+}
+
+TEST(bvh, cache) {
+    using ThinTree = Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle>;
+    using ThreadedTree = Paths::BVH::Detail::ThreadedBVH<Paths::Shape::Triangle, true>;
+
+    const auto triangles = BVHTest::make_triangle_soup(4096);
+    const auto rays = BVHTest::make_rays(2048);
+    const auto linear = BVHTest::make_linear_store(triangles);
+
+    TriangleTree tree { std::vector(triangles) };
+    tree.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+
+    ThinTree thin { tree };
+    ThreadedTree threaded { tree };
+
+    const auto directory = std::filesystem::temp_directory_path();
+    const auto thin_path = (directory / "paths_test_thin.bvh").string();
+    const auto threaded_path = (directory / "paths_test_threaded.bvh").string();
+
+    ASSERT_TRUE(Paths::BVH::Cache::save(thin, 1234, thin_path));
+    ASSERT_TRUE(Paths::BVH::Cache::save(threaded, 1234, threaded_path));
+
+    const auto loaded_thin = Paths::BVH::Cache::load<ThinTree>(1234, thin_path);
+    const auto loaded_threaded = Paths::BVH::Cache::load<ThreadedTree>(1234, threaded_path);
+    ASSERT_NE(loaded_thin, nullptr);
+    ASSERT_NE(loaded_threaded, nullptr);
+    EXPECT_TRUE(BVHTest::same_hits(*linear, *loaded_thin, rays));
+    EXPECT_TRUE(BVHTest::same_hits(*linear, *loaded_threaded, rays));
+    EXPECT_TRUE(BVHTest::same_occlusion(*linear, *loaded_threaded, rays));
+
+    // stores write the same bytes every time, no padding that happens to be in memory ends up in the files
+    const auto serialised = [](auto &store) {
+        Paths::BVH::Cache::Writer writer {};
+        writer(store);
+        return std::vector(writer.data().begin(), writer.data().end());
+    };
+    EXPECT_EQ(serialised(thin), serialised(*loaded_thin));
+    EXPECT_EQ(serialised(threaded), serialised(*loaded_threaded));
+
+    // other keys, other store types and truncated files are not loaded
+    EXPECT_EQ(Paths::BVH::Cache::load<ThinTree>(4321, thin_path), nullptr);
+    EXPECT_EQ(Paths::BVH::Cache::load<ThreadedTree>(1234, thin_path), nullptr);
+    std::filesystem::resize_file(threaded_path, std::filesystem::file_size(threaded_path) - 1);
+    EXPECT_EQ(Paths::BVH::Cache::load<ThreadedTree>(1234, threaded_path), nullptr);
+
+    std::filesystem::remove(thin_path);
+    std::filesystem::remove(threaded_path);
+}
+
+TEST(bvh, occlusion) {
+    const auto triangles = BVHTest::make_triangle_soup(4096);
+    const auto rays = BVHTest::make_rays(2048);
+    const auto linear = BVHTest::make_linear_store(triangles);
+
+    TriangleTree tree { std::vector(triangles) };
+    tree.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+
+    const Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle> thin { tree };
+    const Paths::BVH::Detail::ThreadedBVH<Paths::Shape::Triangle, true> threaded { tree };
+    const Paths::BVH::Detail::WideBVH<Paths::Shape::Triangle> wide { tree };
+
+    EXPECT_TRUE(BVHTest::same_occlusion(*linear, *linear, rays));
+    EXPECT_TRUE(BVHTest::same_occlusion(*linear, tree, rays));
+    EXPECT_TRUE(BVHTest::same_occlusion(*linear, thin, rays));
+    EXPECT_TRUE(BVHTest::same_occlusion(*linear, threaded, rays));
+    EXPECT_TRUE(BVHTest::same_occlusion(*linear, wide, rays));
+}
+
+TEST(bvh, triangle_leaves) {
+    const auto triangles = BVHTest::make_triangle_soup(4096);
+    const auto rays = BVHTest::make_rays(2048);
+
+    // leaves of odd sizes so that the blocks get padded
+    Paths::BVH::Detail::LeafStore<Paths::Shape::Triangle> blocked;
+    std::vector<Paths::BVH::Detail::LeafStore<Paths::Shape::Triangle>::range_t> ranges;
+    for (std::size_t start = 0, size = 1; start < triangles.size(); start += size, size = size % 7 + 1) {
+        const auto end = std::min(start + size, triangles.size());
+        ranges.push_back(blocked.append(std::span(triangles.begin() + start, triangles.begin() + end)));
+    }
+
+    EXPECT_EQ(blocked.size(), triangles.size());
+
+    for (const auto &ray : rays) {
+        const auto expected = Paths::Shape::intersect_linear(ray, triangles.cbegin(), triangles.cend());
+
+        Paths::Hit hit {};
+        for (const auto &range : ranges)
+            blocked.closest_hit(ray, range, hit);
+
+        ASSERT_EQ(expected.has_value(), hit.m_primitive != Paths::Hit::m_npos);
+        if (!expected)
+            continue;
+
+        const auto actual = blocked.surface_at(ray, hit);
+
+        EXPECT_EQ(expected->m_mat_index, actual.m_mat_index);
+        EXPECT_NEAR(expected->m_distance, actual.m_distance, 0.0001);
+        EXPECT_NEAR(expected->m_uv[0], actual.m_uv[0], 0.0001);
+        EXPECT_NEAR(expected->m_uv[1], actual.m_uv[1], 0.0001);
+
+        const auto occluded = [&](Paths::Real t_max) {
+            return std::any_of(
+                ranges.begin(), ranges.end(), [&](auto range) { return blocked.occluded(ray, t_max, range); });
+        };
+        EXPECT_FALSE(occluded(expected->m_distance * .5));
+        EXPECT_TRUE(occluded(expected->m_distance * 2));
+    }
+}
+
+TEST(bvh, degenerate_leaves) {
+    // a triangle with all of its vertices at one spot is a real triangle, not padding, and has to be moved and bounded
+    const Paths::Point spot { 1, 2, 3 };
+    Paths::BVH::Detail::LeafStore<Paths::Shape::Triangle> blocked;
+    const auto range = blocked.append(std::vector { Paths::Shape::Triangle(0, { spot, spot, spot }) });
+
+    const Paths::Matrix identity { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+    const Paths::Point offset { -4, 5, 6 };
+    blocked.transform([&](const Paths::Shape::Triangle &t) { return t.transformed(identity, offset); }, false);
+
+    const auto [min, max] = blocked.extents(range);
+    for (std::size_t axis = 0; axis < 3; axis++) {
+        EXPECT_LE(min[axis], spot[axis] + offset[axis]);
+        EXPECT_GE(max[axis], spot[axis] + offset[axis]);
+        EXPECT_LT(max[axis] - min[axis], 0.01);
+    }
+}
+
+TEST(bvh, watertight) {
+    // far from the origin, where the ulps are not that small next to the triangles
+    const Paths::Point center(3000, -2000, 1000);
+    const auto triangles = BVHTest::make_sphere_mesh(center, 10, 32, 64);
+
+    TriangleTree tree { std::vector(triangles) };
+    tree.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+    const Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle> thin { tree };
+    const Paths::BVH::Detail::WideBVH<Paths::Shape::Triangle> wide { tree };
+
+    // rays from inside aimed right at the vertices and the middles of the edges, where the neighbours meet
+    const Paths::Point origin = center + Paths::Point(1.25, -2.5, .75);
+    std::vector<Paths::Ray> rays;
+    for (const auto &triangle : triangles) {
+        const auto &vertices = triangle.get_vertices();
+        for (std::size_t i = 0; i < 3; i++) {
+            for (const auto target : { vertices[i], Paths::Point((vertices[i] + vertices[(i + 1) % 3]) / 2) })
+                rays.emplace_back(origin, Maths::normalized(target - origin));
+        }
+    }
+
+    std::size_t bound_checks = 0, shape_checks = 0;
+    for (const auto *store : std::initializer_list<const Paths::ShapeStore *> { &thin, &wide }) {
+        std::size_t misses = 0, self_hits = 0;
+
+        for (const auto &ray : rays) {
+            const auto isect = store->intersect_ray(ray, bound_checks, shape_checks);
+            if (!isect) {
+                misses++;
+                continue;
+            }
+
+            // a reflection off of the inside of a convex mesh cannot hit the same triangle
+            const Paths::Ray reflected(
+                isect->offset_origin(), Paths::Detail::reflect_vector(ray.m_direction, isect->m_oriented_normal));
+            const auto next = store->intersect_ray(reflected, bound_checks, shape_checks);
+            if (!next)
+                misses++;
+            else if (next->m_mat_index == isect->m_mat_index)
+                self_hits++;
+        }
+
+        EXPECT_EQ(misses, 0);
+        EXPECT_EQ(self_hits, 0);
+    }
+}
+
+TEST(bvh, deferred_surface) {
+    const auto triangles = BVHTest::make_triangle_soup(1024);
+    const auto rays = BVHTest::make_rays(2048);
+
+    std::vector<Paths::Shape::BoundableShape> shapes(triangles.begin(), triangles.end());
+    for (std::size_t i = 0; i < 64; i++)
+        shapes.emplace_back(Paths::Shape::Sphere(triangles.size() + i, triangles[i * 16].m_center, .5));
+
+    Paths::BVH::Detail::BVHTree<> tree { std::vector(shapes) };
+    tree.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+    const Paths::BVH::Detail::ThinBVHTree<> thin { tree };
+
+    std::size_t bound_checks = 0, shape_checks = 0;
+    for (const auto &ray : rays) {
+        // the eagerly built intersections of every shape
+        std::optional<Paths::Intersection> expected {};
+        for (const auto &shape : shapes) {
+            auto isect = std::visit([&ray](const auto &s) { return s.intersect_ray(ray); }, shape);
+            if (isect && isect->m_distance > 0 && (!expected || isect->m_distance < expected->m_distance))
+                expected = isect;
+        }
+
+        for (const auto *store : std::initializer_list<const Paths::ShapeStore *> { &tree, &thin }) {
+            const auto actual = store->intersect_ray(ray, bound_checks, shape_checks);
+            ASSERT_EQ(expected.has_value(), actual.has_value());
+            if (!expected)
+                continue;
+
+            EXPECT_EQ(expected->m_mat_index, actual->m_mat_index);
+            EXPECT_NEAR(expected->m_distance, actual->m_distance, 0.0001);
+            EXPECT_NEAR(expected->m_uv[0], actual->m_uv[0], 0.0001);
+            EXPECT_NEAR(expected->m_uv[1], actual->m_uv[1], 0.0001);
+        }
+    }
+}
+
+TEST(bvh, leaf_shading) {
+    // the flattened stores read the shading of the closest hit out of arrays kept apart from what gets tested against
+    // rays, which has to give what the triangles work out on their own
+    const auto triangles = BVHTest::make_triangle_soup(4096);
+    const auto rays = BVHTest::make_rays(2048);
+
+    TriangleTree tree { std::vector(triangles) };
+    tree.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+
+    const Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle> thin { tree };
+    const Paths::BVH::Detail::ThreadedBVH<Paths::Shape::Triangle, false> threaded { tree };
+    const Paths::BVH::Detail::ThreadedBVH<Paths::Shape::Triangle, true> threaded_mt { tree };
+    const Paths::BVH::Detail::WideBVH<Paths::Shape::Triangle> wide { tree };
+
+    std::size_t bound_checks = 0, shape_checks = 0;
+    for (const auto &ray : rays) {
+        std::optional<Paths::Intersection> expected {};
+        for (const auto &triangle : triangles) {
+            auto isect = triangle.intersect_ray(ray);
+            if (isect && isect->m_distance > 0 && (!expected || isect->m_distance < expected->m_distance))
+                expected = isect;
+        }
+
+        for (const auto *store : std::initializer_list<const Paths::ShapeStore *> {
+                 &tree, &thin, &threaded, &threaded_mt, &wide }) {
+            const auto actual = store->intersect_ray(ray, bound_checks, shape_checks);
+            ASSERT_EQ(expected.has_value(), actual.has_value());
+            if (!expected)
+                continue;
+
+            ASSERT_EQ(expected->m_mat_index, actual->m_mat_index);
+            EXPECT_EQ(expected->m_going_in, actual->m_going_in);
+            EXPECT_NEAR(expected->m_distance, actual->m_distance, 0.0001);
+            EXPECT_NEAR(expected->m_uv[0], actual->m_uv[0], 0.0001);
+            EXPECT_NEAR(expected->m_uv[1], actual->m_uv[1], 0.0001);
+            for (std::size_t i = 0; i < 3; i++) {
+                EXPECT_NEAR(expected->m_normal[i], actual->m_normal[i], 0.0001);
+                EXPECT_NEAR(expected->m_intersection_point[i], actual->m_intersection_point[i], 0.0001);
+            }
+        }
+    }
+}
+
+TEST(bvh, packets) {
+    const auto triangles = BVHTest::make_triangle_soup(4096);
+
+    TriangleTree tree { std::vector(triangles) };
+    tree.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+
+    const Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle> thin { tree };
+    const Paths::BVH::Detail::WideBVH<Paths::Shape::Triangle> wide { tree };
+
+    // a pinhole camera looking at the soup through a 64x64 grid, traced in 8x8 packets and in a ragged last packet
+    std::vector<Paths::Ray> rays;
+    for (std::size_t y = 0; y < 64; y++) {
+        for (std::size_t x = 0; x < 64; x++) {
+            const Paths::Point target { static_cast<Paths::Real>(x) / 3.2 - 10, static_cast<Paths::Real>(y) / 3.2 - 10,
+                0 };
+            rays.emplace_back(Paths::Point(0, 0, -30), Maths::normalized(target - Paths::Point(0, 0, -30)));
+        }
+    }
+    const auto incoherent = BVHTest::make_rays(61);
+
+    std::size_t bound_checks = 0, shape_checks = 0;
+    for (const auto *store : std::initializer_list<const Paths::ShapeStore *> { &tree, &thin, &wide }) {
+        std::array<std::optional<Paths::Intersection>, Paths::ShapeStore::m_packet_size> isects;
+
+        for (std::size_t start = 0; start <= rays.size(); start += Paths::ShapeStore::m_packet_size) {
+            const auto packet = start == rays.size() ? std::span(incoherent)
+                                                     : std::span(rays).subspan(start, Paths::ShapeStore::m_packet_size);
+            store->intersect_packet(packet, std::span(isects).first(packet.size()), bound_checks, shape_checks);
+
+            for (std::size_t i = 0; i < packet.size(); i++) {
+                const auto expected = store->intersect_ray(packet[i], bound_checks, shape_checks);
+                ASSERT_EQ(expected.has_value(), isects[i].has_value());
+                if (!expected)
+                    continue;
+                EXPECT_EQ(expected->m_mat_index, isects[i]->m_mat_index);
+                EXPECT_NEAR(expected->m_distance, isects[i]->m_distance, 0.0001);
+            }
+        }
+    }
+}
@@ -0,0 +1,173 @@
+#include <gtest/gtest.h>
+
+#include "Paths/Integrator/Sampler/MonteCarlo.hpp"
+#include "Paths/Integrator/Wavefront.hpp"
+#include "bvh_utils.hpp"
+
+/// A camera at the origin looking down +z without any depth of field
+static Paths::Camera make_camera(std::size_t width, std::size_t height) {
+    Paths::Camera camera {};
+    camera.m_resolution = { width, height };
+    camera.m_fov_hint = 45;
+    camera.m_focal_distance = 1;
+    camera.m_aperture_diameter = 0;
+    camera.set_look_at({ 0, 0, 1 });
+    return camera;
+}
+
+/// The average of the images of n_renders renders, per channel
+static Paths::Color average_of_renders(Paths::Integrator &integrator, std::size_t n_renders) {
+    Paths::Color sum { 0, 0, 0 };
+    std::size_t n_pixels = 0;
+
+    for (std::size_t i = 0; i < n_renders; i++) {
+        integrator.do_render();
+        const auto image = integrator.get_image();
+        for (const auto &color : image)
+            sum = sum + color;
+        n_pixels += image.size();
+    }
+
+    return sum / static_cast<Paths::ColorChannelType>(n_pixels);
+}
+
+TEST(integrator, wavefront_pixels) {
+    // a red half-plane on the left and a green one on the right that face the camera and absorb everything, so every
+    // path is done after its first hit and has the colour of the side its pixel is on
+    Paths::Scene scene {};
+    scene.insert_material({ .m_emittance = { 1, 0, 0 } });
+    scene.insert_material({ .m_emittance = { 0, 1, 0 } });
+    scene.insert_store(BVHTest::make_linear_store(std::vector {
+        Paths::Shape::Triangle(0, { Paths::Point(0, 1e4, 10), Paths::Point(0, -1e4, 10), Paths::Point(-1e4, 0, 10) }),
+        Paths::Shape::Triangle(1, { Paths::Point(0, -1e4, 10), Paths::Point(0, 1e4, 10), Paths::Point(1e4, 0, 10) }),
+    }));
+
+    // more pixels than fit in one wave, and neither side a multiple of the tiles the camera rays are made in
+    constexpr std::size_t width = 517, height = 515;
+    static_assert(width * height > Paths::WavefrontIntegrator::m_max_wave_size);
+
+    Paths::WavefrontIntegrator wavefront {};
+    wavefront.set_camera(make_camera(width, height));
+    wavefront.set_scene(&scene);
+    wavefront.do_render();
+
+    // there is a path for every pixel, so with none of the pixels left out none got written twice either
+    const auto image = wavefront.get_image();
+    ASSERT_EQ(image.size(), width * height);
+
+    for (std::size_t y = 0; y < height; y++) {
+        for (std::size_t x = 0; x < width; x++) {
+            // camera rays are jittered by up to a pixel, the ones next to the middle can end up on either side
+            if (x + 2 >= width / 2 && x <= width / 2 + 2)
+                continue;
+
+            const Paths::Color expected = x < width / 2 ? Paths::Color { 1, 0, 0 } : Paths::Color { 0, 1, 0 };
+            for (std::size_t i = 0; i < 3; i++)
+                ASSERT_EQ(image.at(x, y)[i], expected[i]) << "at " << x << ", " << y;
+        }
+    }
+}
+
+TEST(integrator, wavefront_matches_monte_carlo) {
+    // the inside of a dim mirror sphere, paths keep bouncing until the roulette ends them, so how much light gets
+    // gathered depends on when and how often paths are terminated
+    std::vector<Paths::Shape::Triangle> triangles {};
+    for (const auto &triangle : BVHTest::make_sphere_mesh({ 0, 0, 0 }, 10, 16, 32)) {
+        auto vertices = triangle.get_vertices();
+        if (Maths::dot(triangle.m_normal, vertices[0]) > 0)
+            std::swap(vertices[1], vertices[2]);
+        triangles.emplace_back(0, vertices);
+    }
+
+    Paths::BVH::Detail::BVHTree<Paths::Shape::Triangle> tree { std::move(triangles) };
+    tree.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+
+    Paths::Scene scene {};
+    scene.insert_material({ .m_reflectance = 1, .m_albedo = { .9, .9, .9 }, .m_emittance = { .1, .1, .1 } });
+    scene.insert_store(std::make_shared<Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle>>(tree));
+
+    Paths::MonteCarloIntegrator monte_carlo {};
+    monte_carlo.set_camera(make_camera(32, 32));
+    monte_carlo.set_scene(&scene);
+
+    Paths::WavefrontIntegrator wavefront {};
+    wavefront.set_camera(make_camera(32, 32));
+    wavefront.set_scene(&scene);
+
+    const auto expected = average_of_renders(monte_carlo, 16);
+    const auto actual = average_of_renders(wavefront, 16);
+
+    // just the first nine hits would gather .1 * (1 - .9^9) / (1 - .9)
+    EXPECT_GT(expected[0], .6);
+    for (std::size_t i = 0; i < 3; i++)
+        EXPECT_NEAR(expected[i], actual[i], expected[i] * .02);
+}
+
+TEST(integrator, wavefront_sort_queue) {
+    using Wavefront = Paths::WavefrontIntegrator;
+
+    // a queue in no particular order, the ith path being for the ith ray
+    const auto rays = BVHTest::make_rays(10000);
+    std::vector<Wavefront::PathState> paths(rays.size());
+    for (std::size_t i = 0; i < paths.size(); i++) {
+        paths[i].m_pixel = static_cast<std::uint32_t>(i);
+        paths[i].m_throughput = Paths::Color(1, 2, 3) * static_cast<Paths::ColorChannelType>(i);
+    }
+
+    auto sorted_rays = rays;
+    auto sorted_paths = paths;
+    Wavefront::SortScratch scratch {};
+    Wavefront::sort_queue(sorted_rays, sorted_paths, scratch);
+
+    ASSERT_EQ(sorted_rays.size(), rays.size());
+    ASSERT_EQ(sorted_paths.size(), paths.size());
+
+    std::vector<bool> seen(paths.size(), false);
+    for (std::size_t i = 0; i < sorted_paths.size(); i++) {
+        const auto pixel = sorted_paths[i].m_pixel;
+        ASSERT_LT(pixel, paths.size());
+        ASSERT_FALSE(seen[pixel]);
+        seen[pixel] = true;
+
+        for (std::size_t j = 0; j < 3; j++) {
+            ASSERT_EQ(sorted_rays[i].m_origin[j], rays[pixel].m_origin[j]);
+            ASSERT_EQ(sorted_rays[i].m_direction[j], rays[pixel].m_direction[j]);
+            ASSERT_EQ(sorted_paths[i].m_throughput[j], paths[pixel].m_throughput[j]);
+        }
+    }
+
+    // the rays end up grouped by their major directions
+    for (std::size_t i = 1; i < sorted_rays.size(); i++)
+        ASSERT_LE(sorted_rays[i - 1].m_major_direction, sorted_rays[i].m_major_direction);
+}
+
+TEST(integrator, node_cache_misses) {
+    using Wavefront = Paths::WavefrontIntegrator;
+
+    Paths::BVH::Detail::BVHTree<Paths::Shape::Triangle> tree { BVHTest::make_triangle_soup(65536) };
+    tree.root().split(22, 4, Paths::BVH::EPartitionType::BinnedSAH);
+    const Paths::BVH::Detail::ThinBVHTree<Paths::Shape::Triangle> thin { tree };
+
+    auto rays = BVHTest::make_rays(20000);
+    std::vector<Wavefront::PathState> paths(rays.size());
+    const auto shuffled_rays = rays;
+    Wavefront::SortScratch scratch {};
+    Wavefront::sort_queue(rays, paths, scratch);
+
+    const auto trace = [&thin](const std::vector<Paths::Ray> &queue) {
+        Paths::BVH::NodeCacheModel model {};
+        model.record([&] {
+            std::size_t bound_checks = 0, shape_checks = 0;
+            for (const auto &ray : queue)
+                static_cast<void>(thin.intersect_ray(ray, bound_checks, shape_checks));
+        });
+        return model;
+    };
+
+    // the same nodes get fetched in either order, sorted rays find more of them still in the cache
+    const auto shuffled = trace(shuffled_rays);
+    const auto sorted = trace(rays);
+    EXPECT_EQ(shuffled.m_fetches, sorted.m_fetches);
+    EXPECT_GT(shuffled.m_misses, 0);
+    EXPECT_LT(sorted.m_misses, shuffled.m_misses);
+}
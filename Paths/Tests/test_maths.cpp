@@ -1,5 +1,8 @@
 #include <gtest/gtest.h>
 
+#include <vector>
+
+#include "Maths/Hilbert.hpp"
 #include "maths_utils.hpp"
 
 TEST(maths, vecops) {
@@ -15,3 +18,25 @@ TEST(maths, vecops) {
 TEST(maths, matops) { }
 
 TEST(maths, matvecops) { }
+
+TEST(maths, hilbert) {
+    constexpr std::uint32_t side = 64;
+    std::vector<bool> visited(side * side, false);
+
+    auto previous = Maths::hilbert_2d_point(side, 0);
+    for (std::uint64_t d = 0; d < side * side; d++) {
+        const auto [x, y] = Maths::hilbert_2d_point(side, d);
+        ASSERT_LT(x, side);
+        ASSERT_LT(y, side);
+        EXPECT_FALSE(visited[y * side + x]);
+        visited[y * side + x] = true;
+
+        // every step is to a neighbouring cell
+        if (d != 0) {
+            const auto distance = (x > previous.first ? x - previous.first : previous.first - x)
+                + (y > previous.second ? y - previous.second : previous.second - y);
+            EXPECT_EQ(distance, 1);
+        }
+        previous = { x, y };
+    }
+}
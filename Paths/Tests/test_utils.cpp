@@ -0,0 +1,57 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "Utils/ThreadPool.hpp"
+
+TEST(utils, thread_pool_nesting) {
+    Utils::ThreadPool pool { 4 };
+
+    // loops within loops within loops, every innermost task counted once
+    std::atomic<std::size_t> count = 0;
+    pool.run(8, [&](std::size_t) {
+        pool.run(8, [&](std::size_t) { pool.run(8, [&](std::size_t) { ++count; }); });
+    });
+
+    EXPECT_EQ(count, 8 * 8 * 8);
+}
+
+TEST(utils, thread_pool_helping) {
+    using namespace std::chrono_literals;
+
+    Utils::ThreadPool pool { 2 };
+    const auto main_id = std::this_thread::get_id();
+
+    // the worker takes the second task of the main thread's loop and holds it while another thread starts a loop of
+    // its own, the main thread has nothing to do but wait in the meantime
+    std::atomic<bool> second_started = false;
+    std::atomic<bool> ran_on_main = false;
+
+    std::thread other([&] {
+        while (!second_started)
+            std::this_thread::yield();
+
+        pool.run(4, [&](std::size_t) {
+            if (std::this_thread::get_id() == main_id)
+                ran_on_main = true;
+            std::this_thread::sleep_for(20ms);
+        });
+    });
+
+    pool.run(2, [&](std::size_t i) {
+        if (i == 0) {
+            while (!second_started)
+                std::this_thread::yield();
+        } else {
+            second_started = true;
+            std::this_thread::sleep_for(200ms);
+        }
+    });
+
+    other.join();
+
+    // the tasks of the unrelated loop are left to the other threads
+    EXPECT_FALSE(ran_on_main);
+}
@@ -30,8 +30,14 @@ end
 local clock = Clock:new(nil)
 
 local Configuration = {
-    integrator = "stat",
-    flatteningMethod = 0, -- no flattening, thin, threaded, multiple threaded
+    integrator = "stat", -- stat, albedo, whitted, pt, wavefront
+    sortRays = false, -- whether the wavefront integrator sorts secondary rays before tracing them
+    modelNodeCache = false, -- whether the wavefront integrator counts L1 misses of BVH nodes, slows secondary rays down
+    flatteningMethod = 0, -- no flattening, thin, threaded, multiple threaded, wide
+    partitioner = "middle", -- middle, median, sah, morton, spatial
+    duplicationBudget = 0.3, -- how many extra shape references spatial splits may make, relative to the shape count
+    optimiseTreelets = false, -- restructures the tree after building, recovers the quality lost with morton
+    bvhCache = false, -- loads thin, threaded and multiple threaded BVHs from cache/ instead of building them
     treeDepth = 13,
     treeMinShapes = 8,
     samplesToTake = 16,
@@ -40,6 +46,8 @@ local Configuration = {
     outputFile = true,
     normaliseOutput = false,
     outFilename = "",
+    tileTimes = false, -- prints tile scheduling statistics, exports the seconds spent per tile next to the output
+    threads = 0, -- threads shared by rendering, averaging, exporting and BVH builds, 0 for one per core
 }
 
 function Configuration:new(o)
@@ -48,7 +56,13 @@ function Configuration:new(o)
 
     self.__index = self
     self.integrator = "stat"
+    self.sortRays = false
+    self.modelNodeCache = false
     self.flatteningMethod = 0
+    self.partitioner = "middle"
+    self.duplicationBudget = 0.3
+    self.optimiseTreelets = false
+    self.bvhCache = false
     self.treeDepth = 13
     self.treeMinShapes = 8
     self.samplesToTake = 16
@@ -57,6 +71,7 @@ function Configuration:new(o)
     self.outputFile = true
     self.normaliseOutput = false
     self.outFilename = ""
+    self.tileTimes = false
 
     return o
 end
@@ -78,6 +93,10 @@ local Statistics = {
     timeConstruct = 0,
     timeFlatten = 0,
     timeRender = 0,
+    sahCost = 0,
+    referenceCount = 0,
+    nodeMemory = 0,
+    peakResidentMemory = 0,
 }
 
 function Statistics:new(o)
@@ -89,6 +108,10 @@ function Statistics:new(o)
     o.timeConstruct = 0
     o.timeFlatten = 0
     o.timeRender = 0
+    o.sahCost = 0
+    o.referenceCount = 0
+    o.nodeMemory = 0
+    o.peakResidentMemory = 0
 
     return o
 end
@@ -97,6 +120,7 @@ local function doLog(conf, stats)
     print(
             conf.integrator .. "," ..
                     conf.flatteningMethod .. "," ..
+                    conf.partitioner .. "," ..
                     conf.treeDepth .. "," ..
                     conf.treeMinShapes .. "," ..
                     conf.samplesToTake .. "," ..
@@ -104,26 +128,44 @@ local function doLog(conf, stats)
                     stats.timeLoad .. "," ..
                     stats.timeConstruct .. "," ..
                     stats.timeFlatten .. "," ..
-                    stats.timeRender
+                    stats.timeRender .. "," ..
+                    stats.sahCost .. "," ..
+                    stats.referenceCount .. "," ..
+                    stats.nodeMemory .. "," ..
+                    stats.peakResidentMemory
     )
 end
 
 local modelToLoad = 0
-local model
+local modelFilename
+local modelSTLOffset = point.new({ 0, 0, 0 })
+local modelTransform
 if modelToLoad == 0 then
-    model = store.newLinearTriFromSTL(
-            "objects/teapot.stl",
-            0,
-            point.new({ 0, 0, 0 }),
-            matrix.newDegRotation(-180, -90, 0) * (matrix.newIdentity() * 0.25)
-    )
+    modelFilename = "objects/teapot.stl"
+    modelTransform = matrix.newDegRotation(-180, -90, 0) * (matrix.newIdentity() * 0.25)
 elseif modelToLoad == 1 then
-    model = store.newLinearTriFromSTL(
-            "objects/Stanford_Bunny.stl",
-            0,
-            point.new({ 0, 0, 0 }),
-            matrix.newDegRotation(-180, -90, 0) * (matrix.newIdentity() * 0.0325)
-    )
+    modelFilename = "objects/Stanford_Bunny.stl"
+    modelTransform = matrix.newDegRotation(-180, -90, 0) * (matrix.newIdentity() * 0.0325)
+end
+
+-- parsed by the first render that builds a BVH, ones that load their BVH from the cache do not need the triangles
+local model
+local function getModel()
+    if model == nil then
+        model = store.newLinearTriFromSTL(modelFilename, 0, modelSTLOffset, modelTransform)
+    end
+    return model
+end
+
+-- a cache is only reused if the model and everything that shapes its BVH are the same
+local function getCachedBVHKey(conf)
+    return store.bvhCacheKey(modelFilename, 0, modelSTLOffset, modelTransform,
+            conf.flatteningMethod .. "," ..
+                    conf.partitioner .. "," ..
+                    conf.duplicationBudget .. "," ..
+                    tostring(conf.optimiseTreelets) .. "," ..
+                    conf.treeDepth .. "," ..
+                    conf.treeMinShapes)
 end
 
 local function doRender(conf)
@@ -179,6 +221,8 @@ local function doRender(conf)
         end
     end
 
+    paths.setThreadCount(conf.threads)
+
     local stats = Statistics:new()
 
     local origin = point.new({ 0, 0, 0 })
@@ -192,22 +236,50 @@ local function doRender(conf)
     local scene0 = scene.new()
     addMaterialsToScene(scene0)
 
-    clock:reset()
-    stats.timeLoad = clock:elapsed()
+    local cacheKey
+    local cachePath
+    local lModel
+    if conf.bvhCache and conf.flatteningMethod >= 1 and conf.flatteningMethod <= 3 then
+        cacheKey = getCachedBVHKey(conf)
+        if cacheKey ~= nil then
+            cachePath = "cache/" .. cacheKey .. ".bvh"
+            clock:reset()
+            lModel = store.loadBVHCache(cachePath, cacheKey)
+            stats.timeLoad = clock:elapsed()
+        end
+    end
 
-    clock:reset()
-    local lModel = model:makeBVHTreeTri(conf.treeDepth, conf.treeMinShapes)
-    stats.timeConstruct = clock:elapsed()
+    if lModel == nil then
+        local triangles = getModel()
+        clock:reset()
+        lModel = triangles:makeBVHTreeTri(conf.treeDepth, conf.treeMinShapes, conf.partitioner, conf.duplicationBudget)
+        if conf.optimiseTreelets then
+            lModel:optimiseTreelets()
+        end
+        stats.timeConstruct = clock:elapsed()
+        local buildStats = lModel:buildStats()
+        stats.sahCost = buildStats.sahCost
+        stats.referenceCount = buildStats.referenceCount
+        stats.nodeMemory = buildStats.nodeMemory
+        stats.peakResidentMemory = buildStats.peakResidentMemory
+
+        clock:reset()
+        if conf.flatteningMethod == 1 then
+            lModel:toThinBVH()
+        elseif conf.flatteningMethod == 2 then
+            lModel:toTBVH()
+        elseif conf.flatteningMethod == 3 then
+            lModel:toMTBVH()
+        elseif conf.flatteningMethod == 4 then
+            lModel:toWideBVH()
+        end
+        stats.timeFlatten = clock:elapsed()
 
-    clock:reset()
-    if conf.flatteningMethod == 1 then
-        lModel:toThinBVH()
-    elseif conf.flatteningMethod == 2 then
-        lModel:toTBVH()
-    elseif conf.flatteningMethod == 3 then
-        lModel:toMTBVH()
+        if cachePath ~= nil then
+            posix.mkdir("cache") -- fails harmlessly if it exists
+            lModel:saveBVHCache(cachePath, cacheKey)
+        end
     end
-    stats.timeFlatten = clock:elapsed()
 
     local unboundableStore = store.newLinear()
     --linearStore:insertPlane(scene0:resolveMaterial("mirror"), origin + mirrorOffset, point.new({ 0, 0, -1 }))
@@ -244,7 +316,13 @@ local function doRender(conf)
     cam.apertureDiameter = 0.75
     cam:setLookAt(origin + modelOffset + point.new({ 0, 2, 0 }))
 
-    local integ = integrator.newSamplerWrapper(conf.integrator)
+    local integ
+    if conf.integrator == "wavefront" then
+        integ = integrator.newWavefront(conf.sortRays)
+        integ:setModelNodeCache(conf.modelNodeCache)
+    else
+        integ = integrator.newSamplerWrapper(conf.integrator)
+    end
     integ:wrapInAverager()
     integ:setCamera(cam)
     integ:setScene(scene0)
@@ -261,6 +339,23 @@ local function doRender(conf)
     end
     stats.timeRender = clock:elapsed()
 
+    local rayStats = integ:getRayStatistics()
+    if rayStats then
+        print("secondary rays: " .. rayStats.rays .. ", " .. rayStats:mraysPerSecond() .. " Mrays/s, " ..
+                rayStats:boundChecksPerRay() .. " bound checks per ray, " ..
+                rayStats:nodeMissesPerRay() .. " node cache misses per ray, " ..
+                rayStats.sortSeconds .. "s sorting")
+    end
+
+    local tileStats = integ:getTileStatistics()
+    if tileStats and conf.tileTimes then
+        print(tileStats.tiles / tileStats.renders .. " tiles per sample, " ..
+                tileStats.steals / tileStats.renders .. " stolen per sample, slowest took " ..
+                tileStats.slowestTileSeconds * 1000 .. "ms, threads idle " ..
+                tileStats:idleFraction() * 100 .. "% of the time")
+        integ:getTileTimes():export(string.gsub(conf:getOutFilename(), "%.exr$", "_tiles.exr"), "exrf32")
+    end
+
     if conf.outputFile then
         if conf.normaliseOutput then
             local img = image.new(integ:getImageView())
@@ -294,7 +389,7 @@ if benchmark then
     conf.normaliseOutput = true
     conf.outFilename = ""
 
-    for method = 0, 3, 1 do
+    for method = 0, 4, 1 do
         conf.flatteningMethod = method
         for depth = 12, 22, 1 do
             conf.treeDepth = depth